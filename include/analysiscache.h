@@ -0,0 +1,131 @@
+/**
+ * Persistent on-disk cache of code analysis results.
+ *
+ * Date: 10/17/2026
+ */
+
+#ifndef _ANALYSISCACHE_H
+#define _ANALYSISCACHE_H
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "arch.h"
+#include "types.h"
+
+namespace chameleon {
+
+/**
+ * class AnalysisCache
+ *
+ * Save & restore the results of analyzing a binary's functions so subsequent
+ * launches of the same binary can skip disassembling & analyzing every
+ * function.  Results are stored in a single versioned file per binary, named
+ * by a key that should hash everything the analysis depends on (code,
+ * transformation metadata, blacklisted functions, etc).  The file also records
+ * the binary's size & modification time, so results are only reused for the
+ * same file on disk.  The file is mapped read-only when loaded and functions
+ * are only parsed when looked up.
+ *
+ * Note: DynamoRIO's instructions & the stack regions built from metadata can't
+ * be serialized.  Instead the cache stores the inputs needed to rebuild them
+ * cheaply: the transformation points, the slot restrictions (in the order
+ * they were discovered) and the boundaries of the instruction runs.
+ */
+class AnalysisCache {
+public:
+  /* Analysis results for a single function */
+  struct Function {
+    std::vector<std::pair<uintptr_t, RandomizedFunction::TransformType>>
+      transformAddrs;
+    std::vector<RandRestriction> restrictions;
+    std::vector<urange_t> runs;
+  };
+
+  /**
+   * Construct a cache for a binary.  Does not touch the filesystem; users
+   * must call load() to read in previous results.
+   *
+   * @param dir directory in which cache files are stored
+   * @param key hash identifying the binary & analysis inputs
+   * @param binary path of the binary being analyzed
+   */
+  AnalysisCache(const char *dir, uint64_t key, const char *binary);
+  AnalysisCache() = delete;
+  AnalysisCache(const AnalysisCache &rhs) = delete;
+  ~AnalysisCache();
+
+  /**
+   * Map the cache file & index the functions it contains.  Fails if the file
+   * doesn't exist or was written by a different version, for a different key
+   * or for a binary whose size or modification time differ.
+   *
+   * @return a return code describing the outcome
+   */
+  ret_t load();
+
+  /**
+   * Return whether a cache file was successfully loaded.
+   * @return true if loaded or false otherwise
+   */
+  bool loaded() const { return data != nullptr; }
+
+  /**
+   * Return the time it took to originally analyze the binary, as recorded in
+   * the loaded cache file.
+   * @return analysis time in microseconds or 0 if no cache was loaded
+   */
+  uint64_t getAnalysisTime() const { return analysisTime; }
+
+  /**
+   * Look up a function's analysis results in the loaded cache file.
+   *
+   * @param addr the function's address
+   * @param func output analysis results
+   * @return true if the function was found or false otherwise
+   */
+  bool lookup(uintptr_t addr, Function &func) const;
+
+  /**
+   * Record a function's analysis results to be written by store().
+   *
+   * @param addr the function's address
+   * @param func the function's analysis results
+   */
+  void record(uintptr_t addr, Function &&func)
+  { recorded[addr] = std::move(func); }
+
+  /**
+   * Write all recorded functions to the cache file, replacing any existing
+   * file.  The file is written to a temporary & renamed into place so
+   * concurrent launches never observe a partially-written cache.
+   *
+   * @param analysisTime time taken to analyze the functions in microseconds
+   * @return a return code describing the outcome
+   */
+  ret_t store(uint64_t analysisTime);
+
+  /* Return the cache file's name */
+  const std::string &getFilename() const { return filename; }
+
+private:
+  std::string filename;
+  uint64_t key, analysisTime;
+
+  /* Binary being analyzed, whose identity is checked against the file */
+  const char *binary;
+
+  /* Mapped cache file & offsets of each function's record */
+  void *data;
+  size_t size;
+  std::unordered_map<uintptr_t, size_t> index;
+
+  /* Functions to be written out, sorted by address */
+  std::map<uintptr_t, Function> recorded;
+};
+
+}
+
+#endif /* _ANALYSISCACHE_H */
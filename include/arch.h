@@ -128,6 +128,13 @@ uintptr_t sp(const struct user_regs_struct &regs);
  */
 void sp(struct user_regs_struct &regs, uintptr_t newSP);
 
+/**
+ * Extract the frame pointer from a register set.
+ * @param regs a register set
+ * @return the frame pointer's value
+ */
+uintptr_t fp(const struct user_regs_struct &regs);
+
 /**
  * Return the system call number from a register set.
  * @param regs a previously-populated register set
@@ -135,6 +142,23 @@ void sp(struct user_regs_struct &regs, uintptr_t newSP);
  */
 long syscallNumber(const struct user_regs_struct &regs);
 
+/**
+ * Return the number of hardware breakpoints available to each thread.
+ * @return the number of hardware breakpoints
+ */
+size_t numHardwareBreakpoints();
+
+/**
+ * Return the user area writes (see PTRACE_POKEUSER) needed to set hardware
+ * instruction breakpoints at the given addresses, or to disable all hardware
+ * breakpoints if no addresses are given.  Writes must be applied in order.
+ *
+ * @param addrs breakpoint addresses, at most numHardwareBreakpoints()
+ * @param writes output argument populated with user area offsets & values
+ */
+void hardwareBreakpointRegs(const std::vector<uintptr_t> &addrs,
+                            std::vector<std::pair<size_t, uint64_t>> &writes);
+
 /**
  * Marshal the given arguments into the register set for a function call.
  * @param regs a register set
@@ -181,6 +205,13 @@ uint32_t alignFrameSize(uint32_t size);
  */
 int32_t framePointerOffset();
 
+/**
+ * Return the canonicalized offset of the return address in a function's
+ * original (non-randomized) stack frame.
+ * @return the return address' canonicalized offset
+ */
+int32_t returnAddressOffset();
+
 ///////////////////////////////////////////////////////////////////////////////
 // Randomization implementation
 ///////////////////////////////////////////////////////////////////////////////
@@ -199,13 +230,17 @@ RandomizedFunctionPtr getRandomizedFunction(const Binary &binary,
                                             MemoryWindow &window);
 
 /**
- * Rewrite the child's stack according to the newly-randomized code.
+ * Rewrite a thread's stack according to the newly-randomized code.  Doesn't
+ * touch the child, so stacks of multiple threads can be transformed
+ * concurrently; callers read & write the thread's registers and stack.
  *
  * @param CT a CodeTransformer object containing randomization metadata
  * @param callback function called by transformation runtime to read
  *                 transformation metadata
  * @param meta transformation metadata handle
  * @param isReturn true if we stopped at a return instruction
+ * @param regs the thread's current registers, set to the transformed
+ *             registers (including the top of the transformed stack)
  * @param childSrcBase address of source stack's base in child's address space
  * @param bufSrcBase address of source stack's base in chameleon's address
  *                   space
@@ -213,18 +248,17 @@ RandomizedFunctionPtr getRandomizedFunction(const Binary &binary,
  *                     space
  * @param bufDstBase address of destination stack's base in chameleon's address
  *                   space
- * @param newSP output argument set to top of transformed stack
  * @return a return code describing the outcome
  */
 ret_t transformStack(CodeTransformer *CT,
                      get_rand_info callback,
                      st_handle meta,
                      bool isReturn,
+                     struct user_regs_struct &regs,
                      uintptr_t childSrcBase,
                      uintptr_t bufSrcBase,
                      uintptr_t childDstBase,
-                     uintptr_t bufDstBase,
-                     uintptr_t &newSp);
+                     uintptr_t bufDstBase);
 
 /**
  * Call the stack transformation runtime with the current stack in order to
@@ -326,6 +360,19 @@ bool getFrameUpdateRestriction(instr_t *instr,
  */
 ret_t rewriteFrameUpdate(instr_t *instr, int32_t newSize, bool &changed);
 
+/**
+ * Find where a stack slot reference's displacement is encoded in an
+ * instruction so that later randomizations can patch it in place rather than
+ * re-encoding the instruction.
+ *
+ * @param instr the instruction, with raw bits set to its current encoding
+ * @param disp the reference's current displacement
+ * @param width output argument set to the size of the encoded displacement
+ * @return offset of the displacement from the start of the instruction or -1
+ *         if it can't be patched in place
+ */
+int32_t getDisplacementOffset(instr_t *instr, int32_t disp, uint32_t &width);
+
 }
 }
 
@@ -330,6 +330,14 @@ public:
    */
   unwind_iterator getUnwindLocations(const function_record *func) const;
 
+  /**
+   * Hash the code section & transformation metadata.  Any change to the code
+   * or metadata changes the hash, so it can be used to identify results
+   * derived from them, e.g., cached code analysis.
+   * @return a hash of the code & transformation metadata
+   */
+  uint64_t hashCodeAndMetadata() const;
+
 private:
   /* Raw file access */
   const char *filename;
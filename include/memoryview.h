@@ -12,6 +12,7 @@
 #include <memory>
 #include <vector>
 #include <cstdint>
+#include <pthread.h>
 
 #include "types.h"
 #include "utils.h"
@@ -62,6 +63,19 @@ public:
   virtual byte_iterator getData(uintptr_t address)
   { return byte_iterator::empty(); }
 
+  /**
+   * Get an iterator to the underlying data store at a given address which is
+   * safe to write up to len bytes.  Regions which share their backing store
+   * with other regions must make a private copy of the range before handing
+   * it out.
+   *
+   * @param addr a program virtual address
+   * @param len number of bytes that will be written
+   * @return an iterator for accessing the underlying data
+   */
+  virtual byte_iterator getWritableData(uintptr_t address, size_t len)
+  { return getData(address); }
+
   /* Comparison types & functions for sorting */
   static bool compare(const std::unique_ptr<MemoryRegion> &lhs,
                       const std::unique_ptr<MemoryRegion> &rhs)
@@ -195,6 +209,202 @@ private:
   std::unique_ptr<unsigned char[]> data;
 };
 
+/**
+ * class PagePool
+ *
+ * A pool of page-sized blocks backed by an in-memory file.  Blocks are
+ * reference counted so that several CowRegions can map the same physical page
+ * into their views.  Blocks whose last reference is dropped are recycled for
+ * later allocations.
+ */
+class PagePool {
+public:
+  PagePool();
+  ~PagePool();
+
+  /**
+   * Allocate contiguous blocks, recycling a run of previously-freed blocks if
+   * possible.  Each block has a reference count of one.  Blocks are
+   * zero-filled unless recycled, in which case their contents are undefined.
+   *
+   * @param num number of blocks to allocate
+   * @return index of the first block or -1 if the pool could not be grown
+   */
+  ssize_t allocate(size_t num);
+
+  /**
+   * Allocate a single block, recycling a previously-freed block if possible.
+   * The block's contents are undefined.
+   *
+   * @return index of the block or -1 if the pool could not be grown
+   */
+  ssize_t allocate();
+
+  /**
+   * Add a reference to each of the blocks.
+   * @param blocks block indexes
+   */
+  void get(const std::vector<size_t> &blocks);
+
+  /**
+   * Drop a reference to a block, recycling it if it was the last.
+   * @param block a block index
+   */
+  void put(size_t block);
+  void put(const std::vector<size_t> &blocks);
+
+  /**
+   * Return whether a block is only referenced by a single region, i.e., it
+   * can be written in place.
+   * @param block a block index
+   * @return true if there is a single reference or false otherwise
+   */
+  bool exclusive(size_t block);
+
+  /**
+   * Field getters - return what you ask for.
+   */
+  int getFd() const { return fd; }
+
+private:
+  /* In-memory file backing the blocks */
+  int fd;
+
+  /* Number of blocks handed out so far & number of blocks in the file */
+  size_t numBlocks, capacity;
+
+  /* Per-block reference counts & blocks which can be recycled */
+  std::vector<size_t> refCount;
+  std::vector<size_t> freeBlocks;
+
+  pthread_mutex_t lock;
+
+  /**
+   * Grow the file so it has room for at least num blocks.  Must be called
+   * with the lock held.
+   * @param num number of blocks
+   * @return true if the file has room or false otherwise
+   */
+  bool reserve(size_t num);
+};
+
+/**
+ * class CowRegion
+ *
+ * Holds the data representing the memory region in page-sized blocks from a
+ * PagePool, mapped contiguously into a private view.  Copying the region only
+ * maps the same blocks into a new view; a page is duplicated the first time
+ * it's handed out for writing via getWritableData().  Use for regions that are
+ * copied often but of which only a fraction is modified, e.g., the code
+ * section across re-randomizations.
+ *
+ * Each run of consecutive blocks occupies a separate mapping.  Copies of views
+ * fragmented by many duplicated pages copy the data into contiguous blocks
+ * rather than sharing them to bound the number of mappings.
+ */
+class CowRegion : public MemoryRegion {
+public:
+  /**
+   * Instantiate a copy-on-write MemoryRegion.  Blocks are allocated from a
+   * new pool, the on-disk data is copied into them and the rest is
+   * zero-initialized.
+   *
+   * @param start starting address of region
+   * @param len length of region in bytes
+   * @param fileLen length of on-disk portion of memory region; truncated to
+   *                match len if larger
+   * @param data byte iterator to on-disk data previously mapped into memory
+   */
+  CowRegion(uintptr_t start, size_t len, size_t fileLen, byte_iterator data);
+  ~CowRegion();
+
+  /**
+   * Create a copy of this memory region.  The copy shares all of its pages
+   * with this region until they're written.
+   * @return a copy of the MemoryRegion object
+   */
+  virtual MemoryRegion *copy() const;
+
+  /**
+   * Populate the buffer with the region's memory.
+   * @param address the starting address to copy into the buffer
+   * @param buffer buffer to populate with region's memory
+   * @param offset starting offset within buffer
+   * @return number of bytes copied into buffer
+   */
+  virtual size_t populate(uintptr_t address,
+                          std::vector<char> &buffer,
+                          size_t offset) const override;
+
+  /**
+   * Get an iterator to the underlying data store at a given address.  The
+   * data may be shared with other regions and must not be written.
+   * @param addr a program virtual address
+   * @return an iterator for accessing the underlying data
+   */
+  virtual byte_iterator getData(uintptr_t address) override;
+
+  /**
+   * Get an iterator to the underlying data store at a given address,
+   * duplicating any shared pages overlapping [address, address + len).
+   * @param addr a program virtual address
+   * @param len number of bytes that will be written
+   * @return an iterator for accessing the underlying data
+   */
+  virtual byte_iterator getWritableData(uintptr_t address,
+                                        size_t len) override;
+
+private:
+  CowRegion(const CowRegion &rhs);
+
+  /* Pool from which blocks are allocated, shared between copies */
+  std::shared_ptr<PagePool> pool;
+
+  /* Page-aligned start of the view & the view itself */
+  uintptr_t pageStart;
+  unsigned char *view;
+
+  /* Pool block backing each page of the view */
+  std::vector<size_t> blocks;
+
+  /* Number of runs of consecutive blocks, i.e., mappings in the view */
+  size_t runs;
+
+  /* Views with more runs than this are compacted when copied */
+  static const size_t maxViewRuns = 64;
+
+  /* Serializes duplicating pages, writers may share pages of the view */
+  pthread_mutex_t lock;
+
+  /**
+   * Map the region's blocks into a new view.
+   * @return true if the view was mapped or false otherwise
+   */
+  bool mapView();
+
+  /**
+   * Replace the region's blocks with contiguous blocks holding a copy of the
+   * data.  Doesn't map the new blocks.
+   * @param data data to copy into the new blocks
+   * @return true if the blocks were replaced or false otherwise
+   */
+  bool compact(const unsigned char *data);
+
+  /**
+   * Count discontinuities between a page's block & its neighbors' blocks.
+   * @param page index of the page in the view
+   * @return number of neighboring pages not backed by adjacent blocks
+   */
+  size_t breaksAround(size_t page) const;
+
+  /**
+   * Make a private copy of a page so that it can be written.
+   * @param page index of the page in the view
+   * @return true if the page can be written or false otherwise
+   */
+  bool unshare(size_t page);
+};
+
 /**
  * class MemoryWindow
  *
@@ -216,8 +426,8 @@ public:
 
   /**
    * Copy another memory window's memory regions.  Regions that are backed in
-   * memory are deep-copied, other regions (e.g., file-backed) are
-   * shallow-copied.
+   * memory are deep-copied, copy-on-write regions share their pages until
+   * written and other regions (e.g., file-backed) are shallow-copied.
    *
    * @param toCopy other memory region to copy
    */
@@ -281,6 +491,17 @@ public:
    */
   byte_iterator getData(uintptr_t address);
 
+  /**
+   * Get an iterator pointing to the data stored at a given address which can
+   * be used to modify up to len bytes.  Any pages shared with other windows
+   * are duplicated first, so writes are not visible through other windows.
+   *
+   * @param address a program virtual address
+   * @param len number of bytes that will be written
+   * @return an iterator for accessing the underlying data
+   */
+  byte_iterator getWritableData(uintptr_t address, size_t len);
+
   /**
    * Return the number of regions in the window.
    * @return the number of regions in the window
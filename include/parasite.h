@@ -12,9 +12,26 @@
 
 /* Commands & arguments for the parasite */
 #define GET_UFFD PARASITE_USER_CMDS
+#define SET_CODE_FD (PARASITE_USER_CMDS + 1)
+#define SYSCALL_BATCH (PARASITE_USER_CMDS + 2)
+
+/* Maximum number of system calls executed by a single SYSCALL_BATCH */
+#define MAX_BATCHED_SYSCALLS 64
+
+/* A system call executed by the parasite */
+struct parasiteSyscall {
+  long nr; /* system call number */
+  long args[6];
+  long ret; /* return value, set by the parasite */
+};
 
 union parasiteArgs {
   int uffd; /* GET_UFFD */
+  int codeFd; /* SET_CODE_FD */
+  struct {
+    unsigned long num; /* number of calls to execute/executed */
+    struct parasiteSyscall calls[MAX_BATCHED_SYSCALLS];
+  } batch; /* SYSCALL_BATCH */
 };
 
 /* Only include the C++ part for chameleon, not in the parasite */
@@ -64,6 +81,17 @@ ret_t infect(struct parasite_ctl *ctx, size_t nthreads);
  */
 int stealUFFD(struct parasite_ctl *ctx);
 
+/**
+ * Pass a file descriptor containing pre-rendered code from chameleon to the
+ * child.  The descriptor remains open in the child so that code can be mapped
+ * from it via system calls executed in the child's context.
+ *
+ * @param ctx a parasite control context
+ * @param fd chameleon's file descriptor
+ * @return the file descriptor in the child or -1 if it could not be passed
+ */
+int passCodeFD(struct parasite_ctl *ctx, int fd);
+
 /**
  * Cure the child's parasite.  Internally frees pointed-to ctx and sets its
  * storage to null, meaning it is no longer valid; users must get another
@@ -89,6 +117,20 @@ ret_t syscall(struct parasite_ctl *ctx, long syscall, long &sysRet,
               long a1 = 0, long a2 = 0, long a3 = 0,
               long a4 = 0, long a5 = 0, long a6 = 0);
 
+/**
+ * Execute several system calls in the context of the child process with a
+ * single command to the parasite.  Calls are executed in order and stop at
+ * the first failing call.  Note that the child must have previously been
+ * stopped & infected.
+ *
+ * @param ctx a parasite control context
+ * @param calls the system calls, return values are set upon completion
+ * @param num the number of system calls
+ * @return a return code describing the outcome
+ */
+ret_t syscalls(struct parasite_ctl *ctx, struct parasiteSyscall *calls,
+               size_t num);
+
 /**
  * Return the address at which compel will infect the child process.
  * @param ctx a pointer to a parasite control context pointer
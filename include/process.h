@@ -13,6 +13,7 @@
 #ifndef _PROCESS_H
 #define _PROCESS_H
 
+#include <vector>
 #include <semaphore.h>
 #include <sys/signal.h>
 #include <sys/types.h>
@@ -20,6 +21,7 @@
 #include "types.h"
 
 struct parasite_ctl;
+struct parasiteSyscall;
 
 namespace chameleon {
 
@@ -38,6 +40,23 @@ public:
   /* Size of stacks allocated by the OS by default */
   static size_t defaultStackSize;
 
+  /* Regions of child memory (address & local buffer) for vectored I/O */
+  typedef std::vector<std::pair<uintptr_t, byte_iterator>> RegionList;
+
+  /* A traced thread in the process */
+  struct Thread {
+    pid_t tid;
+    bool stopped; /* thread is at a trace-stop */
+    bool pending; /* an event consumed while stopping threads has yet to be
+                     reported by wait() */
+    int pendingStatus; /* wait status of the pending event */
+    urange_t stackBounds; /* usable region of the thread's stack */
+
+    Thread(pid_t tid, const urange_t &stackBounds)
+      : tid(tid), stopped(true), pending(false), pendingStatus(0),
+        stackBounds(stackBounds) {}
+  };
+
   /**
    * Construct a process object.  Initialize the process' command-line but
    * nothing else; users must call forkAndExec() to start the process.
@@ -51,8 +70,9 @@ public:
                                    stackBounds(0, 0), newTaskPid(-1),
                                    status(Ready), exit(0),
                                    stopReason(stop_t::Other),
-                                   reinjectSignal(false), uffd(-1),
-                                   nthreads(0), parasite(nullptr) {}
+                                   reinjectSignal(false), uffd(-1), tid(-1),
+                                   allStopped(false), regsTid(-1),
+                                   regsDirty(false), parasite(nullptr) {}
 
   /**
    * Construct a process object from an existing task.  Should be called when
@@ -68,7 +88,8 @@ public:
   Process(pid_t pid, int argc = 0, char **argv = nullptr)
     : argc(argc), argv(argv), pid(pid), newTaskPid(-1), status(Running),
       exit(0), stopReason(stop_t::Other), reinjectSignal(false), uffd(-1),
-      nthreads(0), parasite(nullptr) {}
+      tid(pid), allStopped(false), regsTid(-1), regsDirty(false),
+      parasite(nullptr) {}
   Process() = delete;
 
   /////////////////////////////////////////////////////////////////////////////
@@ -93,16 +114,98 @@ public:
   /**
    * Initialize the Process object for a newly-forked child process.  The child
    * should be trace-stopped at the fork event.
+   *
+   * @param stopped true if the child's initial stop was already reported to
+   *                the parent's Process object (see takeStrayStop())
+   * @return a return code describing the outcome
+   */
+  ret_t initForkedChild(bool stopped = false);
+
+  /**
+   * Attach to an already-running process, e.g., a long-lived service, whose
+   * PID was passed to the constructor.  Seizes & stops all of the process'
+   * threads and discovers their stacks.  Fails if the main thread uses more
+   * than half of its stack bounds or if another thread's frames can't be
+   * found by following its frame pointers.
+   *
+   * Note: the call returns with the process in the stopped state.  Users
+   * should call resume() or continue convenience functions to restart it.
+   *
    * @return a return code describing the outcome
    */
-  ret_t initForkedChild();
+  ret_t attachRunning();
 
   /**
-   * Trace a newly created thread.
+   * Trace a newly created thread.  The thread is automatically attached by
+   * ptrace when created; wait for its initial stop, record its stack and let
+   * it run.
+   *
    * @param pid the PID of the new thread
+   * @return a return code describing the outcome
    */
   ret_t traceThread(pid_t pid);
 
+  /**
+   * Return whether the initial stop of a newly-forked child was consumed while
+   * waiting for events from this process' threads, and forget about it.
+   *
+   * @param pid the PID of the forked child
+   * @return true if the child's initial stop was already consumed
+   */
+  bool takeStrayStop(pid_t pid);
+
+  /**
+   * Save an event for a task that isn't traced by any process object (yet),
+   * e.g., a forked child's initial stop reported before the fork event.  The
+   * event is claimed once the task's process object waits for it.
+   *
+   * @param task the task's ID
+   * @param wstatus the wait status
+   */
+  static void saveStrayEvent(pid_t task, int wstatus);
+
+  /**
+   * Wait for an event from any task traced by the calling thread.  Used by
+   * threads tracing several processes to wait for all of them at once; the
+   * event should be passed to the process owning the task via deliver().
+   *
+   * @param task output argument set to the task reporting the event, or -1
+   *             if not blocking & no event is available or if the wait was
+   *             interrupted by a signal
+   * @param wstatus output argument set to the wait status
+   * @param block whether to block until an event arrives
+   * @return a return code describing the outcome
+   */
+  static ret_t waitAny(pid_t &task, int &wstatus, bool block);
+
+  /**
+   * Return whether a task belongs to the process, i.e., is one of its threads
+   * including new threads that haven't reported their clone event.
+   * @param task the task's ID
+   * @return true if the task belongs to the process or false otherwise
+   */
+  bool ownsTask(pid_t task);
+
+  /**
+   * Update the process' status with an event returned by waitAny() for one of
+   * its tasks, exactly as if returned by wait().  Events which don't stop the
+   * process (e.g., new or exiting threads) leave the process running.
+   *
+   * @param task the task reporting the event
+   * @param wstatus the wait status
+   * @return a return code describing the outcome
+   */
+  ret_t deliver(pid_t task, int wstatus);
+
+  /**
+   * Update the process' status with any event consumed before it was resumed
+   * or while waiting for other tasks, without waiting for new events.  The
+   * process is left running if there are none.
+   *
+   * @return a return code describing the outcome
+   */
+  ret_t pollEvent();
+
   /**
    * Wait for a child event and update the process' status, which can be
    * queried via getStatus() after returning.
@@ -131,8 +234,9 @@ public:
   ret_t restoreInterrupt();
 
   /**
-   * Interrupt a child.  Users must call wait() in order to synchronize with
-   * the kernel's interrupt of the child.
+   * Interrupt a child, stopping all of its threads.  Returns with the main
+   * thread selected (see selectThread()).  Events consumed from other threads
+   * while stopping them are reported by subsequent calls to wait().
    *
    * @return a return code describing the outcome
    */
@@ -153,7 +257,9 @@ public:
    * either the next signal delivery or system call boundary (either going into
    * or coming out of kernel) by the child.  If type = SingleStep, execute a
    * single instruction.  Users must call wait() (even for single-stepping) in
-   * order to synchronize with child's next event.
+   * order to synchronize with child's next event.  The type applies to the
+   * selected thread; if interrupt() stopped all threads, the others are
+   * continued as well.
    *
    * @param type the type of continuation
    * @return a return code describing the outcome
@@ -214,6 +320,59 @@ public:
    */
   ret_t detachHandoff();
 
+  /////////////////////////////////////////////////////////////////////////////
+  // Per-thread control
+  /////////////////////////////////////////////////////////////////////////////
+
+  /*
+   * The following APIs operate on individual threads while the other threads
+   * remain stopped, e.g., to drive each thread to a particular location after
+   * interrupt().  Register & single-word memory APIs below act on the selected
+   * thread, which is the thread that most recently reported an event.
+   */
+
+  /**
+   * Select the thread targeted by register & memory APIs.  The thread must be
+   * stopped.
+   * @param tid the thread's ID
+   * @return a return code describing the outcome
+   */
+  ret_t selectThread(pid_t tid);
+
+  /**
+   * Resume a single stopped thread without resuming the others.  Users must
+   * call waitThreads() to synchronize with the thread's next stop.
+   *
+   * @param tid the thread's ID
+   * @param type the type of continuation
+   * @return a return code describing the outcome
+   */
+  ret_t resumeThread(pid_t tid, trace::resume_t type);
+
+  /**
+   * Wait for any thread resumed via resumeThread() to stop.  Signals & ptrace
+   * events are saved and reported by wait() after the process is resumed, so
+   * the application never loses them.
+   *
+   * @param tid output argument set to the thread that stopped or -1 if no
+   *            thread stopped before the timeout
+   * @param signal output argument set to the stop signal, or -1 if the thread
+   *               exited
+   * @param timeout maximum time to wait in microseconds
+   * @return a return code describing the outcome
+   */
+  ret_t waitThreads(pid_t &tid, int &signal, uint64_t timeout);
+
+  /**
+   * Interrupt a single running thread & wait for it to stop.
+   *
+   * @param tid the thread's ID
+   * @param signal output argument set to SIGTRAP if the thread hit a
+   *               breakpoint before the interrupt arrived, or 0 otherwise
+   * @return a return code describing the outcome
+   */
+  ret_t interruptThread(pid_t tid, int &signal);
+
   /////////////////////////////////////////////////////////////////////////////
   // Inspect & modify process state
   /////////////////////////////////////////////////////////////////////////////
@@ -228,7 +387,9 @@ public:
   status_t getStatus() const { return status; }
   void setStatus(status_t status) { this->status = status; }
   int getUserfaultfd() const { return uffd; }
-  size_t getNumThreads() const { return nthreads; }
+  size_t getNumThreads() const { return threads.size(); }
+  const std::vector<Thread> &getThreads() const { return threads; }
+  pid_t getSelectedThread() const { return tid; }
   struct parasite_ctl *getParasiteCtl() { return parasite; }
 
   /**
@@ -274,6 +435,12 @@ public:
    */
   bool stoppedAtSyscall() const { return getSignal() == SIGTRAP; }
 
+  /*
+   * General purpose registers of the selected thread are cached between
+   * stops.  Reads are served from the cache and writes only update the cache;
+   * modified registers are written back to the thread before it resumes.
+   */
+
   /**
    * Read general purpose registers.
    * @param regs a register set to be populated with the child's registers
@@ -328,6 +495,23 @@ public:
    */
   ret_t setSP(uintptr_t newSP) const;
 
+  /**
+   * Set hardware instruction breakpoints in the selected thread, replacing any
+   * previously set.  Hardware breakpoints trap before executing the
+   * instruction, so the program counter points at the breakpoint when stopped.
+   *
+   * @param addrs breakpoint addresses, at most arch::numHardwareBreakpoints()
+   * @return a return code describing the outcome
+   */
+  ret_t setHardwareBreakpoints(const std::vector<uintptr_t> &addrs) const;
+
+  /**
+   * Disable all hardware breakpoints in the selected thread.
+   * @return a return code describing the outcome
+   */
+  ret_t clearHardwareBreakpoints() const
+  { return setHardwareBreakpoints(std::vector<uintptr_t>()); }
+
   /**
    * Marshal a set of arguments into registers to invoke a function call
    * according to the ISA-specific calling convention.
@@ -353,6 +537,14 @@ public:
    */
   ret_t readRegion(uintptr_t addr, byte_iterator &buffer) const;
 
+  /**
+   * Read several regions of memory into buffers.  All regions are read with a
+   * single system call when possible.
+   * @param regions child addresses & buffers into which data is read
+   * @return a return code describing the outcome
+   */
+  ret_t readRegions(const RegionList &regions) const;
+
   /**
    * Print 8 bytes of data from child's memory.
    * @param addr the address to read
@@ -375,6 +567,14 @@ public:
    */
   ret_t writeRegion(uintptr_t addr, const byte_iterator &buffer) const;
 
+  /**
+   * Write several regions of memory from buffers to child memory.  All
+   * regions are written with a single system call when possible.
+   * @param regions child addresses & buffers of data to be written
+   * @return a return code describing the outcome
+   */
+  ret_t writeRegions(const RegionList &regions) const;
+
   /**
    * Get the system call number.  Caller must ensure Process trace-stopped.  If
    * not stopped at syscall-enter-stop (i.e., entering the kernel for the
@@ -400,6 +600,27 @@ public:
    */
   ret_t stealUserfaultfd();
 
+  /**
+   * Pass a file descriptor from Chameleon to the child, e.g., a file
+   * containing pre-rendered code.  The descriptor remains open in the child.
+   *
+   * @param fd Chameleon's file descriptor
+   * @param childFd output argument set to the descriptor in the child
+   * @return a return code describing the outcome
+   */
+  ret_t passCodeFile(int fd, int &childFd);
+
+  /**
+   * Execute a batch of system calls in the context of the child with a single
+   * command to the parasite rather than injecting each call individually.
+   * The child is infected for the duration of the batch.
+   *
+   * @param calls the system calls, return values are set upon completion
+   * @param num the number of system calls
+   * @return a return code describing the outcome
+   */
+  ret_t runSyscalls(struct parasiteSyscall *calls, size_t num);
+
 private:
   /* Arguments */
   int argc;
@@ -419,7 +640,12 @@ private:
   bool reinjectSignal; /* whether to re-inject signal into tracee */
   sigset_t intSet; /* signal mask when chameleon's thread was interrupted */
   int uffd; /* userfaultfd file descriptor */
-  size_t nthreads; /* number of threads in the process */
+  pid_t tid; /* selected thread, targeted by ptrace requests */
+  std::vector<Thread> threads; /* all traced threads, main thread first */
+  bool allStopped; /* all threads were stopped by interrupt() */
+  mutable struct user_regs_struct cachedRegs; /* cached registers */
+  mutable pid_t regsTid; /* thread whose registers are cached or -1 */
+  mutable bool regsDirty; /* cached registers must be written back */
   struct parasite_ctl *parasite; /* libcompel handle for child parasite */
   sem_t handoff; /* coordinate handing off tracing */
 
@@ -436,6 +662,103 @@ private:
    */
   ret_t waitInternal(bool reinject);
 
+  /**
+   * Take an event already consumed for one of the process' threads, either
+   * while stopping threads or while waiting for other tasks.
+   *
+   * @param tid output argument set to the thread reporting the event
+   * @param wstatus output argument set to the wait status
+   * @return true if an event was taken or false otherwise
+   */
+  bool takeEvent(pid_t &tid, int &wstatus);
+
+  /**
+   * Update the process' status from a thread's wait status.
+   *
+   * @param tid the thread reporting the event
+   * @param wstatus the wait status
+   * @param reinject whether or not to reinject a signal
+   * @return a return code describing the outcome
+   */
+  ret_t recordEvent(pid_t tid, int wstatus, bool reinject);
+
+  /**
+   * Find a traced thread.
+   * @param tid the thread's ID
+   * @return the thread or nullptr if not traced
+   */
+  Thread *findThread(pid_t tid);
+
+  /**
+   * Handle a stop reported for a task which isn't a traced thread, i.e., a new
+   * thread or forked child whose initial stop arrived before the clone or fork
+   * event, or a task of another process traced by the same thread.  New
+   * threads are recorded & resumed, other events are saved until claimed by
+   * the task's process object or takeStrayStop().
+   *
+   * @param tid the task's ID
+   * @param wstatus the wait status
+   * @return a return code describing the outcome
+   */
+  ret_t handleUnknownTask(pid_t tid, int wstatus);
+
+  /**
+   * Start tracing a new thread stopped at its initial stop.  Records the
+   * thread's stack & resumes it.
+   * @param tid the thread's ID
+   * @param running true if the thread was already running when attaching
+   *                rather than newly created
+   * @return a return code describing the outcome
+   */
+  ret_t addThread(pid_t tid, bool running = false);
+
+  /**
+   * Remove a thread after it exits.
+   * @param tid the thread's ID
+   */
+  void removeThread(pid_t tid);
+
+  /**
+   * Wait for an interrupted thread to stop.  Stops for other events are saved
+   * as pending & reported by a later wait().
+   *
+   * @param thread the thread
+   * @return a return code describing the outcome
+   */
+  ret_t waitForInterrupt(Thread &thread);
+
+  /**
+   * Transfer regions of memory between chameleon & the child using
+   * process_vm_readv()/process_vm_writev().  Regions which can't be accessed
+   * that way (e.g., writes to read-only code pages) fall back to accessing
+   * the child's memory file.
+   *
+   * @param regions child addresses & buffers
+   * @param write true to write to the child or false to read from it
+   * @return a return code describing the outcome
+   */
+  ret_t transferRegions(const RegionList &regions, bool write) const;
+
+  /**
+   * Populate the register cache with the selected thread's registers.
+   * @return a return code describing the outcome
+   */
+  ret_t cacheRegs() const;
+
+  /**
+   * Write back modified registers to the thread whose registers are cached.
+   * Must be called before the thread resumes or another agent (e.g., compel)
+   * accesses its registers.
+   * @return a return code describing the outcome
+   */
+  ret_t flushRegs() const;
+
+  /**
+   * Flush & drop the cached registers, e.g., when the thread is resumed.
+   * @return a return code describing the outcome
+   */
+  ret_t invalidateRegs() const;
+
   /**
    * Initialize the child's stack by pre-touching all stack pages in
    * preparation for re-randomization.  The child's stack bounds are stored in
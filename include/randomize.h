@@ -448,6 +448,22 @@ struct InstructionRun {
   bool empty() const { return instrs.empty(); }
 };
 
+/**
+ * An instruction that must be revisited at every randomization.  Most
+ * instructions only reference a stack slot through a displacement, which is
+ * patched directly in the code buffer.  The rest (frame updates & ISA-specific
+ * rewrites) are re-encoded.
+ */
+struct PatchSite {
+  uint32_t run, instr; /* Instruction's location in the sparse list */
+  uint32_t offset; /* Offset from the function's start of the displacement, or
+                      of the instruction if it must be re-encoded */
+  uint32_t width; /* Size of the displacement in bytes */
+  int origOffset; /* Canonicalized offset of the slot in the original layout */
+  uint16_t base; /* Base register type (arch::RegType) of the reference */
+  bool reencode; /* Re-encode the instruction rather than patching it */
+};
+
 /**
  * A sparse list of instructions, containing only those that would be
  * randomized.  Instructions are organized into runs of consecutive
@@ -476,13 +492,34 @@ public:
                      size_t maxPadding,
                      MemoryWindow &mw);
   RandomizedFunction(const RandomizedFunction &rhs, MemoryWindow &mw);
+  RandomizedFunction(const RandomizedFunction &rhs,
+                     MemoryWindow &mw,
+                     const std::vector<SlotMap> &slots,
+                     uint32_t frameSize);
+  virtual ~RandomizedFunction();
 
   /**
-   * Deep copy the randomized function.
+   * Copy the randomized function.  The copy shares the function's analysis
+   * once patch sites have been recorded and only copies the randomization
+   * state, i.e., stack regions, slot remappings & frame sizes.
    * @param mw a memory window used to set the copied instruction's raw bits
    */
   virtual RandomizedFunction *copy(MemoryWindow &mw) const = 0;
 
+  /**
+   * Copy the randomized function starting from the layout of its code in a
+   * memory window rather than from its current randomization.  Only reads the
+   * function's analysis, so the function can be randomized concurrently.  The
+   * function's patch sites must be valid for the code in the memory window.
+   *
+   * @param mw a memory window containing the function's code
+   * @param slots slot remapping information for the code in the window
+   * @param frameSize randomized frame size for the code in the window
+   */
+  virtual RandomizedFunction *copy(MemoryWindow &mw,
+                                   const std::vector<SlotMap> &slots,
+                                   uint32_t frameSize) const = 0;
+
   /**
    * Get alignment requirements for the function's stack frame.
    * @return frame alignment requirements
@@ -507,10 +544,29 @@ public:
    * instructions.  Users can modify the instructions (including
    * adding/removing instructions) but *must not* delete the list itself.
    */
-  const SparseInstrList &getInstructions() const { return instrs; }
-  SparseInstrList &getInstructions() { return instrs; }
+  const SparseInstrList &getInstructions() const { return analysis->instrs; }
+  SparseInstrList &getInstructions() { return analysis->instrs; }
   void setInstructions(SparseInstrList &&instrs)
-  { this->instrs = std::move(instrs); }
+  { analysis->instrs = std::move(instrs); }
+
+  /**
+   * Get & set the function's patch sites, in instruction order.  Patch sites
+   * are recorded while rewriting instructions for the first randomization;
+   * afterwards, randomizing the function only needs to visit the patch sites
+   * & the instructions are no longer modified.
+   */
+  bool hasPatchSites() const { return analysis->patchable; }
+  const std::vector<PatchSite> &getPatchSites() const
+  { return analysis->patchSites; }
+  void setPatchSites(std::vector<PatchSite> &&sites);
+
+  /**
+   * Get the instruction re-encoded at a patch site.  Each copy of the
+   * function keeps its own version of these instructions.
+   * @param idx index of the patch site among patch sites that re-encode
+   * @return the instruction to re-encode
+   */
+  instr_t *getPatchInstruction(size_t idx) { return patchInstrs[idx]; }
 
   /**
    * Return a stack region's name or none if it doesn't have one.
@@ -626,7 +682,7 @@ public:
    */
   void addTransformAddr(uintptr_t addr, TransformType type) {
     assert(funcContains(func, addr) && "Transformation point not in function");
-    transformAddrs[addr] = type;
+    analysis->transformAddrs[addr] = type;
   }
 
   /**
@@ -637,8 +693,8 @@ public:
    *         transformation point
    */
   TransformType getTransformationType(uintptr_t addr) const {
-    auto it = transformAddrs.find(addr);
-    if(it == transformAddrs.end()) return TransformType::None;
+    auto it = analysis->transformAddrs.find(addr);
+    if(it == analysis->transformAddrs.end()) return TransformType::None;
     else return it->second;
   }
 
@@ -647,7 +703,7 @@ public:
    * @return vector of program transformation points
    */
   const std::unordered_map<uintptr_t, TransformType> &getTransformAddrs() const
-  { return transformAddrs; }
+  { return analysis->transformAddrs; }
 
   /**
    * Typically compilers allocate space for callee-saved registers/immovable
@@ -688,6 +744,17 @@ public:
    */
   int getRandomizedOffset(int orig) const;
 
+  /**
+   * Get the randomized offset for a stack slot in a snapshot of a slot
+   * layout, e.g., the layout used by the code the child is currently running.
+   *
+   * @param slots slot remapping information sorted by original offset
+   * @param orig the canonicalized original stack slot offset
+   * @return the canonicalized randomized offset, or INT32_MAX if orig doesn't
+   *         correspond to any stack slot
+   */
+  static int getRandomizedOffset(const std::vector<SlotMap> &slots, int orig);
+
   /**
    * Return whether a given offset should be transformed.
    * @param offset a canonicalized stack offset from the previous randomization
@@ -725,24 +792,55 @@ protected:
   /* Buffer containing function's instructions */
   byte_iterator funcData;
 
-  /* Disassembled instructions to be transformed */
-  SparseInstrList instrs;
+  /*
+   * Results of analyzing the function.  Identical for every child, so copies
+   * of the function in forked children share them once patch sites have been
+   * recorded, after which they're never modified.
+   */
+  struct Analysis {
+    /* Disassembled instructions to be transformed */
+    SparseInstrList instrs;
+
+    /* Where to rewrite instructions at each randomization & whether they've
+       been recorded yet */
+    std::vector<PatchSite> patchSites;
+    bool patchable;
+
+    /*
+     * Map of program counter addresses where we can do a transformation and
+     * the type of transformation point.
+     */
+    std::unordered_map<uintptr_t, TransformType> transformAddrs;
+
+    /*
+     * Canonicalized slots from metadata for searching.  Randomized versions
+     * of slots are contained in the region objects.
+     */
+    std::vector<std::pair<int, const stack_slot *>> slots;
+
+    /* Set of previously-seen offsets during analysis */
+    std::unordered_set<int> seen;
+
+    /* Stack regions as laid out by analysis, before any randomization */
+    std::vector<StackRegionPtr> regions;
+
+    Analysis() : patchable(false) {}
+    Analysis(const Analysis &rhs)
+      : instrs(rhs.instrs), patchSites(rhs.patchSites),
+        patchable(rhs.patchable), transformAddrs(rhs.transformAddrs),
+        slots(rhs.slots), seen(rhs.seen) {
+      regions.reserve(rhs.regions.size());
+      for(auto &r : rhs.regions) regions.emplace_back(r->copy());
+    }
+  };
+  std::shared_ptr<Analysis> analysis;
+
+  /* Instructions re-encoded at patch sites, owned by this copy */
+  std::vector<instr_t *> patchInstrs;
 
   /* Maximum size of frame */
   uint32_t maxFrameSize;
 
-  /*
-   * Map of program counter addresses where we can do a transformation and the
-   * type of transformation point.
-   */
-  std::unordered_map<uintptr_t, TransformType> transformAddrs;
-
-  /*
-   * Canonicalized slots from metadata for searching.  Randomized versions of
-   * slots are contained in the region objects.
-   */
-  std::vector<std::pair<int, const stack_slot *>> slots;
-
   /*
    * Maintain lists of slot remappings from one previous and current
    * randomization in order to transform thread stacks.
@@ -753,9 +851,6 @@ protected:
   std::vector<SlotMap> _a, _b, prevSortedByRand;
   std::vector<SlotMap> *prevRand, *curRand;
 
-  /* Set of previously-seen offsets during analysis */
-  std::unordered_set<int> seen;
-
   /* Stack regions.  Laid out by target-specific implementation. */
   std::vector<StackRegionPtr> regions;
 
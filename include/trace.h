@@ -69,6 +69,21 @@ bool interrupt(pid_t tracee);
  */
 stop_t stopReason(int wstatus);
 
+/**
+ * Return whether a thread stopped because it was interrupted via interrupt(),
+ * which is also how newly-created threads report their first stop.
+ * @param wstatus the wait status as returned by the wait() family of syscalls
+ * @return true if an interrupt stop or false otherwise
+ */
+bool isInterruptStop(int wstatus);
+
+/**
+ * Return whether a thread stopped at a ptrace event, e.g., clone() or fork().
+ * @param wstatus the wait status as returned by the wait() family of syscalls
+ * @return true if stopped at a ptrace event (excluding interrupt stops)
+ */
+bool isEventStop(int wstatus);
+
 /* Type of resume operation */
 enum resume_t {
   Continue = 0, /* continue until next signal */
@@ -151,6 +166,15 @@ bool getMem(pid_t tracee, uintptr_t addr, uint64_t &data);
  */
 bool setMem(pid_t tracee, uintptr_t addr, uint64_t data);
 
+/**
+ * Write a word in a tracee's (child) user area, e.g., a debug register.
+ * @param tracee the tracee's PID
+ * @param offset offset of the word in struct user
+ * @param data data to write
+ * @return true if succeeded or false otherwise
+ */
+bool setUser(pid_t tracee, size_t offset, uint64_t data);
+
 }
 }
 
@@ -12,12 +12,14 @@
 #ifndef _TRANSFORM_H
 #define _TRANSFORM_H
 
+#include <map>
 #include <random>
 #include <unordered_map>
 #include <pthread.h>
 #include <stack_transform.h>
 
 /* Note: arch.h includes DynamoRIO APIs */
+#include "analysiscache.h"
 #include "arch.h"
 #include "binary.h"
 #include "log.h"
@@ -42,16 +44,43 @@ public:
    * transformer; users must call initialize().
    * @param proc a process
    * @param batchedFaults maximum number of faults handled at once
+   * @param slotPadding maximum padding added between stack slots
+   * @param prefetchDepth maximum number of code pages eagerly served after
+   *                      each fault, or 0 to disable prefetching
+   * @param scrambleThreads number of threads randomizing functions
+   * @param numEpochs number of randomizations generated ahead of the child
+   * @param numShards number of shards the code is split into, one of which is
+   *                  re-randomized per epoch
+   * @param coldPeriod number of epochs between re-randomizations of functions
+   *                   not seen executing, or 1 to re-randomize every function
+   *                   every epoch
    */
   CodeTransformer(Process &proc,
                   Binary &binary,
                   size_t batchedFaults = 1,
-                  size_t slotPadding = 128)
+                  size_t slotPadding = 128,
+                  size_t prefetchDepth = 0,
+                  size_t scrambleThreads = 1,
+                  size_t numEpochs = 1,
+                  size_t numShards = 1,
+                  size_t coldPeriod = 1)
     : proc(proc), binary(binary), codeStart(0), codeEnd(0),
-      rewriteMetadata(nullptr), slotPadding(slotPadding), faultHandlerPid(-1),
-      faultHandlerExit(false), batchedFaults(batchedFaults), intPageAddr(0),
-      scramblerPid(-1), scramblerExit(false), numRandomizations(0),
-      rerandomizeTime(0)
+      rewriteMetadata(nullptr), nextTransform(0), transformWorkersExit(false),
+      hwAdvances(0), swAdvances(0), trampolineAdvances(0), hwAdvanceTime(0),
+      swAdvanceTime(0), trampolineAdvanceTime(0),
+      slotPadding(slotPadding), batchedFaults(batchedFaults),
+      prefetchDepth(prefetchDepth), codeEpoch(0), intPageAddr(0),
+      numRandomizations(0),
+      rerandomizeTime(0), numEpochs(numEpochs), nextEpoch(0),
+      scrambleEpoch(0), stablePatchSites(false), inheritedCodeFile(false),
+      restoringCode(false),
+      numShards(numShards), scrambleShard(0),
+      coldPeriod(coldPeriod), scrambleGeneration(0), scrambledFunctions(0),
+      lazyRandomizations(0),
+      scrambleThreads(scrambleThreads),
+      scrambleBuffer(nullptr), scrambleFailed(false),
+      scrambleWorkersExit(false), droppedPages(0), codeFd(-1), childCodeFd(-1),
+      codeSlot(0), renderSlot(0), codeSwitchTime(0)
 #ifdef DEBUG_BUILD
       , curStackBase(0x400000000000)
 #endif
@@ -64,10 +93,15 @@ public:
    * an initial code randomization (if disabled, act just like the OS mapping
    * pages from disk).
    *
+   * If the process was already running when attached, its threads are
+   * executing the original code so there's no initial randomization; the
+   * first re-randomization switches the process to randomized code.
+   *
    * @param randomize if true, randomize the code
+   * @param running true if the process was already running when attached
    * @return a return code describing the outcome
    */
-  ret_t initialize(bool randomize);
+  ret_t initialize(bool randomize, bool running = false);
 
   /**
    * Initialize a code transformer object from an existing code transformer by
@@ -76,31 +110,60 @@ public:
    * OS mapping pages from disk).  Usually used to initialize the transformer
    * for a forked child that has execution state from a previous randomization.
    *
+   * Only copies state, must be called while the other transformer's child is
+   * stopped at the fork.  The child isn't touched until
+   * finishInitialization(), which can be called once the other child resumes.
+   *
    * @param rhs another code transformer object
    * @return a return code describing the outcome
    */
   ret_t initializeFromExisting(CodeTransformer &rhs, bool randomize);
 
+  /**
+   * Finish initializing a code transformer object initialized from an existing
+   * code transformer by setting up the child's code & fault handling.  The
+   * child runs the code it inherited until its scrambler generates its next
+   * epoch.  Must be called by the child's tracer before resuming the child.
+   *
+   * @param randomize whether randomization was copied from the existing
+   *                  code transformer
+   * @return a return code describing the outcome
+   */
+  ret_t finishInitialization(bool randomize);
+
   /**
    * Clean up the state transformer, including stopping handling faults.  Users
    * should not call any other APIs after a call to cleanup().
    *
    * Note: calls Process::detach() in order to close the userfaultfd file
-   * descriptor & exit the fault handling thread.
+   * descriptor after removing it from the shared fault loop.
    *
    * @return a return code describing the outcome
    */
   ret_t cleanup();
 
   /**
-   * Re-randomize the child process.  This generates a new stack layout,
-   * rewrites threads of the child process using the new layout and drops all
-   * existing code pages.
+   * Re-randomize the child process.  This switches in the next epoch generated
+   * by the scrambler, rewrites threads of the child process using its stack
+   * layout and drops all existing code pages.
    *
    * @return a return code describing the outcome
    */
   ret_t rerandomize();
 
+  /**
+   * Switch the child back to the code it was running when attached, e.g.,
+   * before detaching from a long-running process.  Stops generating epochs
+   * and transforms the child's stacks back to the original layouts.  If
+   * serving page faults, every code page is populated so the child can run
+   * once the userfaultfd is closed.  Only supported if the child was already
+   * running when attached (see initialize()) & not randomizing lazily.
+   *
+   * @param randomize whether the code was randomized
+   * @return a return code describing the outcome
+   */
+  ret_t restoreOriginalCode(bool randomize);
+
   /**
    * Return the Process object to which the CodeTransformer is attached.
    * @return the attached Process object
@@ -123,6 +186,26 @@ public:
    */
   RandomizedFunction *getRandomizedFunctionInfo(uintptr_t pc) const;
 
+  /**
+   * Get the randomization information handed to the stack transformation
+   * runtime for the function enclosing a given program counter value.  The
+   * information translates from the layout of the code the child is running
+   * to the layout of the next epoch to be switched in.  When randomizing
+   * lazily, the function is randomized for the next epoch on demand.
+   *
+   * Note: the information isn't cached per epoch.  It only points at the
+   * running & next layouts, which are swapped in place at every switch, so
+   * building it is a handful of stores, while a cached copy would have to be
+   * rebuilt whenever the running layouts change (switches, restoring the
+   * original code, forked children, lazy randomization).
+   *
+   * @param pc a program counter value
+   * @param info output stack transformation runtime's randomization
+   *             information for the function enclosing pc
+   * @return true if the function was found or false otherwise
+   */
+  bool getRandInfo(uintptr_t pc, func_rand_info &info);
+
   /**
    * Return the userfaultfd file descriptor for the attached process.
    * @return the userfaultfd file descriptor or -1 if there was an error
@@ -137,18 +220,29 @@ public:
   size_t getNumFaultsBatched() const { return batchedFaults; }
 
   /**
-   * Return the fault handling thread's PID.  Only valid after successful calls
-   * to initialize().
-   * @return the fault handling thread's PID or -1 if not initialized
+   * Return the maximum number of code pages the fault handling thread eagerly
+   * serves after handling a fault.
+   * @return the prefetch depth, or 0 if prefetching is disabled
+   */
+  size_t getPrefetchDepth() const { return prefetchDepth; }
+
+  /**
+   * Return the starting address of the code section.
+   * @return the starting address of the code section
+   */
+  uintptr_t getCodeStart() const { return codeStart; }
+
+  /**
+   * Return the ending address of the code section.
+   * @return the ending address of the code section
    */
-  pid_t getFaultHandlerPid() const { return faultHandlerPid; }
+  uintptr_t getCodeEnd() const { return codeEnd; }
 
   /**
-   * Return the code re-randomization ("scrambler") thread's PID.  Only valid
-   * after successful calls to initialize().
-   * @return the scrambler thread's PID or -1 if not initialized
+   * Return the number of threads randomizing functions.
+   * @return the number of threads randomizing functions
    */
-  pid_t getScramblerPid() const { return scramblerPid; }
+  size_t getNumScrambleThreads() const { return scrambleThreads; }
 
   /**
    * DynamoRIO operand size in bytes.
@@ -190,11 +284,13 @@ public:
                                         int32_t offset);
 
   /**
-   * Randomize all functions contained in the memory window.
+   * Randomize functions contained in the memory window.
    * @param buffer buffer into which randomized code will be written
+   * @param range only randomize functions starting in this address range
    * @return a return code describing the outcome
    */
-  ret_t randomizeFunctions(MemoryWindow &buffer);
+  ret_t randomizeFunctions(MemoryWindow &buffer,
+                           const urange_t &range = urange_t(0, UINTPTR_MAX));
 
   /**
    * Dump the process' backtrace to the stack transformation log.
@@ -203,13 +299,6 @@ public:
 
   /* The following APIs should *only* be called by the fault-handling thread */
 
-  /**
-   * Set the PID of the fault handling thread.  Should only be called from the
-   * fault handling thread.
-   * @param pid the fault handling thread's PID
-   */
-  void setFaultHandlerPid(pid_t pid) { faultHandlerPid = pid; }
-
   /**
    * Get the address of the page that should be filled with interrupt
    * instructions by the fault handling thread.
@@ -218,6 +307,14 @@ public:
    */
   uintptr_t getIntPageAddr() const { return intPageAddr; }
 
+  /**
+   * Return the code window's randomization epoch, incremented every time the
+   * code window is switched to a new randomization.  Callers should hold the
+   * code window lock.
+   * @return the current code epoch
+   */
+  size_t getCodeEpoch() const { return codeEpoch; }
+
   /**
    * Lock the code window during page fault handling to avoid inconsistent code
    * pages in the child application.
@@ -231,6 +328,23 @@ public:
    */
   ret_t unlockCodeWindow();
 
+  /**
+   * When randomizing lazily, randomize every function overlapping a code page
+   * which hasn't yet been randomized for the current epoch.  Must be called
+   * before serving the page; the caller must hold the code window lock.
+   *
+   * @param page a page-aligned code address
+   * @return a return code describing the outcome
+   */
+  ret_t randomizePage(uintptr_t page);
+
+  /**
+   * Record that a code page faulted or was prefetched in the execution
+   * profile, crediting every function overlapping the page.
+   * @param page a page-aligned code address
+   */
+  void samplePage(uintptr_t page);
+
   /**
    * Return the address of a buffer which can be directly passed to the kernel
    * to handle a fault for an address, or 0 if none can be used for zero-copy.
@@ -251,51 +365,90 @@ public:
   ret_t project(uintptr_t address, std::vector<char> &buffer) const
   { return codeWindow.project(address, buffer); }
 
+  /* The following APIs should *only* be called by the scrambler threads */
+
   /**
-   * Return whether the fault handling thread should exit.
-   * @return true if the fault handler should exit, false otherwise
+   * Get the semaphore used by the scrambler threads to signal that they have
+   * finished a randomization.
+   * @return the semaphore signaling randomization has finished
    */
-  bool shouldFaultHandlerExit() const { return faultHandlerExit; }
+  sem_t *getFinishedScrambleSem() { return &finishedScrambling; }
 
-  /* The following APIs should *only* be called by the scrambling thread */
+  /**
+   * Return the transformer's code buffer.
+   * @return the memory window object representing the code segment
+   */
+  const MemoryWindow &getCodeWindow() const { return codeWindow; }
 
   /**
-   * Set the scrambler thread's PID.
-   * @param pid the scrambler thread's PID
+   * Return whether code is switched between randomizations by mapping
+   * pre-rendered code from a file rather than by serving page faults.
+   * @return true if mapping code from a file or false otherwise
    */
-  void setScramberPid(pid_t pid) { scramblerPid = pid; }
+  bool mapsCodeFromFile() const { return codeFd >= 0; }
 
   /**
-   * Get the semaphore signaling the scrambler thread should generate a new
-   * randomized version of the code.
-   * @return the semaphore signaling to randomized code
+   * Generate the next epoch into the tail of the ring: randomize the most
+   * recently generated code, snapshot every function's slot layout and either
+   * render the code into the code file or find the pages which changed.
+   * Called by a shared scrambler thread once an entry of the ring is free.
+   * @return a return code describing the outcome
    */
-  sem_t *getScrambleSem() { return &scramble; }
+  ret_t generateEpoch();
 
   /**
-   * Get the semaphore used by the scrambler thread to signal that it has
-   * finished a randomization.
-   * @return the semaphore signaling randomization has finished
+   * A scrambler worker & its queue of functions to randomize.  Each worker
+   * randomizes functions from the front of its own queue and steals from the
+   * back of other workers' queues once its own runs dry.
    */
-  sem_t *getFinishedScrambleSem() { return &finishedScrambling; }
+  struct ScrambleWorker {
+    CodeTransformer *CT;
+    size_t id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    size_t first, last; /* Worker's share of scrambleOrder */
+    size_t next, end; /* Remaining functions in the current round */
+    std::random_device rng; /* Per-worker source of randomization seeds */
+    ret_t code; /* Outcome of the current round */
+  };
 
   /**
-   * Return the transformer's code buffer.
-   * @return the memory window object representing the code segment
+   * Randomize functions alongside the scrambler thread generating a new
+   * version of the code.  Returns when the workers are shut down.
+   * @param worker the worker
    */
-  const MemoryWindow &getCodeWindow() const { return codeWindow; }
+  void runScrambleWorker(ScrambleWorker &worker);
 
   /**
-   * Return the transformer's code buffer for the next randomized version.
-   * @return the memory window object representing the code segment
+   * Functions being analyzed in parallel at startup.  Results are stored at
+   * each function's index so they can be merged in metadata order regardless
+   * of which thread analyzed which function.
    */
-  MemoryWindow &getNextCodeWindow() { return nextCodeWindow; }
+  struct AnalysisWork {
+    CodeTransformer *CT;
+    AnalysisCache *cache; /* Previous results or nullptr if not caching */
+    std::vector<const function_record *> funcs;
+    std::vector<size_t> order; /* Indexes into funcs, largest first */
+    size_t next; /* Next entry in order to analyze */
+    std::vector<RandomizedFunctionPtr> infos;
+    std::vector<AnalysisCache::Function> records;
+    std::vector<ret_t> codes;
+    size_t hits; /* Functions found in the cache */
+    size_t firstFailed; /* Lowest index that failed, or funcs.size() */
+  };
 
   /**
-   * Return whether the scrambler thread should exit.
-   * @return true if the scrambler thread should exit or false otherwise
+   * Analyze functions until all have been claimed, skipping those after the
+   * lowest-indexed function that failed.
+   * @param work the functions being analyzed
    */
-  bool shouldScramblerExit() const { return scramblerExit; }
+  void runAnalysisWorker(AnalysisWork &work);
+
+  /**
+   * Transform threads' stacks alongside the tracer whenever the child is
+   * re-randomized.  Returns when the workers are shut down.
+   */
+  void runTransformWorker();
 
 private:
   /* A previously instantiated process */
@@ -308,16 +461,62 @@ private:
   uintptr_t codeStart, codeEnd;
 
   /* An abstract view of the code segment, used to randomize code */
-  MemoryWindow codeWindow, nextCodeWindow;
+  MemoryWindow codeWindow;
 
   /* Child stack transformation buffer & metadata */
   std::unique_ptr<unsigned char> stackMem;
   std::shared_ptr<struct _st_handle> rewriteMetadata;
 
+  /* A thread's stack being transformed during re-randomization */
+  struct StackTransform {
+    pid_t tid;
+    bool isReturn; /* Thread stopped at a return instruction */
+    struct user_regs_struct regs; /* Thread's registers, transformed in place */
+    urange_t bounds; /* Usable region of the thread's stack */
+    unsigned char *buf; /* Buffer holding the thread's stack */
+    uintptr_t sp, childSrcBase, bufSrcBase, childDstBase, bufDstBase;
+    ret_t code; /* Outcome of transforming the thread's stack */
+  };
+  std::vector<StackTransform> stackTransforms;
+
+  /* Stack transformation buffers for threads other than the main thread */
+  std::unordered_map<pid_t, std::vector<unsigned char>> threadStackMem;
+
+  /* Parallel stack transformation - the tracer transforms stacks alongside
+     the workers, which are started the first time the child has more than
+     one thread */
+  std::vector<pthread_t> transformWorkers;
+  sem_t transformStart, /* Begin transforming stacks */
+        transformDone; /* A worker finished transforming stacks */
+  size_t nextTransform; /* Next entry in stackTransforms to transform */
+  bool transformWorkersExit;
+
+  /* Stop-the-world pause per re-randomization, keyed by the number of threads
+     in the child: number of re-randomizations & total pause */
+  std::map<size_t, std::pair<size_t, uint64_t>> pauseByThreads;
+
+  /* Number of times & total time spent advancing threads to transformation
+     points using hardware breakpoints vs. breakpoint instructions vs.
+     trampolining returns */
+  size_t hwAdvances, swAdvances, trampolineAdvances;
+  uint64_t hwAdvanceTime, swAdvanceTime, trampolineAdvanceTime;
+
   /* Randomization machinery */
   typedef std::unordered_map<uintptr_t, RandomizedFunctionPtr>
     RandomizedFunctionMap;
   RandomizedFunctionMap functions; /* Per-function randomization information */
+
+  /* Flat index of randomized functions used to look up functions from
+     program counter values while transforming stacks.  Starting addresses are
+     kept in a separate sorted array to keep binary searches compact. */
+  struct IndexedFunction {
+    uintptr_t end;
+    RandomizedFunction *info;
+    size_t epoch; /* Epoch last randomized for when randomizing lazily */
+    size_t samples; /* Times seen executing since last re-randomized */
+  };
+  std::vector<uintptr_t> functionStarts;
+  std::vector<IndexedFunction> functionIndex;
   size_t slotPadding; /* Maximum padding between subsequent stack slots */
   // Note: from http://www.pcg-random.org/posts/cpps-random_device.html:
   //
@@ -327,24 +526,108 @@ private:
   // Hence we can't check if it's a true RNG from the entropy() function.
   std::random_device rng;
 
-  /* Reading & responding to page faults */
-  pthread_t faultHandler;
-  pid_t faultHandlerPid;
-  bool faultHandlerExit;
+  /* Reading & responding to page faults, done by the fault loop shared by all
+     transformers */
   size_t batchedFaults; /* Number of faults to handle at once */
+  size_t prefetchDepth; /* Number of pages to serve ahead of faults */
+  size_t codeEpoch; /* Randomization currently served, protected by lock */
   pthread_mutex_t windowLock;
   uintptr_t intPageAddr; /* Address of page that should be filled with
                             interrupt instructions by fault handler thread */
 
-  /* Re-randomization */
-  pthread_t scrambler;
-  pid_t scramblerPid;
-  bool scramblerExit;
-  sem_t scramble, /* Begin generating a new set of randomized code */
-        finishedScrambling; /* Scrambler has finished randomizing */
+  /* Re-randomization - epochs are generated by the scrambler threads shared
+     by all transformers, one requested per free entry of the ring */
+  sem_t finishedScrambling; /* Number of generated epochs in the ring */
+  pthread_mutex_t scrambleLock; /* Held by a scrambler while generating */
   size_t numRandomizations;
   uint64_t rerandomizeTime;
 
+  /* Pipelined re-randomization - the scrambler generates up to numEpochs
+     randomizations ahead of the child into a ring.  Each epoch holds its code
+     & the per-function slot layouts (parallel to functionIndex) needed to
+     transform stacks into it, as the randomized functions themselves have
+     already moved on to later epochs. */
+  struct Epoch {
+    MemoryWindow code;
+    std::vector<urange_t> changedCode; /* Pages changed from previous epoch */
+    size_t codeSlot; /* Slot of the code file holding the code */
+    std::vector<std::vector<SlotMap>> slots;
+    std::vector<uint32_t> frameSizes;
+  };
+  size_t numEpochs;
+  std::unique_ptr<Epoch[]> epochs;
+  size_t nextEpoch, /* Next epoch to be switched in */
+         scrambleEpoch; /* Next epoch to be generated */
+  MemoryWindow lastCode; /* Most recently generated code */
+  bool stablePatchSites; /* Every function's patch sites are valid for the
+                            code of every epoch, see initializeFromExisting() */
+  bool inheritedCodeFile; /* The child inherited another transformer's code
+                             file mapping when forked */
+  std::vector<std::vector<SlotMap>> runningSlots; /* Layouts of the code the
+                                                     child is running */
+  std::vector<uint32_t> runningFrameSizes;
+
+  /* The code & layouts the child was running when attached, if it was
+     already running, which are restored before detaching */
+  MemoryWindow originalCode;
+  std::vector<std::vector<SlotMap>> originalSlots;
+  std::vector<uint32_t> originalFrameSizes;
+  bool restoringCode; /* Stopped generating epochs to restore original code */
+
+  /* Rolling re-randomization - the code is split by address into shards of
+     roughly equal amounts of code & each epoch re-randomizes a single shard
+     in round-robin order, bounding the work & dropped pages per epoch.
+     Shard i holds the functions starting in [shardBounds[i],
+     shardBounds[i+1]). */
+  size_t numShards, scrambleShard; /* Next shard to be re-randomized */
+  std::vector<uintptr_t> shardBounds;
+
+  /* Hotness-driven re-randomization - functions are sampled when they're on
+     a stack being transformed or their pages fault or are prefetched.
+     Functions sampled since they were last re-randomized are re-randomized in
+     every epoch, the rest only every coldPeriod epochs.  Indexed like
+     functionIndex.
+
+     Note: epochs are generated ahead of switches, so samples only affect
+     epochs generated afterwards.  In particular, functions on the stack at a
+     switch were sampled after the epoch being switched to was generated and
+     are only guaranteed to be re-randomized numEpochs switches later. */
+  size_t coldPeriod,
+         scrambleGeneration, /* Number of epochs generated */
+         scrambledFunctions; /* Functions re-randomized across all epochs */
+  std::vector<size_t> lastScrambled; /* Generation last re-randomized in */
+  std::vector<bool> scrambleSelected; /* Selected for this round */
+
+  /* Lazy randomization - rather than generating epochs ahead of the child,
+     functions are randomized when their pages fault or, if they have frames
+     on the stack, while switching.  Code for the latter is written once the
+     switch succeeds.  Protected by the code window lock. */
+  std::vector<size_t> pendingFunctions; /* Indexes of functions whose code
+                                           must be written at the switch */
+  size_t lazyRandomizations;
+
+  /* Parallel randomization - worker 0 is whichever thread is calling
+     randomizeFunctions(), the rest run in their own threads */
+  size_t scrambleThreads;
+  std::vector<RandomizedFunctionPtr *> scrambleOrder;
+  std::vector<std::unique_ptr<ScrambleWorker>> scrambleWorkers;
+  sem_t scrambleStart, /* Begin randomizing the next round of functions */
+        scrambleDone; /* A worker finished randomizing */
+  MemoryWindow *scrambleBuffer; /* Buffer being randomized in this round */
+  urange_t scrambleRange; /* Functions randomized in this round */
+  bool scrambleFailed, scrambleWorkersExit;
+
+  size_t droppedPages;
+
+  /* Switching code by mapping pre-rendered code from a memory-backed file.
+     The file holds a slot per epoch in the ring plus the slot mapped by the
+     child, so the scrambler never renders over code the child is running. */
+  int codeFd, /* Chameleon's descriptor or -1 if serving page faults */
+      childCodeFd; /* The child's descriptor for the same file */
+  size_t codeSlot, /* Slot currently mapped by the child */
+         renderSlot; /* Slot the next generated epoch is rendered into */
+  uint64_t codeSwitchTime;
+
 #ifdef DEBUG_BUILD
   /* Current transformed stack base */
   uintptr_t curStackBase;
@@ -357,12 +640,53 @@ private:
   ret_t initializeFaultHandling();
 
   /**
-   * Initialize the scrambler thread (including synchronization data) and
-   * buffers for re-randomization.
+   * Initialize synchronization data & buffers for re-randomization and
+   * request the ring's epochs from the shared scrambler threads.
    * @return a return code describing the outcome
    */
   ret_t initializeScrambler();
 
+  /**
+   * Deal functions out to scrambler workers & start the worker threads.  A
+   * no-op when randomizing with a single thread.
+   * @return a return code describing the outcome
+   */
+  ret_t initializeScrambleWorkers();
+
+  /**
+   * Stop & join the scrambler worker threads.
+   */
+  void stopScrambleWorkers();
+
+  /**
+   * Get the next function for a scrambler worker to randomize, stealing from
+   * other workers if its own queue is empty.
+   * @param worker the worker
+   * @return the function to randomize or nullptr if all queues are empty
+   */
+  RandomizedFunctionPtr *nextScrambleFunction(ScrambleWorker &worker);
+
+  /**
+   * Return whether a function should be randomized in the current round.
+   * @param addr the function's address
+   * @return true if the function should be randomized or false otherwise
+   */
+  bool shouldScramble(uintptr_t addr) const;
+
+  /**
+   * Select which functions in a range are re-randomized in the next epoch
+   * according to the execution profile, resetting their samples.
+   * @param range only select functions starting in this address range
+   */
+  void selectHotFunctions(const urange_t &range);
+
+  /**
+   * Randomize functions until all workers' queues are empty or a worker
+   * failed.  The outcome is stored in the worker.
+   * @param worker the worker
+   */
+  void scrambleFunctions(ScrambleWorker &worker);
+
   /**
    * Insert breakpoints where chameleon can perform a transformation.
    *
@@ -390,7 +714,43 @@ private:
                 const std::unordered_map<uintptr_t, uint64_t> &origData) const;
 
   /**
-   * Advance the child process to a transformation point.
+   * Find where the current function activation's return address is stored.
+   * The return address lives in a randomized slot, so it can only be located
+   * once the frame pointer is set up & before the epilogue starts reading it
+   * back.  Uses the layout of the code the child is running, which is kept
+   * separately from the randomizations the scrambler generates ahead.
+   *
+   * @param info randomization information for the current function
+   * @param pc the child's current program counter
+   * @return the address of the return address' slot or 0 if it can't be
+   *         located
+   */
+  uintptr_t findReturnAddressSlot(const RandomizedFunction *info,
+                                  uintptr_t pc) const;
+
+  /**
+   * Advance the child to a transformation point by redirecting the current
+   * function's return through the interrupt page.  When the child traps, put
+   * the real return address back & rewind the child to one of the function's
+   * return instructions.  Doesn't touch any code, and the child reaches a
+   * transformation point as soon as the function returns.  Functions that
+   * don't return in time (e.g., event loops) are interrupted & the call fails
+   * with AdvancingFailed, after which the child can be advanced another way.
+   *
+   * @param info randomization information for the current function
+   * @param slot address of the return address' slot
+   * @param Ty output argument set to the type of transformation point at which
+   *           the child was stopped
+   * @param t a running timer which will be paused while advancing forward
+   * @return a return code describing the outcome
+   */
+  ret_t trampolineReturn(const RandomizedFunction *info, uintptr_t slot,
+                         RandomizedFunction::TransformType &Ty, Timer &t);
+
+  /**
+   * Advance the child process to a transformation point.  Uses hardware
+   * breakpoints if the current function has few enough transformation
+   * points, otherwise sprays breakpoint instructions into its code.
    *
    * @param ty output argument set to the type of transformation point at which
    *           the child was stopp
@@ -398,7 +758,42 @@ private:
    * @return a return code describing the outcome
    */
   ret_t advanceToTransformationPoint(RandomizedFunction::TransformType &Ty,
-                                     Timer &t) const;
+                                     Timer &t);
+
+  /**
+   * Advance every thread in the child to a transformation point.  Threads are
+   * driven individually while the rest stay stopped; if a thread doesn't
+   * reach a transformation point in a timely manner (e.g., it's blocked in a
+   * system call), give up on this re-randomization.  Adds an entry to
+   * stackTransforms for each thread.
+   *
+   * @param t a running timer which will be paused while advancing forward
+   * @return a return code describing the outcome
+   */
+  ret_t advanceThreadsToTransformationPoints(Timer &t);
+
+  /**
+   * Start the workers used to transform threads' stacks in parallel.
+   * @return a return code describing the outcome
+   */
+  ret_t initializeTransformWorkers();
+
+  /**
+   * Stop & join the stack transformation workers.
+   */
+  void stopTransformWorkers();
+
+  /**
+   * Transform stacks from stackTransforms until all have been claimed.
+   */
+  void transformNextStacks();
+
+  /**
+   * Transform every stack in stackTransforms, in parallel if the child has
+   * multiple threads.
+   * @return a return code describing the outcome
+   */
+  ret_t transformStacks();
 
   /**
    * Calculate the stack bounds of both the stack in the child's memory and
@@ -473,6 +868,99 @@ private:
    */
   ret_t remapCodeSegment(uintptr_t start, size_t len) const;
 
+  /**
+   * Return the size of a slot in the code file, i.e., the page-aligned size of
+   * the code section.
+   * @return size of a slot in bytes
+   */
+  size_t codeSlotSize() const { return PAGE_UP(codeEnd) - PAGE_DOWN(codeStart); }
+
+  /**
+   * Create a memory-backed file for pre-rendered code and pass it to the
+   * child.  On failure, users should fall back to serving page faults.
+   * @return a return code describing the outcome
+   */
+  ret_t initializeCodeFile();
+
+  /**
+   * Render a randomized version of the code into a slot of the code file.
+   * The interrupt page is filled with interrupt instructions so that the
+   * child traps after executing the system call which maps the slot.
+   *
+   * @param window the code to render
+   * @param slot the slot of the code file
+   * @return a return code describing the outcome
+   */
+  ret_t renderCode(const MemoryWindow &window, size_t slot) const;
+
+  /**
+   * Replace the child's code section with a private mapping of a slot of the
+   * code file.
+   * @param slot the slot of the code file
+   * @return a return code describing the outcome
+   */
+  ret_t mapCodeSlot(size_t slot) const;
+
+  /**
+   * Find the code pages whose contents differ between two randomized versions
+   * of the code.  Changed pages are coalesced into ranges which are dropped
+   * when switching from one version to the other.
+   *
+   * @param cur the code the child will be running before the switch
+   * @param next the code the child will be running after the switch
+   * @param range the code addresses which may differ
+   * @param changed output page ranges which differ
+   * @return a return code describing the outcome
+   */
+  ret_t findChangedCode(const MemoryWindow &cur,
+                        const MemoryWindow &next,
+                        const urange_t &range,
+                        std::vector<urange_t> &changed) const;
+
+  /**
+   * Snapshot every function's current slot layout & randomized frame size,
+   * in the order of the function index.
+   *
+   * @param slots output slot layouts
+   * @param frameSizes output randomized frame sizes
+   */
+  void snapshotLayouts(std::vector<std::vector<SlotMap>> &slots,
+                       std::vector<uint32_t> &frameSizes) const;
+
+  /**
+   * Split the indexed functions into shards by address, balancing the amount
+   * of code in each shard.
+   */
+  void buildShards();
+
+  /**
+   * Randomize a function's stack layout for an epoch when randomizing lazily,
+   * if not already randomized for that epoch.  Saves the layout used by the
+   * function's current code so frames can be transformed out of it.  The
+   * caller must hold the code window lock.
+   *
+   * @param idx the function's position in the function index
+   * @param epoch the epoch for which to randomize the function
+   * @param rewrite write the function's code into the code window now rather
+   *                than when switching to the epoch
+   * @return a return code describing the outcome
+   */
+  ret_t randomizeForEpoch(size_t idx, size_t epoch, bool rewrite);
+
+  /**
+   * Switch the code to the next epoch in the ring after the child's stacks
+   * have been transformed.
+   * @return a return code describing the outcome
+   */
+  ret_t switchCode();
+
+  /**
+   * Switch the code to the next epoch when randomizing lazily after the
+   * child's stacks have been transformed.
+   * @return a return code describing the outcome
+   */
+  ret_t switchCodeLazily();
+
   /**
    * Map a region of memory in the child with the given set of protections and
    * flags.
@@ -485,6 +973,16 @@ private:
    */
   ret_t mapMemory(uintptr_t start, size_t len, int prot, int flags) const;
 
+  /**
+   * Execute system calls in the child.  Large batches are executed by the
+   * parasite with a single command, small batches are injected one call at a
+   * time as infecting the child isn't free.  Stops at the first failing call.
+   *
+   * @param calls the system calls, return values are set upon completion
+   * @return a return code describing the outcome
+   */
+  ret_t runSyscalls(std::vector<struct parasiteSyscall> &calls) const;
+
   /**
    * Unmap a region of memory in the child.
    * @param start starting address of the region
@@ -510,6 +1008,14 @@ private:
    */
   ret_t dropCode();
 
+  /**
+   * Drop ranges of the child's code pages, forcing them to be brought back in
+   * by faults.
+   * @param ranges page-aligned address ranges to drop
+   * @return a return code describing the outcome
+   */
+  ret_t dropCode(const std::vector<urange_t> &ranges);
+
   /**
    * Create memory window for the application's code.  The window will be used
    * both as a buffer for randomization and as the source of data used to
@@ -532,30 +1038,61 @@ private:
    * @param instr an instruction
    * @param wouldRandomize output argument set to true if the instruction would
    * be rewritten during randomization
+   * @param record if non-null, output analysis results to be cached
    * @return a return code describing the outcome
    */
   template<int (*NumOp)(instr_t *), opnd_t (*GetOp)(instr_t *, unsigned)>
   ret_t analyzeOperands(RandomizedFunctionPtr &info,
                         uint32_t frameSize,
                         instr_t *instr,
-                        bool &wouldRandomize);
+                        bool &wouldRandomize,
+                        AnalysisCache::Function *record);
 
   /**
    * Disassemble a function's code and analyze for randomization restrictions.
    * @param info randomization information for a function
+   * @param record if non-null, output analysis results to be cached
    * @return a return code describing the outcome
    */
-  ret_t analyzeFunction(RandomizedFunctionPtr &info);
+  ret_t analyzeFunction(RandomizedFunctionPtr &info,
+                        AnalysisCache::Function *record = nullptr);
+
+  /**
+   * Rebuild a function's analysis from cached results rather than analyzing
+   * the function's code.  Only instructions inside the cached instruction runs
+   * are disassembled.
+   *
+   * @param info randomization information for a function
+   * @param cached cached analysis results for the function
+   * @return a return code describing the outcome
+   */
+  ret_t analyzeFunctionFromCache(RandomizedFunctionPtr &info,
+                                 const AnalysisCache::Function &cached);
+
+  /**
+   * Return the key identifying analysis results for the binary, i.e., a hash
+   * of the code & metadata plus the sets of blacklisted & identity-randomized
+   * functions.
+   * @return the analysis cache key
+   */
+  uint64_t getAnalysisCacheKey() const;
 
   /**
    * Disassemble all functions and analyze for randomization restrictions.
    * Instantiates all randomization machinery but does *not* perform actual
-   * randomization
+   * randomization.  If an analysis cache directory was specified, reuse
+   * previous results for the same binary when available.
    *
    * @return a return code describing the outcome
    */
   ret_t analyzeFunctions();
 
+  /**
+   * Build the flat index used to look up randomized functions from program
+   * counter values.  Must be called whenever the set of functions changes.
+   */
+  void buildFunctionIndex();
+
   /**
    * Rewrite stack slot reference operands to refer to the randomized location.
    * Templated because DynamoRIO differentiates between source & destination
@@ -569,6 +1106,8 @@ private:
    * @param randFrameSize currently calculated randomized frame size
    * @param instr an instruction
    * @param changed output argument set to true if instruction was changed
+   * @param sites if non-null, a patch site is added for each rewritten
+   *              operand with its offset set to the new displacement
    * @return a return code describing the outcome
    */
   template<int (*NumOp)(instr_t *),
@@ -578,15 +1117,79 @@ private:
                           uint32_t frameSize,
                           uint32_t randFrameSize,
                           instr_t *instr,
-                          bool &changed);
+                          bool &changed,
+                          std::vector<PatchSite> *sites);
+
+  /* Original & randomized frame sizes while walking a function's code */
+  struct FrameSizes {
+    uint32_t frameSize, maxFrameSize, randFrameSize, maxRandFrameSize;
+  };
+
+  /**
+   * Restore frame sizes after an epilogue in the middle of a function body.
+   * See frame size cleanup comment in analyzeFunction().
+   * @param frame frame sizes
+   */
+  static void restoreFrameSizes(FrameSizes &frame);
+
+  /**
+   * Rewrite an instruction for the current randomization, re-encoding it into
+   * the buffer if changed, and update the frame sizes.
+   *
+   * @param info randomization information for a function
+   * @param instr an instruction
+   * @param cur location of the instruction in the buffer, advanced past the
+   *            re-encoded instruction
+   * @param real application address of the instruction, advanced past the
+   *             original instruction
+   * @param frame frame sizes at the instruction
+   * @param sites if non-null, patch sites are added for rewritten operands
+   * @param reencode output argument set to true if the instruction must be
+   *                 re-encoded at every randomization
+   * @return a return code describing the outcome
+   */
+  ret_t rewriteInstruction(RandomizedFunctionPtr &info,
+                           instr_t *instr,
+                           byte *&cur,
+                           byte *&real,
+                           FrameSizes &frame,
+                           std::vector<PatchSite> *sites,
+                           bool &reencode);
+
+  /**
+   * Apply the current randomization to a function using its patch sites.
+   * @param info randomization information for a function
+   * @param funcData the function's code in the buffer
+   * @return a return code describing the outcome
+   */
+  ret_t patchFunction(RandomizedFunctionPtr &info, byte_iterator &funcData);
+
+  /**
+   * Randomize a function's stack layout without touching its code.
+   * @param info randomization information for a function
+   * @param seeds source of seeds for the function's randomization
+   * @return a return code describing the outcome
+   */
+  ret_t randomizeSlots(RandomizedFunctionPtr &info, std::random_device &seeds);
+
+  /**
+   * Re-encode a function using its current stack layout.
+   * @param info randomization information for a function
+   * @param buffer buffer into which randomized code will be written
+   * @return a return code describing the outcome
+   */
+  ret_t rewriteFunction(RandomizedFunctionPtr &info, MemoryWindow &buffer);
 
   /**
    * Randomize and re-encode a function.
    * @param info randomization information for a function
    * @param buffer buffer into which randomized code will be written
+   * @param seeds source of seeds for the function's randomization
    * @return a return code describing the outcome
    */
-  ret_t randomizeFunction(RandomizedFunctionPtr &info, MemoryWindow &buffer);
+  ret_t randomizeFunction(RandomizedFunctionPtr &info,
+                          MemoryWindow &buffer,
+                          std::random_device &seeds);
 };
 
 }
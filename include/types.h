@@ -64,6 +64,8 @@ namespace chameleon {
   X(UffdHandshakeFailed, "userfaultfd API handshake failed") \
   X(UffdRegisterFailed, "userfaultfd register region failed") \
   X(UffdCopyFailed, "userfaultfd copy failed") \
+  X(CodeFileFailed, "could not set up file for mapping pre-rendered code") \
+  X(AnalysisCacheFailed, "could not read/write analysis cache") \
   X(MarshalDataFailed, "failed to marshal data to handle fault") \
   X(BadMarshal, "invalid view of memory, found overlapping regions")
 
@@ -120,6 +120,28 @@ static ssize_t findRight(const T *records, ssize_t nrecords, const V val) {
   else return -1;
 }
 
+/* Initial value for hashing (FNV-1a 64-bit offset basis) */
+#define HASH_INIT 0xcbf29ce484222325UL
+
+/**
+ * Hash a buffer using 64-bit FNV-1a.  Hashes of several buffers can be chained
+ * by passing the previous hash as the initial value.
+ *
+ * @param data the buffer
+ * @param len number of bytes in the buffer
+ * @param hash initial hash value
+ * @return the hash of the buffer
+ */
+uint64_t hashBytes(const void *data, size_t len, uint64_t hash = HASH_INIT);
+
+/**
+ * Return the number of CPUs chameleon may run on, i.e., in its CPU affinity
+ * mask, which may be fewer than are online.
+ *
+ * @return the number of usable CPUs, at least 1
+ */
+size_t usableCPUs();
+
 /**
  * Sleep until somebody wakes people waiting on the key.  Returns immediately
  * if *key != val, i.e., somebody has already changed val.
@@ -0,0 +1,307 @@
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "analysiscache.h"
+#include "log.h"
+#include "utils.h"
+
+using namespace chameleon;
+
+///////////////////////////////////////////////////////////////////////////////
+// File format
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The cache file is a header followed by a record per function, sorted by
+ * address.  Each function record is immediately followed by its transformation
+ * points, restrictions and instruction runs.  All records are fixed-size &
+ * 8-byte aligned so the file can be read directly from its mapping.
+ *
+ * Bump the version whenever the layout or the analysis itself changes.
+ */
+
+static const char cacheMagic[8] = { 'C', 'H', 'M', 'A', 'N', 'A', 'L', 'Y' };
+static const uint32_t cacheVersion = 2;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numFuncs;
+  uint64_t key;
+  uint64_t analysisTime;
+  uint64_t binSize, binMtimeSec, binMtimeNsec; /* Binary's identity */
+};
+
+struct CacheFunction {
+  uint64_t addr;
+  uint32_t numTransforms, numRestrictions, numRuns, pad;
+};
+
+struct CacheTransform {
+  uint64_t addr;
+  uint32_t type, pad;
+};
+
+struct CacheRestriction {
+  int32_t flags, offset;
+  uint32_t size, alignment;
+  int64_t rangeStart, rangeEnd;
+  uint16_t base, pad[3];
+};
+
+struct CacheRun {
+  uint64_t start, end;
+};
+
+/**
+ * Return the size of a function record including its trailing arrays.
+ * @param func a function record
+ * @return the size of the record in bytes
+ */
+static inline size_t recordSize(const CacheFunction *func) {
+  return sizeof(CacheFunction) +
+         func->numTransforms * sizeof(CacheTransform) +
+         func->numRestrictions * sizeof(CacheRestriction) +
+         func->numRuns * sizeof(CacheRun);
+}
+
+/**
+ * Write an entire buffer to a file, handling partial writes.
+ *
+ * @param fd file descriptor
+ * @param buf buffer to write
+ * @param len number of bytes to write
+ * @return true if all bytes were written or false otherwise
+ */
+static bool writeAll(int fd, const void *buf, size_t len) {
+  const char *cur = (const char *)buf;
+  ssize_t written;
+
+  while(len) {
+    written = write(fd, cur, len);
+    if(written < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    cur += written;
+    len -= written;
+  }
+  return true;
+}
+
+/**
+ * Fill in the identity of the binary in a cache header.
+ *
+ * @param binary path of the binary
+ * @param header header to fill in
+ * @return true if the binary could be inspected or false otherwise
+ */
+static bool binaryIdentity(const char *binary, CacheHeader &header) {
+  struct stat st;
+
+  if(stat(binary, &st)) return false;
+  header.binSize = st.st_size;
+  header.binMtimeSec = st.st_mtim.tv_sec;
+  header.binMtimeNsec = st.st_mtim.tv_nsec;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AnalysisCache implementation
+///////////////////////////////////////////////////////////////////////////////
+
+AnalysisCache::AnalysisCache(const char *dir, uint64_t key, const char *binary)
+  : key(key), analysisTime(0), binary(binary), data(nullptr), size(0) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016" PRIx64 ".cache", key);
+  filename = dir;
+  filename += name;
+}
+
+AnalysisCache::~AnalysisCache() {
+  if(data) munmap(data, size);
+}
+
+ret_t AnalysisCache::load() {
+  int fd;
+  struct stat st;
+  size_t offset, i;
+  const CacheHeader *header;
+  const CacheFunction *func;
+  CacheHeader identity;
+
+  if(data) return ret_t::Success;
+  if(!binaryIdentity(binary, identity)) return ret_t::AnalysisCacheFailed;
+
+  fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0) return ret_t::FileOpenFailed;
+  if(fstat(fd, &st) || (size_t)st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return ret_t::AnalysisCacheFailed;
+  }
+  size = st.st_size;
+  data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) {
+    data = nullptr;
+    return ret_t::AnalysisCacheFailed;
+  }
+
+  header = (const CacheHeader *)data;
+  if(memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) ||
+     header->version != cacheVersion || header->key != key ||
+     header->binSize != identity.binSize ||
+     header->binMtimeSec != identity.binMtimeSec ||
+     header->binMtimeNsec != identity.binMtimeNsec) {
+    DEBUGMSG("stale analysis cache '" << filename << "'" << std::endl);
+    goto bad;
+  }
+
+  // Index the function records, making sure none run off the end of the file
+  for(i = 0, offset = sizeof(CacheHeader); i < header->numFuncs; i++) {
+    if(offset + sizeof(CacheFunction) > size) goto bad;
+    func = (const CacheFunction *)((char *)data + offset);
+    if(offset + recordSize(func) > size) goto bad;
+    index[func->addr] = offset;
+    offset += recordSize(func);
+  }
+  analysisTime = header->analysisTime;
+
+  DEBUGMSG("loaded analysis cache '" << filename << "' with "
+           << index.size() << " function(s)" << std::endl);
+
+  return ret_t::Success;
+
+bad:
+  munmap(data, size);
+  data = nullptr;
+  size = 0;
+  index.clear();
+  return ret_t::AnalysisCacheFailed;
+}
+
+bool AnalysisCache::lookup(uintptr_t addr, Function &func) const {
+  size_t i;
+  const CacheFunction *rec;
+  const CacheTransform *transform;
+  const CacheRestriction *res;
+  const CacheRun *run;
+  RandRestriction cur;
+
+  auto it = index.find(addr);
+  if(it == index.end()) return false;
+
+  rec = (const CacheFunction *)((char *)data + it->second);
+  transform = (const CacheTransform *)(rec + 1);
+  res = (const CacheRestriction *)(transform + rec->numTransforms);
+  run = (const CacheRun *)(res + rec->numRestrictions);
+
+  func.transformAddrs.clear();
+  func.transformAddrs.reserve(rec->numTransforms);
+  for(i = 0; i < rec->numTransforms; i++, transform++)
+    func.transformAddrs.emplace_back(transform->addr,
+      (RandomizedFunction::TransformType)transform->type);
+
+  func.restrictions.clear();
+  func.restrictions.reserve(rec->numRestrictions);
+  for(i = 0; i < rec->numRestrictions; i++, res++) {
+    cur.flags = res->flags;
+    cur.offset = res->offset;
+    cur.size = res->size;
+    cur.alignment = res->alignment;
+    cur.base = res->base;
+    cur.range.first = res->rangeStart;
+    cur.range.second = res->rangeEnd;
+    func.restrictions.push_back(cur);
+  }
+
+  func.runs.clear();
+  func.runs.reserve(rec->numRuns);
+  for(i = 0; i < rec->numRuns; i++, run++)
+    func.runs.emplace_back(run->start, run->end);
+
+  return true;
+}
+
+ret_t AnalysisCache::store(uint64_t analysisTime) {
+  int fd;
+  bool good = true;
+  std::string tmpName;
+  CacheHeader header;
+  CacheFunction rec;
+  CacheTransform transform;
+  CacheRestriction res;
+  CacheRun run;
+
+  memset(&header, 0, sizeof(header));
+  if(!binaryIdentity(binary, header)) return ret_t::AnalysisCacheFailed;
+
+  // Write to a per-process temporary file & atomically rename into place
+  tmpName = filename + "." + std::to_string(getpid());
+  fd = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    DEBUGMSG("could not open '" << tmpName << "': " << strerror(errno)
+             << std::endl);
+    return ret_t::AnalysisCacheFailed;
+  }
+
+  memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+  header.version = cacheVersion;
+  header.numFuncs = recorded.size();
+  header.key = key;
+  header.analysisTime = analysisTime;
+  good = writeAll(fd, &header, sizeof(header));
+
+  for(auto func = recorded.begin(); good && func != recorded.end(); ++func) {
+    memset(&rec, 0, sizeof(rec));
+    rec.addr = func->first;
+    rec.numTransforms = func->second.transformAddrs.size();
+    rec.numRestrictions = func->second.restrictions.size();
+    rec.numRuns = func->second.runs.size();
+    good = writeAll(fd, &rec, sizeof(rec));
+
+    for(auto &t : func->second.transformAddrs) {
+      memset(&transform, 0, sizeof(transform));
+      transform.addr = t.first;
+      transform.type = t.second;
+      good = good && writeAll(fd, &transform, sizeof(transform));
+    }
+
+    for(auto &r : func->second.restrictions) {
+      memset(&res, 0, sizeof(res));
+      res.flags = r.flags;
+      res.offset = r.offset;
+      res.size = r.size;
+      res.alignment = r.alignment;
+      res.base = r.base;
+      res.rangeStart = r.range.first;
+      res.rangeEnd = r.range.second;
+      good = good && writeAll(fd, &res, sizeof(res));
+    }
+
+    for(auto &r : func->second.runs) {
+      run.start = r.first;
+      run.end = r.second;
+      good = good && writeAll(fd, &run, sizeof(run));
+    }
+  }
+
+  if(close(fd)) good = false;
+  if(!good || rename(tmpName.c_str(), filename.c_str())) {
+    DEBUGMSG("could not write '" << filename << "': " << strerror(errno)
+             << std::endl);
+    unlink(tmpName.c_str());
+    return ret_t::AnalysisCacheFailed;
+  }
+
+  DEBUGMSG("wrote analysis cache '" << filename << "' with "
+           << recorded.size() << " function(s)" << std::endl);
+
+  return ret_t::Success;
+}
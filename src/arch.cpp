@@ -264,9 +264,42 @@ uintptr_t arch::sp(const struct user_regs_struct &regs) { return regs.rsp; }
 void arch::sp(struct user_regs_struct &regs, uintptr_t newSP)
 { regs.rsp = newSP; }
 
+uintptr_t arch::fp(const struct user_regs_struct &regs) { return regs.rbp; }
+
 long arch::syscallNumber(const struct user_regs_struct &regs)
 { return regs.orig_rax; }
 
+size_t arch::numHardwareBreakpoints() { return 4; }
+
+/**
+ * Return the offset of a debug register in the user area.
+ * @param reg the debug register number
+ * @return the offset of the register in struct user
+ */
+static inline size_t debugRegOffset(size_t reg) {
+  return offsetof(struct user, u_debugreg) +
+         reg * sizeof(((struct user *)nullptr)->u_debugreg[0]);
+}
+
+void
+arch::hardwareBreakpointRegs(const std::vector<uintptr_t> &addrs,
+                             std::vector<std::pair<size_t, uint64_t>> &writes) {
+  uint64_t dr7 = 0;
+
+  assert(addrs.size() <= numHardwareBreakpoints() &&
+         "Too many hardware breakpoints");
+
+  // Set the addresses in DR0-DR3 before enabling them in DR7.  Instruction
+  // breakpoints use R/W = 00 & LEN = 00 in DR7, so only set the local enable
+  // bit for each breakpoint.
+  writes.clear();
+  for(size_t i = 0; i < addrs.size(); i++) {
+    writes.emplace_back(debugRegOffset(i), addrs[i]);
+    dr7 |= 1UL << (i * 2);
+  }
+  writes.emplace_back(debugRegOffset(7), dr7);
+}
+
 void arch::marshalFuncCall(struct user_regs_struct &regs,
                            long a1, long a2, long a3,
                            long a4, long a5, long a6) {
@@ -344,6 +377,8 @@ uint32_t arch::alignFrameSize(uint32_t size) { return ROUND_UP(size, 16); }
 
 int32_t arch::framePointerOffset() { return -16; }
 
+int32_t arch::returnAddressOffset() { return 8; }
+
 ///////////////////////////////////////////////////////////////////////////////
 // Randomization implementation
 ///////////////////////////////////////////////////////////////////////////////
@@ -623,9 +658,21 @@ public:
                         MemoryWindow &mw)
     : RandomizedFunction(rhs, mw), alignment(rhs.alignment) {}
 
+  x86RandomizedFunction(const x86RandomizedFunction &rhs,
+                        MemoryWindow &mw,
+                        const std::vector<SlotMap> &slots,
+                        uint32_t frameSize)
+    : RandomizedFunction(rhs, mw, slots, frameSize),
+      alignment(rhs.alignment) {}
+
   virtual RandomizedFunction *copy(MemoryWindow &mw) const override
   { return new x86RandomizedFunction(*this, mw); }
 
+  virtual RandomizedFunction *copy(MemoryWindow &mw,
+                                   const std::vector<SlotMap> &slots,
+                                   uint32_t frameSize) const override
+  { return new x86RandomizedFunction(*this, mw, slots, frameSize); }
+
   virtual uint32_t getFrameAlignment() const override { return alignment; }
 
   virtual const char *getRegionName(const StackRegionPtr &r) const override
@@ -653,12 +700,12 @@ public:
     // TODO what if there are multiple types of restrictions for a single stack
     // slot, e.g., one use causes a SP-limited displacement and another causes
     // the slot to be immutable?
-    if(seen.count(offset)) {
+    if(analysis->seen.count(offset)) {
       DEBUGMSG_VERBOSE(" -> previously handled offset " << offset
                        << std::endl);
       return code;
     }
-    else seen.insert(offset);
+    else analysis->seen.insert(offset);
 
     // Add to the appropriate region depending on the restriction type
     switch(res.flags) {
@@ -714,8 +761,8 @@ public:
    */
   void populateMovable() {
     StackRegionPtr &r = regions[x86Region::R_Movable];
-    for(auto &s : slots) {
-      if(!seen.count(s.first)) {
+    for(auto &s : analysis->slots) {
+      if(!analysis->seen.count(s.first)) {
         const stack_slot *slot = s.second;
         r->addSlot(s.first, slot->size, slot->alignment);
         DEBUGMSG(" -> slot @ " << s.first << " (size = " << slot->size
@@ -961,7 +1008,7 @@ public:
     bool foundPrologue = false, foundEpilogue = false;
     int calleeSaveOffset;
 
-    for(auto &instrRun : instrs) {
+    for(auto &instrRun : analysis->instrs) {
       bool containsPrologue = false, containsEpilogue = false;
       for(auto &instr : instrRun.instrs) {
         if(isCalleeSavePush(instr)) containsPrologue = true;
@@ -1529,22 +1576,17 @@ ret_t arch::transformStack(CodeTransformer *CT,
                            get_rand_info callback,
                            st_handle meta,
                            bool isReturn,
+                           struct user_regs_struct &src,
                            uintptr_t childSrcBase,
                            uintptr_t bufSrcBase,
                            uintptr_t childDstBase,
-                           uintptr_t bufDstBase,
-                           uintptr_t &sp) {
-  struct user_regs_struct src;
+                           uintptr_t bufDstBase) {
   struct regset_x86_64 srcST, dstST;
-  Process &proc = CT->getProcess();
 
   // Note: don't mess with FP registers - they don't contain transformable
   // content (e.g., pointers that must be fixed up) and their locations are not
   // being randomized.
 
-  if(!proc.traceable()) return ret_t::InvalidState;
-  if(proc.readRegs(src) != ret_t::Success) return ret_t::PtraceFailed;
-
   srcST.rip = (void *)src.rip;
   srcST.rax = src.rax;
   srcST.rdx = src.rdx;
@@ -1587,9 +1629,6 @@ ret_t arch::transformStack(CodeTransformer *CT,
   src.r14 = dstST.r14;
   src.r15 = dstST.r15;
 
-  if(proc.writeRegs(src) != ret_t::Success) return ret_t::PtraceFailed;
-
-  sp = src.rsp;
   return ret_t::Success;
 }
 
@@ -1877,6 +1916,28 @@ arch::rewriteFrameUpdate(instr_t *instr, int32_t newSize, bool &changed) {
   return ret_t::Success;
 }
 
+int32_t
+arch::getDisplacementOffset(instr_t *instr, int32_t disp, uint32_t &width) {
+  int32_t offset = -1;
+  size_t i, len;
+  byte *bits;
+
+  // Stack slot references are re-encoded with 4-byte displacements (see
+  // randomizeOperands()), so look for the one place the displacement shows up
+  // in the encoding.  If it shows up more than once, e.g., an immediate with
+  // the same value, we can't tell which one to patch.
+  if(!instr_raw_bits_valid(instr)) return -1;
+  bits = instr_get_raw_bits(instr);
+  len = instr_length(GLOBAL_DCONTEXT, instr);
+  for(i = 0; i + sizeof(int32_t) <= len; i++) {
+    if(memcmp(&bits[i], &disp, sizeof(int32_t))) continue;
+    if(offset >= 0) return -1;
+    offset = i;
+  }
+  width = sizeof(int32_t);
+  return offset;
+}
+
 #else
 # error "Unsupported architecture!"
 #endif
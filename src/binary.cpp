@@ -338,6 +338,15 @@ Binary::getUnwindLocations(const function_record *func) const {
                                                   func->unwind.num);
 }
 
+uint64_t Binary::hashCodeAndMetadata() const {
+  uint64_t hash = HASH_INIT;
+  hash = hashBytes(codeSection.getData(), codeSection.size(), hash);
+  hash = hashBytes(functions.getData(), functions.size(), hash);
+  hash = hashBytes(stackSlots.getData(), stackSlots.size(), hash);
+  hash = hashBytes(unwind.getData(), unwind.size(), hash);
+  return hash;
+}
+
 ret_t Binary::getSectionByName(const char *name, Section &section) {
   size_t len = strnlen(name, 512);
   const char *curName;
@@ -19,15 +19,28 @@ using namespace std;
 using namespace chameleon;
 
 pid_t masterPID;
-static pthread_t masterThread;
 static int childArgc;
 static char **childArgv;
 static bool randomize = true;
 static uint64_t randomizePeriod = 0; /* in milliseconds */
 static size_t maxPadding = 128;
+static size_t batchedFaults = 1;
+static size_t prefetchDepth = 0;
+static size_t scrambleThreads = 1;
+static size_t numEpochs = 1;
+static size_t numShards = 1;
+static size_t coldPeriod = 1;
+static pid_t attachPid = 0;
+static char attachExe[64];
+static char *attachArgv[2] = { attachExe, nullptr };
 extern const char *blacklistFilename;
 extern const char *badSitesFilename; // TODO hack, should remove
 extern const char *identityRandFilename;
+extern const char *analysisCacheDir;
+extern bool mapCodeFromFile;
+extern bool returnTrampolines;
+extern bool lazyRandomization;
+extern size_t sharedScramblers;
 #ifdef DEBUG_BUILD
 pthread_mutex_t logLock;
 static bool tracing = false;
@@ -41,26 +54,52 @@ static bool doRerandomize = false;
 
 // Some helpful typedefs to safely wrap pointers & make ADTs bearable
 typedef unique_ptr<Binary> BinaryPtr;
-typedef std::pair<Process, pthread_t> ChildHandler;
 
 // The application's binary file on disk
 static BinaryPtr binary;
 
-// Note: chameleon will fork the main application and maintain its information
-// in the main thread.  This list holds information for additional children
-// forked during the application's (or its children's) execution.
-static int numChildren = 0;
-static list<ChildHandler> children; /* running children/handlers */
-static list<pthread_t> toJoin; /* children that have exited & need joining */
-static pthread_mutex_t childLock = PTHREAD_MUTEX_INITIALIZER,
-                       joinLock = PTHREAD_MUTEX_INITIALIZER;
+// Note: chameleon traces the main application & the children it forks from a
+// fixed set of tracer threads, the first of which is the main thread.  Each
+// tracer waits for events from all of its processes at once & handles them in
+// turn.  Only the thread that attached to a process may trace it, so processes
+// stay with their tracer; forked children are handed off to the least-loaded
+// tracer when they're created.
+struct Tracee {
+  unique_ptr<Process> proc;
+  unique_ptr<CodeTransformer> CT;
+  bool main; /* is this the main application? */
+  bool handedOff; /* was tracing handed off from another tracer? */
+
+  Tracee(Process *proc, CodeTransformer *CT, bool main)
+    : proc(proc), CT(CT), main(main), handedOff(false) {}
+};
+
+struct Tracer {
+  size_t id;
+  pthread_t thread;
+  list<Tracee> tracees; /* processes traced, only touched by the tracer */
+  list<Tracee> handoffs; /* forked children waiting to be set up */
+  size_t load; /* number of processes traced or being handed off */
+  bool alarm; /* an alarm rang since the tracer last re-randomized */
+  sem_t wake; /* wakes up the tracer when it has nothing to trace */
+};
+
+static size_t numTracers = 1;
+static vector<unique_ptr<Tracer>> tracers; /* fixed once the alarm starts */
+static pthread_mutex_t tracerLock = PTHREAD_MUTEX_INITIALIZER; /* protects
+                                                   handoffs & load */
+static int numTracees = 0; /* processes alive across all tracers */
+
+// Set when asked to detach from an attached process, after which tracers
+// restore their processes' original code & stop tracing them
+static volatile sig_atomic_t detaching = 0;
 
 // Declare event & child handling APIs to satisfy compiler
 static void alarmCallback(void *data);
-static ret_t addChild(pid_t pid, CodeTransformer &CT);
-static ret_t cleanupChild(const Process *proc);
-static Process::status_t handleEvent(CodeTransformer &CT);
-static void *forkedChildLoop(void *p);
+static ret_t addChild(Tracer &tracer, pid_t pid, CodeTransformer &CT,
+                      bool stopped);
+static bool handleEvent(Tracer &tracer, Tracee &tracee);
+static void *tracerLoop(void *p);
 
 static bool checkCompatibility() {
   // TODO other checks?
@@ -72,6 +111,8 @@ static void printHelp(const char *bin) {
   cout << bin << " - run an application under the Popcorn Chameleon framework"
               << endl << endl
        << "Usage: " << bin << " [ OPTIONS ] -- <application> [ APP ARGS ]"
+                    << endl
+       << "       " << bin << " [ OPTIONS ] -o PID [ -- <application> ]"
                     << endl << endl
        << bin << "'s arguments must precede '--', after which the user should "
                  "specify a binary and any arguments" << endl << endl
@@ -79,13 +120,46 @@ static void printHelp(const char *bin) {
        << "  -h      : print help and exit" << endl
        << "  -p MS   : re-randomization period in milliseconds" << endl
        << "  -m PAD  : maximum amount of padding to add between slots" << endl
+       << "  -f NUM  : maximum number of code page faults to handle at once"
+          << endl
+       << "  -a NUM  : after a code page fault, serve up to NUM pages predicted "
+          "to fault next" << endl
+       << "  -w NUM  : number of threads randomizing the application's code at "
+          "each re-randomization" << endl
+       << "  -j NUM  : number of threads generating randomizations for all "
+          "children" << endl
+       << "  -u NUM  : number of threads tracing the application & its "
+          "children" << endl
+       << "  -g NUM  : number of randomizations to generate ahead of "
+          "re-randomizations" << endl
+       << "  -x NUM  : split the code into NUM shards and re-randomize one "
+          "shard per period" << endl
+       << "  -y NUM  : re-randomize functions not seen executing only every "
+          "NUM periods; functions are seen executing when their code pages "
+          "fault or are prefetched (see -a) or when they're on a stack at a "
+          "re-randomization, which only affects randomizations generated "
+          "afterwards, i.e., switched to -g periods later" << endl
        << "  -n      : don't randomize the code section" << endl
+       << "  -c      : switch code by mapping pre-rendered code from a file "
+          "rather than by serving page faults" << endl
+       << "  -e      : advance to transformation points by trampolining the "
+          "current function's return rather than inserting breakpoints"
+          << endl
+       << "  -l      : randomize functions as their code faults in rather "
+          "than ahead of each re-randomization (implies serving page faults)"
+          << endl
+       << "  -o PID  : attach to the already-running process PID (whose binary "
+          "defaults to /proc/PID/exe) rather than starting the application; "
+          "send SIGTERM or SIGHUP to detach, restoring its original code"
+          << endl
        << "  -b FILE : don't touch functions whose addresses are listed in "
           "the specified file (i.e., no analysis or randomization)" << endl
        << "  -s FILE : don't transform if thread's stack has frames from call "
           "sites listed in the specified file" << endl
        << "  -i FILE : do an identity \"randomization\" for functions whose "
           "addresses are listed in the specified file *" << endl
+       << "  -k DIR  : cache code analysis results in DIR to speed up "
+          "subsequent launches of the same binary" << endl
 #ifdef DEBUG_BUILD
        << "  -t FILE : trace execution by dumping PC values to FILE (warning: "
           "slow!)" << endl
@@ -124,7 +198,8 @@ static void parseArgs(int argc, char **argv) {
   argv[i] = nullptr;
 
   // Parse arguments up until the delimiter
-  while((c = getopt(argc, argv, "hp:m:nb:s:t:rdi:v")) != -1) {
+  while((c = getopt(argc, argv, "hp:m:f:a:w:j:u:g:x:y:ncelo:b:s:k:t:rdi:v"))
+        != -1) {
     switch(c) {
     default: break;
     case 'h': printHelp(argv[0]); exit(0); break;
@@ -138,10 +213,60 @@ static void parseArgs(int argc, char **argv) {
       if(end == optarg)
         ERROR("invalid maximum slot padding '" << optarg << "'" << endl);
       break;
+    case 'f':
+      batchedFaults = strtoul(optarg, &end, 10);
+      if(end == optarg || !batchedFaults)
+        ERROR("invalid number of batched faults '" << optarg << "'" << endl);
+      break;
+    case 'a':
+      prefetchDepth = strtoul(optarg, &end, 10);
+      if(end == optarg)
+        ERROR("invalid prefetch depth '" << optarg << "'" << endl);
+      break;
+    case 'w':
+      scrambleThreads = strtoul(optarg, &end, 10);
+      if(end == optarg || !scrambleThreads)
+        ERROR("invalid number of scrambler threads '" << optarg << "'" << endl);
+      break;
+    case 'j':
+      sharedScramblers = strtoul(optarg, &end, 10);
+      if(end == optarg || !sharedScramblers)
+        ERROR("invalid number of shared scrambler threads '" << optarg << "'"
+              << endl);
+      break;
+    case 'u':
+      numTracers = strtoul(optarg, &end, 10);
+      if(end == optarg || !numTracers)
+        ERROR("invalid number of tracers '" << optarg << "'" << endl);
+      break;
+    case 'g':
+      numEpochs = strtoul(optarg, &end, 10);
+      if(end == optarg || !numEpochs)
+        ERROR("invalid number of epochs '" << optarg << "'" << endl);
+      break;
+    case 'x':
+      numShards = strtoul(optarg, &end, 10);
+      if(end == optarg || !numShards)
+        ERROR("invalid number of shards '" << optarg << "'" << endl);
+      break;
+    case 'y':
+      coldPeriod = strtoul(optarg, &end, 10);
+      if(end == optarg || !coldPeriod)
+        ERROR("invalid cold period '" << optarg << "'" << endl);
+      break;
     case 'n': randomize = false; break;
+    case 'c': mapCodeFromFile = true; break;
+    case 'e': returnTrampolines = true; break;
+    case 'l': lazyRandomization = true; break;
+    case 'o':
+      attachPid = strtol(optarg, &end, 10);
+      if(end == optarg || attachPid <= 0)
+        ERROR("invalid PID '" << optarg << "'" << endl);
+      break;
     case 'b': blacklistFilename = optarg; break;
     case 's': badSitesFilename = optarg; break; // TODO hack should be removed
     case 'i': identityRandFilename = optarg; break;
+    case 'k': analysisCacheDir = optarg; break;
 #ifdef DEBUG_BUILD
     case 't': tracing = true; traceFilename = optarg; break;
     case 'r': traceRegs = true; break;
@@ -151,6 +276,18 @@ static void parseArgs(int argc, char **argv) {
     }
   }
 
+  // Restoring the original code relies on the scramblers' ring of epochs
+  if(attachPid && lazyRandomization)
+    ERROR("cannot randomize lazily when attaching to a process" << endl);
+
+  // When attaching, the process' binary is available through procfs
+  if(attachPid && (!foundDelim || childArgc <= 0)) {
+    snprintf(attachExe, sizeof(attachExe), "/proc/%d/exe", attachPid);
+    childArgc = 1;
+    childArgv = attachArgv;
+    foundDelim = true;
+  }
+
   if(!foundDelim || childArgc <= 0) {
     printHelp(argv[0]);
     ERROR("did not specify a binary" << endl);
@@ -165,40 +302,35 @@ static void parseArgs(int argc, char **argv) {
 }
 
 static void alarmCallback(void *data) {
-  list<ChildHandler>::iterator it;
+#ifdef DEBUG_BUILD
+  // Triggering a re-randomization only occurs when interrupting a wait, but
+  // when single-stepping through the child there's basically no window to be
+  // interrupted.  Instead, tracers force a re-randomization at the next step.
+  if(tracing) {
+    __atomic_store_n(&doRerandomize, true, __ATOMIC_RELEASE);
+    alarmsRung++;
+    return;
+  }
+#endif
 
-  // TODO 1: currently assume that adding/cleaning up children is a rare event
-  // and if somebody is calling either addChild() or cleanupChild(), just skip
-  // this alarm
-  // TODO 2: proper error propagation instead of ERROR when any of the below
+  // Kick off an action; flag the alarm for every tracer & send a signal to
+  // interrupt tracers blocked waiting for events, which re-randomize each of
+  // their processes.  Tracers currently performing other work pick up the
+  // alarm before they next wait.
+  // TODO proper error propagation instead of ERROR when any of the below
   // actions fail
-  int ret = pthread_mutex_trylock(&childLock);
-  if(ret) {
-    if(ret == EBUSY) return; // Somebody else has the lock
-    else ERROR("could not try to acquire child lock" << endl);
+  for(auto &tracer : tracers) {
+    __atomic_store_n(&tracer->alarm, true, __ATOMIC_RELEASE);
+    if(pthread_kill(tracer->thread, SIGINT))
+      ERROR("could not interrupt tracer " << tracer->id << endl);
   }
 
-  DEBUG(if(tracing) __atomic_store_n(&doRerandomize, true, __ATOMIC_RELEASE);)
-
-  // Kick off an action; send a signal to handler threads that are blocked in
-  // waitpid(), which will perform an action on the child inside handleEvent().
-  // Handlers currently performing other work will skip this alarm.  There's no
-  // race condition between the signaled thread finishing this alarm's action
-  // and the next alarm signal, as signals received when not blocking in
-  // waitpid() are a no-op.
-  if(pthread_kill(masterThread, SIGINT))
-    ERROR("could not interrupt handler for main process" << endl);
-  for(it = children.begin(); it != children.end(); it++)
-    if(pthread_kill(it->second, SIGINT))
-      ERROR("could not interrupt handler for child process "
-            << it->first.getPid() << endl);
-
   DEBUG(alarmsRung++);
-  if(pthread_mutex_unlock(&childLock)) ERROR("could not unlock mutex" << endl);
 }
 
 static ret_t setupSignalsAndAlarm(Alarm &alarm) {
   struct sigaction handler;
+  sigset_t childSig;
   auto intHandler = [](int signal){};
   ret_t code;
 
@@ -206,9 +338,19 @@ static ret_t setupSignalsAndAlarm(Alarm &alarm) {
   // here.  Additionally, spawned threads will inherit the signal masks set up
   // here (threads may change masks as needed).
 
-  // Register an empty handler for SIGINT, chameleon's preferred method for
-  // poking other threads.  Always required as SIGINT is used to wake up page
-  // fault handling threads from blocking reads.
+  // Tracers learn that their processes have events to report by waiting for
+  // SIGCHLD (see runTracer()).  Block it before spawning any threads so it
+  // stays pending until a tracer takes it.
+  sigemptyset(&childSig);
+  sigaddset(&childSig, SIGCHLD);
+  if(pthread_sigmask(SIG_BLOCK, &childSig, nullptr)) {
+    DEBUGMSG("could not block SIGCHLD: " << strerror(errno) << endl);
+    return ret_t::SignalMaskFailed;
+  }
+
+  // Register a handler for SIGINT, chameleon's preferred method for poking
+  // other threads.  Tracers keep it blocked & wait for it, but other threads
+  // must not be killed by it.
   memset(&handler, 0, sizeof(struct sigaction));
   handler.sa_handler = intHandler;
   if(sigaction(SIGINT, &handler, nullptr) == -1) {
@@ -233,150 +375,209 @@ static ret_t setupSignalsAndAlarm(Alarm &alarm) {
   return ret_t::Success;
 }
 
-/* Arguments to child handlers */
-struct HandlerArgs {
-  Process *child;
-  CodeTransformer *parentCT;
-  sem_t finishedInit;
-};
+/**
+ * Set up detaching from an attached process when chameleon is asked to exit.
+ * Must be called after starting the tracers, which the handler wakes up.
+ * @return a return code describing the outcome
+ */
+static ret_t setupDetaching() {
+  struct sigaction handler;
+  auto termHandler = [](int signal) {
+    detaching = 1;
+    for(auto &tracer : tracers) pthread_kill(tracer->thread, SIGINT);
+  };
 
-static ret_t addChild(pid_t pid, CodeTransformer &CT) {
-  ret_t code = ret_t::Success;
-  HandlerArgs args;
+  memset(&handler, 0, sizeof(struct sigaction));
+  handler.sa_handler = termHandler;
+  if(sigaction(SIGTERM, &handler, nullptr) == -1 ||
+     sigaction(SIGHUP, &handler, nullptr) == -1) {
+    DEBUGMSG("could not initialize handler: " << strerror(errno) << endl);
+    return ret_t::ChameleonSignalFailed;
+  }
+  return ret_t::Success;
+}
 
-  if(pthread_mutex_lock(&childLock)) return ret_t::LockFailed;
+/**
+ * Resume a process until its next event.
+ * @param tracee the process
+ */
+static void resumeTracee(Tracee &tracee) {
+  Process &child = *tracee.proc;
+  trace::resume_t type = trace::Continue;
+  ret_t code;
 
-  children.emplace_back(Process(pid), pthread_t());
-  ChildHandler &child = children.back();
-  if((code = child.first.initForkedChild()) != ret_t::Success) goto cleanup;
+#ifdef DEBUG_BUILD
+  if(tracing) type = trace::SingleStep;
+  else if(verboseDebug) type = trace::Syscall;
+#endif
+  code = child.resume(type);
+  if(code != ret_t::Success)
+    ERROR(child.getPid() << ": could not continue to next event: "
+          << retText(code) << endl);
+}
 
-  args.child = &child.first;
-  args.parentCT = &CT;
-  if(sem_init(&args.finishedInit, 0, 0)) {
-    code = ret_t::SemaphoreFailed;
-    goto cleanup;
-  }
+/**
+ * Clean up a process after it exits (or if it can't be traced).
+ * @param tracer the process' tracer
+ * @param tracees the list containing the process
+ * @param it the process
+ * @return the process following the removed process
+ */
+static list<Tracee>::iterator finishTracee(Tracer &tracer,
+                                           list<Tracee> &tracees,
+                                           list<Tracee>::iterator it) {
+  pid_t pid = it->proc->getPid();
+  ret_t code;
 
-  if(pthread_create(&child.second, nullptr, forkedChildLoop, &args)) {
-    code = ret_t::ChildHandlerSetupFailed;
-    goto cleanup;
+  INFO(pid << ": cleaning up " << (it->main ? "main" : "forked") << " child"
+       << endl);
+  code = it->CT->cleanup();
+  if(code != ret_t::Success) {
+    if(it->main) {
+      ERROR("could not clean up transformer: " << retText(code) << endl);
+    }
+    else WARN(pid << ": problem cleaning up code transformer" << endl);
   }
+  it = tracees.erase(it);
 
-  if((code = child.first.detachHandoff()) != ret_t::Success) goto cleanup;
-  if(MASK_INT(sem_wait(&args.finishedInit))) return ret_t::SemaphoreFailed;
-  __atomic_add_fetch(&numChildren, 1, __ATOMIC_RELEASE);
+  if(pthread_mutex_lock(&tracerLock)) ERROR("could not lock tracers" << endl);
+  tracer.load--;
+  if(pthread_mutex_unlock(&tracerLock))
+    ERROR("could not unlock tracers" << endl);
 
-cleanup:
-  if(pthread_mutex_unlock(&childLock)) return ret_t::LockFailed;
+  // Wake everybody up to exit once the last process is gone
+  if(__atomic_add_fetch(&numTracees, -1, __ATOMIC_ACQ_REL) == 0)
+    for(auto &t : tracers) sem_post(&t->wake);
 
-  return code;
+  return it;
 }
 
-static ret_t cleanupChild(const Process *proc) {
-  ret_t code = ret_t::Success;
-  list<ChildHandler>::iterator it;
-
-  if(pthread_mutex_lock(&childLock)) return ret_t::LockFailed;
-
-  // Find the entry containing the Process object & handler, add the handler to
-  // be joined and remove the child entry
-  for(it = children.begin(); it != children.end(); it++) {
-    if(&it->first == proc) {
-      if(pthread_mutex_lock(&joinLock)) {
-        code = ret_t::LockFailed;
-        break;
-      }
+static ret_t addChild(Tracer &tracer,
+                      pid_t pid,
+                      CodeTransformer &CT,
+                      bool stopped) {
+  Process *child = new Process(pid);
+  CodeTransformer *transformer =
+    new CodeTransformer(*child, *binary, batchedFaults, maxPadding,
+                        prefetchDepth, scrambleThreads, numEpochs, numShards,
+                        coldPeriod);
+  Tracee tracee(child, transformer, false);
+  Tracer *target = &tracer;
+  ret_t code;
 
-      toJoin.emplace_back(it->second);
-      children.erase(it);
-      if(__atomic_add_fetch(&numChildren, -1, __ATOMIC_ACQ_REL) == 0)
-        syncWake(&numChildren);
+  // Copy the parent's transformation machinery while it's stopped at the
+  // fork.  Setting up the child's code is left to the child's tracer so that
+  // the parent can resume right away.  Note that we don't have to re-map
+  // child's code - the re-mapped VMA should be inherited from the parent.
+  if((code = child->initForkedChild(stopped)) != ret_t::Success) return code;
+  code = transformer->initializeFromExisting(CT, randomize);
+  if(code != ret_t::Success) {
+    DEBUGMSG(pid << ": could not set up code transformer" << endl);
+    transformer->cleanup();
+    return code;
+  }
 
-      if(pthread_mutex_unlock(&joinLock)) code = ret_t::LockFailed;
-      break;
-    }
+  // Pick the least-loaded tracer
+  if(pthread_mutex_lock(&tracerLock)) return ret_t::LockFailed;
+  for(auto &t : tracers)
+    if(t->load < target->load) target = t.get();
+  target->load++;
+  __atomic_add_fetch(&numTracees, 1, __ATOMIC_ACQ_REL);
+  if(pthread_mutex_unlock(&tracerLock)) return ret_t::LockFailed;
+
+  // Set up the child after the tracer resumes the parent
+  if(target == &tracer) {
+    if(pthread_mutex_lock(&tracerLock)) return ret_t::LockFailed;
+    tracer.handoffs.emplace_back(std::move(tracee));
+    if(pthread_mutex_unlock(&tracerLock)) return ret_t::LockFailed;
+    return ret_t::Success;
   }
 
-  if(it == children.end()) code = ret_t::ChildHandlerCleanupFailed;
-  if(pthread_mutex_unlock(&childLock)) code = ret_t::LockFailed;
+  // Hand off tracing & wake up the new tracer, which attaches to the child
+  tracee.handedOff = true;
+  if((code = child->detachHandoff()) != ret_t::Success) {
+    transformer->cleanup();
+    if(pthread_mutex_lock(&tracerLock)) return ret_t::LockFailed;
+    target->load--;
+    __atomic_add_fetch(&numTracees, -1, __ATOMIC_ACQ_REL);
+    if(pthread_mutex_unlock(&tracerLock)) return ret_t::LockFailed;
+    return code;
+  }
+  if(pthread_mutex_lock(&tracerLock)) return ret_t::LockFailed;
+  target->handoffs.emplace_back(std::move(tracee));
+  if(pthread_mutex_unlock(&tracerLock)) return ret_t::LockFailed;
+  if(sem_post(&target->wake)) return ret_t::SemaphoreFailed;
+  if(pthread_kill(target->thread, SIGINT)) return ret_t::HandoffFailed;
 
-  return code;
+  return ret_t::Success;
 }
 
-static ret_t joinHandlers() {
-  list<pthread_t>::iterator it;
-  ret_t code = ret_t::Success;
-  static bool joining = false;
-
-  // forkedChildLoop() returns a ret_t disguised as a void *.  Trick the
-  // compiler into letting us interpret the return value as a ret_t.
-  union {
-    void *raw;
-    ret_t retVal;
-  } tmp;
-
-  // Check if somebody else is already joining children.  It's okay if this
-  // is stale, we'd rather not block handlers that have better things to do.
-  if(joining) return ret_t::Success;
-
-  if(pthread_mutex_lock(&joinLock)) return ret_t::LockFailed;
-  joining = true;
+/**
+ * Set up forked children (attaching to those handed off by other tracers) &
+ * start them running.
+ * @param tracer the tracer
+ */
+static void adoptHandoffs(Tracer &tracer) {
+  list<Tracee> adopted;
+  pid_t pid;
+  ret_t code;
 
-  for(it = toJoin.begin(); it != toJoin.end(); ++it) {
-    if(pthread_join(*it, &tmp.raw)) {
-      code = ret_t::ChildHandlerCleanupFailed;
-      break;
+  if(pthread_mutex_lock(&tracerLock)) ERROR("could not lock tracers" << endl);
+  adopted.splice(adopted.end(), tracer.handoffs);
+  if(pthread_mutex_unlock(&tracerLock))
+    ERROR("could not unlock tracers" << endl);
+
+  for(auto it = adopted.begin(); it != adopted.end(); ) {
+    // Become the child's tracer
+    pid = it->proc->getPid();
+    if(it->handedOff &&
+       (code = it->proc->attachHandoff()) != ret_t::Success) {
+      WARN(pid << ": could not attach from handoff: " << retText(code)
+           << endl);
+      it = finishTracee(tracer, adopted, it);
+      continue;
     }
-    code = tmp.retVal;
 
-    if(code != ret_t::Success) {
-      // TODO print PID of exiting process
-      WARN("handler exited with error: " << retText(code) << endl);
-      code = ret_t::Success;
+    // Set up the child's code; it runs the code inherited from the parent
+    // until its first randomization is generated
+    if((code = it->CT->finishInitialization(randomize)) != ret_t::Success) {
+      WARN(pid << ": could not set up code transformer: " << retText(code)
+           << endl);
+      it = finishTracee(tracer, adopted, it);
+      continue;
     }
-  }
-  toJoin.clear();
-
-  joining = false;
-  if(pthread_mutex_unlock(&joinLock)) return ret_t::LockFailed;
 
-  return code;
+    INFO(pid << ": beginning forked child on tracer " << tracer.id << endl);
+    resumeTracee(*it);
+    ++it;
+  }
+  tracer.tracees.splice(tracer.tracees.end(), adopted);
 }
 
-static Process::status_t handleEvent(CodeTransformer &CT) {
-  Process &child = CT.getProcess();
+/**
+ * Handle an event reported by a process & resume it.
+ * @param tracer the process' tracer
+ * @param tracee the process, which must not be running
+ * @return true if the process is still alive or false if it exited
+ */
+static bool handleEvent(Tracer &tracer, Tracee &tracee) {
+  Process &child = *tracee.proc;
+  CodeTransformer &CT = *tracee.CT;
   pid_t pid = child.getPid();
   ret_t code;
   uintptr_t pc;
+  Timer t;
 #ifdef DEBUG_BUILD
   long syscall;
 
-  if(tracing) {
-    code = child.singleStep();
-
-    // Triggering a re-randomization only occurs when interrupting a wait, but
-    // when single-stepping through the child there's basically no window to be
-    // interrupted.  Instead, force a re-randomization if the flag is set.
-    if(__atomic_exchange_n(&doRerandomize, false, __ATOMIC_ACQUIRE))
-      child.setStatus(Process::Interrupted);
-  }
-  else if(verboseDebug) code = child.continueToNextSignalOrSyscall();
-  else
+  // Force a re-randomization at the next step if an alarm rang while tracing
+  if(tracing && child.getStatus() == Process::Stopped &&
+     __atomic_exchange_n(&doRerandomize, false, __ATOMIC_ACQUIRE))
+    child.setStatus(Process::Interrupted);
 #endif
-  code = child.continueToNextSignal();
-  if(code != ret_t::Success)
-    ERROR(pid << ": could not continue to next event: " << retText(code)
-          << endl);
-
-  // We're a big happy family, distribute cleanup work between handlers (any
-  // thread is joinable by any other thread) because we don't want to rely only
-  // on the main thread to join children as it may be waiting for a while.
-  code = joinHandlers();
-  if(code != ret_t::Success)
-    WARN(pid << ": could not join handler: " << retText(code) << endl);
 
   switch(child.getStatus()) {
-  default: INFO(pid << ": unknown status"); return Process::Unknown;
+  default: ERROR(pid << ": unknown status" << endl); return false;
   case Process::Stopped:
     DEBUG(
       if(tracing && child.getSignal() == SIGTRAP) {
@@ -418,7 +619,8 @@ static Process::status_t handleEvent(CodeTransformer &CT) {
       break;
     case stop_t::Fork:
       INFO(pid << ": forked process " << child.getNewTaskPid() << endl);
-      code = addChild(child.getNewTaskPid(), CT);
+      code = addChild(tracer, child.getNewTaskPid(), CT,
+                      child.takeStrayStop(child.getNewTaskPid()));
       break;
     }
 
@@ -427,19 +629,47 @@ static Process::status_t handleEvent(CodeTransformer &CT) {
             child.dumpRegs(std::cerr));
       ERROR(pid << ": handling stop event failed: " << retText(code) << endl);
     }
-
-    return Process::Stopped;
+    break;
   case Process::Exited:
     INFO(pid << ": exited with code " << child.getExitCode() << endl);
-    return Process::Exited;
+    return false;
   case Process::SignalExit:
     INFO(pid << ": terminated with signal " << child.getSignal() << endl);
-    return Process::SignalExit;
+    return false;
   case Process::Interrupted:
     pc = child.getPC();
     DEBUGMSG(pid << ": interrupted child at 0x" << hex << pc << endl);
 
-    if(randomize) {
+    // Switch back to the original code & stop tracing the child, or try
+    // again at the next interrupt if its threads can't be switched yet
+    if(detaching) {
+      t.start();
+      code = CT.restoreOriginalCode(randomize);
+      t.end();
+      switch(code) {
+      case ret_t::Success:
+        INFO(pid << ": restoring original code: " << t.elapsed(Timer::Micro)
+             << " us" << endl);
+        return false;
+      case ret_t::NoTransformMetadata: // fall through
+      case ret_t::UnmappedMemory:
+      case ret_t::AdvancingFailed:
+      case ret_t::TransformFailed:
+        WARN(pid << ": retrying restoring original code at 0x" << hex << pc
+             << ": " << retText(code) << endl);
+        break;
+      case ret_t::InvalidState: // fall through
+      case ret_t::DoesNotExist:
+        INFO(pid << ": child died/exited while restoring original code"
+             << endl);
+        return child.getStatus() != Process::Exited &&
+               child.getStatus() != Process::SignalExit;
+      default:
+        ERROR(pid << ": could not restore original code: " << retText(code)
+              << endl);
+      }
+    }
+    else if(randomize) {
       code = CT.rerandomize();
       switch(code) {
       case ret_t::Success: break;
@@ -453,7 +683,8 @@ static Process::status_t handleEvent(CodeTransformer &CT) {
       default:
         if(code == ret_t::InvalidState) {
           INFO(pid << ": child died/exited while processing alarm" << endl);
-          return child.getStatus();
+          return child.getStatus() != Process::Exited &&
+                 child.getStatus() != Process::SignalExit;
         }
         else ERROR(pid << ": could not re-randomize child: " << retText(code)
                    << std::endl);
@@ -472,70 +703,210 @@ static Process::status_t handleEvent(CodeTransformer &CT) {
       )
     }
 
-    // Unblock interrupt signals for next alarm
+    // Resume from the interrupt
     child.setStatus(Process::Interrupted);
-    if((code = child.restoreInterrupt()) != ret_t::Success)
-      ERROR("could not restore signals: " << retText(code) << endl);
-
-    return Process::Stopped;
+    break;
   }
+
+  resumeTracee(tracee);
+  return true;
 }
 
-static void *forkedChildLoop(void *p) {
-  HandlerArgs *args = (HandlerArgs *)p;
-  Process *child = args->child;
-  pid_t cpid = child->getPid();
-  Process::status_t status;
-  ret_t code = ret_t::Success;
-
-  // Note: cleanupChild() removes the process &handler from the children list,
-  // which destroys the Process object pointed to by child.  After the call,
-  // child is no longer valid - do not use!
-
-  // Become the child's tracer
-  if((code = child->attachHandoff()) != ret_t::Success) {
-    DEBUGMSG(cpid << ": could not attach from handoff" << endl);
-    child->detach();
-    cleanupChild(child);
-    return (void *)code;
+
+/**
+ * Handle events for a process until it's left running with no more events to
+ * report.
+ * @param tracer the process' tracer
+ * @param tracee the process
+ * @return true if the process is still alive or false if it exited
+ */
+static bool handlePendingEvents(Tracer &tracer, Tracee &tracee) {
+  Process &child = *tracee.proc;
+  ret_t code;
+
+  while(true) {
+    if(child.getStatus() == Process::Running) {
+      if((code = child.pollEvent()) != ret_t::Success)
+        ERROR(child.getPid() << ": could not handle event: " << retText(code)
+              << endl);
+      if(child.getStatus() == Process::Running) return true;
+    }
+    if(!handleEvent(tracer, tracee)) return false;
   }
+}
 
-  // Initialize transformation machinery.  Note that we don't have to re-map
-  // child's code - the re-mapped VMA should be inherited from the parent.
-  CodeTransformer transformer(*child, *binary, 1, maxPadding);
-  code = transformer.initializeFromExisting(*args->parentCT, randomize);
+/**
+ * Interrupt a process for an alarm & re-randomize it.  If the process reports
+ * another event (or exits) before the interrupt arrives, the event is handled
+ * instead & the process is re-randomized at the next alarm.
+ * @param tracer the process' tracer
+ * @param tracee the process
+ * @return true if the process is still alive or false if it exited
+ */
+static bool interruptTracee(Tracer &tracer, Tracee &tracee) {
+  Process &child = *tracee.proc;
+  ret_t code;
+
+  code = child.interrupt();
   if(code != ret_t::Success) {
-    DEBUGMSG(cpid << ": could not set up code transformer" << endl);
-    transformer.cleanup();
-    cleanupChild(child);
-    return (void *)code;
+    DEBUGMSG(child.getPid() << ": could not interrupt child: "
+             << retText(code) << endl);
+    if(child.getStatus() == Process::Running ||
+       child.getStatus() == Process::Unknown)
+      ERROR(child.getPid() << ": could not interrupt child: "
+            << retText(code) << endl);
+  }
+  return handlePendingEvents(tracer, tracee);
+}
+
+/**
+ * Pass an event to the process owning the reporting task & handle it.
+ * @param tracer the tracer which waited for the event
+ * @param task the task reporting the event
+ * @param wstatus the wait status
+ */
+static void dispatchEvent(Tracer &tracer, pid_t task, int wstatus) {
+  ret_t code;
+
+  for(auto it = tracer.tracees.begin(); it != tracer.tracees.end(); ++it) {
+    if(!it->proc->ownsTask(task)) continue;
+    if((code = it->proc->deliver(task, wstatus)) != ret_t::Success)
+      ERROR(task << ": could not handle event: " << retText(code) << endl);
+    if(!handlePendingEvents(tracer, *it))
+      finishTracee(tracer, tracer.tracees, it);
+    return;
   }
 
-  if(sem_post(&args->finishedInit)) {
-    DEBUGMSG(cpid << ": could not signal end of initialization" << endl);
-    transformer.cleanup();
-    cleanupChild(child);
-    return (void *)ret_t::SemaphoreFailed;
+  // Not part of any process we know about (yet), e.g., a forked child's
+  // initial stop arriving before the parent's fork event
+  Process::saveStrayEvent(task, wstatus);
+}
+
+/**
+ * Trace processes until every process traced by chameleon has exited.
+ * @param tracer the tracer
+ */
+static void runTracer(Tracer &tracer) {
+  list<Tracee>::iterator it;
+  pid_t task;
+  int wstatus, signo;
+  sigset_t intSig, wakeSigs;
+  ret_t code;
+
+  // Interrupts are never delivered to tracers; they stay pending until the
+  // tracer has nothing else to do & waits for them (along with SIGCHLD,
+  // blocked in every thread) so that pokes sent at any point aren't lost
+  sigemptyset(&intSig);
+  sigaddset(&intSig, SIGINT);
+  if(pthread_sigmask(SIG_BLOCK, &intSig, nullptr))
+    ERROR("could not block interrupts for tracer " << tracer.id << endl);
+  wakeSigs = intSig;
+  sigaddset(&wakeSigs, SIGCHLD);
+
+  while(true) {
+    // Take over children handed off by other tracers & handle events consumed
+    // before waiting, e.g., while stopping a process' threads
+    adoptHandoffs(tracer);
+    for(it = tracer.tracees.begin(); it != tracer.tracees.end(); ) {
+      if(handlePendingEvents(tracer, *it)) ++it;
+      else it = finishTracee(tracer, tracer.tracees, it);
+    }
+
+    // Re-randomize every process if an alarm rang
+    if(__atomic_exchange_n(&tracer.alarm, false, __ATOMIC_ACQUIRE)) {
+      for(it = tracer.tracees.begin(); it != tracer.tracees.end(); ) {
+        if(interruptTracee(tracer, *it)) ++it;
+        else it = finishTracee(tracer, tracer.tracees, it);
+      }
+    }
+
+    // Detach from every process if asked to
+    if(detaching) {
+      for(it = tracer.tracees.begin(); it != tracer.tracees.end(); ) {
+        if(interruptTracee(tracer, *it)) ++it;
+        else it = finishTracee(tracer, tracer.tracees, it);
+      }
+    }
+
+    // With nothing to trace, wait for a handoff or for everybody to exit
+    if(tracer.tracees.empty()) {
+      if(!__atomic_load_n(&numTracees, __ATOMIC_ACQUIRE)) break;
+      if(MASK_INT(sem_wait(&tracer.wake)))
+        ERROR("tracer " << tracer.id << " could not wait for handoffs"
+              << endl);
+      continue;
+    }
+
+    // Handle the next event from any of our processes
+    if((code = Process::waitAny(task, wstatus, false)) != ret_t::Success)
+      ERROR("tracer " << tracer.id << " could not wait for events: "
+            << retText(code) << endl);
+    if(task != -1) {
+      dispatchEvent(tracer, task, wstatus);
+      continue;
+    }
+
+    // Otherwise sleep until one of our processes reports an event or we're
+    // poked.  Processes that couldn't be detached from yet are retried right
+    // away.
+    if(detaching) continue;
+    do {
+      signo = sigwaitinfo(&wakeSigs, nullptr);
+    } while(signo == -1 && errno == EINTR);
+    if(signo == -1)
+      ERROR("tracer " << tracer.id << " could not wait for events: "
+            << strerror(errno) << endl);
+
+    // SIGCHLD is sent to the whole process & may have been meant for another
+    // tracer's processes, so pass it on
+    if(signo == SIGCHLD)
+      for(auto &t : tracers)
+        if(t.get() != &tracer && pthread_kill(t->thread, SIGINT))
+          ERROR("could not wake up tracer " << t->id << endl);
   }
 
-  INFO(cpid << ": beginning forked child" << endl);
+  DEBUGMSG("tracer " << tracer.id << " exiting" << endl);
+}
 
-  do {
-    status = handleEvent(transformer);
-  } while(status != Process::Exited && status != Process::SignalExit);
+static void *tracerLoop(void *p) {
+  Tracer *tracer = (Tracer *)p;
+  DEBUGMSG("starting tracer " << tracer->id << endl);
+  runTracer(*tracer);
+  return nullptr;
+}
 
-  INFO(cpid << ": cleaning up forked child" << endl);
-  if(transformer.cleanup() != ret_t::Success)
-    WARN(cpid << ": problem cleaning up code transformer" << endl);
-  cleanupChild(child);
+/**
+ * Start the tracers.  The calling (main) thread becomes the first tracer.
+ * @return a return code describing the outcome
+ */
+static ret_t startTracers() {
+  size_t i;
+
+  tracers.reserve(numTracers);
+  for(i = 0; i < numTracers; i++) {
+    tracers.emplace_back(new Tracer);
+    Tracer &tracer = *tracers.back();
+    tracer.id = i;
+    tracer.load = 0;
+    tracer.alarm = false;
+    if(sem_init(&tracer.wake, 0, 0)) return ret_t::SemaphoreFailed;
+    if(!i) tracer.thread = pthread_self();
+    else if(pthread_create(&tracer.thread, nullptr, tracerLoop, &tracer)) {
+      WARN("could only start " << i << " tracer(s)" << endl);
+      sem_destroy(&tracer.wake);
+      tracers.pop_back();
+      break;
+    }
+  }
 
-  return (void *)code;
+  return ret_t::Success;
 }
 
 int main(int argc, char **argv) {
-  int remaining;
+  size_t i;
   ret_t code;
-  Process::status_t status;
+  Process *child;
+  CodeTransformer *transformer;
   Alarm alarm;
   Timer t;
 
@@ -544,7 +915,6 @@ int main(int argc, char **argv) {
   DEBUGMSG("initializing chameleon" << endl);
   if(!checkCompatibility()) ERROR("incompatible system" << endl);
   masterPID = getpid();
-  masterThread = pthread_self();
   parseArgs(argc, argv);
   if((code = setupSignalsAndAlarm(alarm)) != ret_t::Success)
     ERROR("could not initialize chameleon signaling: " << retText(code) << endl);
@@ -568,7 +938,11 @@ int main(int argc, char **argv) {
   t.end();
   INFO("chameleon setup: " << t.elapsed(Timer::Micro) << " us" << endl);
 
-  INFO("Starting '" << childArgv[0] << "'" << endl);
+  if(attachPid) {
+    INFO("Attaching to " << attachPid << " ('" << childArgv[0] << "')"
+         << endl);
+  }
+  else INFO("Starting '" << childArgv[0] << "'" << endl);
   t.start();
 
   // Initialize libelf/disassembler, load the binary (including all metadata)
@@ -585,20 +959,40 @@ int main(int argc, char **argv) {
 
   // Initialize the main child process & it's transformer
   DEBUG(parasite::initializeLog(verboseDebug));
-  Process child(childArgc, childArgv);
-  code = child.forkAndExec();
+  if(attachPid) {
+    child = new Process(attachPid, childArgc, childArgv);
+    code = child->attachRunning();
+  }
+  else {
+    child = new Process(childArgc, childArgv);
+    code = child->forkAndExec();
+  }
   if(code != ret_t::Success)
     ERROR("could not set up child for tracing: " << retText(code) << endl);
   CodeTransformer::globalInitialize();
-  CodeTransformer transformer(child, *binary, 1, maxPadding);
-  code = transformer.initialize(randomize);
+  transformer = new CodeTransformer(*child, *binary, batchedFaults,
+                                    maxPadding, prefetchDepth,
+                                    scrambleThreads, numEpochs, numShards,
+                                    coldPeriod);
+  code = transformer->initialize(randomize, attachPid != 0);
   if(code != ret_t::Success)
     ERROR("could not set up state transformer: " << retText(code) << endl);
 
   t.end();
-  INFO(child.getPid() << ": application startup: " << t.elapsed(Timer::Micro)
-       << " us" << endl);
-  INFO(child.getPid() << ": beginning main child" << endl);
+  INFO(child->getPid() << ": application " << (attachPid ? "attach"
+                                                        : "startup") << ": "
+       << t.elapsed(Timer::Micro) << " us" << endl);
+
+  // Start the tracers, the main thread traces the main child.  Account for
+  // the main child first so the other tracers wait for handoffs.
+  numTracees = 1;
+  if((code = startTracers()) != ret_t::Success)
+    ERROR("could not start tracers: " << retText(code) << endl);
+  if(attachPid && (code = setupDetaching()) != ret_t::Success)
+    ERROR("could not set up detaching: " << retText(code) << endl);
+  tracers[0]->tracees.emplace_back(child, transformer, true);
+  tracers[0]->load = 1;
+  INFO(child->getPid() << ": beginning main child" << endl);
 
   if(randomizePeriod) {
     code = alarm.start();
@@ -606,23 +1000,15 @@ int main(int argc, char **argv) {
       ERROR("could not start alarm: " << retText(code) << endl);
   }
 
-  do {
-    status = handleEvent(transformer);
-  } while(status != Process::Exited && status != Process::SignalExit);
+  resumeTracee(tracers[0]->tracees.back());
+  runTracer(*tracers[0]);
 
-  INFO(child.getPid() << ": cleaning up main child " << endl);
-  code = transformer.cleanup();
-  if(code != ret_t::Success)
-    ERROR("could not clean up clean up transformer" << retText(code) << endl);
-
-  // We need to wait for all children to finish up, as exiting the main thread
-  // will kill the handlers and their handled children
-  while((remaining = __atomic_load_n(&numChildren, __ATOMIC_ACQUIRE))) {
-    DEBUGMSG("waiting for all children to join" << endl);
-    if(syncWait(&numChildren, remaining))
-      ERROR("could not wait for children to exit: " << strerror(errno) << endl);
-    joinHandlers();
-  }
+  // We need to wait for all tracers to finish up, as exiting the main thread
+  // will kill the tracers and their traced children
+  DEBUGMSG("waiting for all tracers to join" << endl);
+  for(i = 1; i < tracers.size(); i++)
+    if(pthread_join(tracers[i]->thread, nullptr))
+      ERROR("could not join tracer " << i << endl);
 
   if(randomizePeriod) {
     code = alarm.stop();
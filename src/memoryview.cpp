@@ -1,4 +1,9 @@
+#include <algorithm>
 #include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
 
 #include "log.h"
 #include "memoryview.h"
@@ -74,6 +79,280 @@ byte_iterator BufferedRegion::getData(uintptr_t address) {
   else return byte_iterator::empty();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Copy-on-write region implementation
+///////////////////////////////////////////////////////////////////////////////
+
+PagePool::PagePool() : numBlocks(0), capacity(0) {
+  fd = syscall(SYS_memfd_create, "chameleon-pages", MFD_CLOEXEC);
+  if(fd < 0) ERROR("could not create page pool" << std::endl);
+  pthread_mutex_init(&lock, nullptr);
+}
+
+PagePool::~PagePool() {
+  close(fd);
+  pthread_mutex_destroy(&lock);
+}
+
+bool PagePool::reserve(size_t num) {
+  size_t newCapacity;
+
+  if(num <= capacity) return true;
+  newCapacity = std::max<size_t>(capacity * 2, num);
+  if(ftruncate(fd, newCapacity * PAGESZ)) return false;
+  capacity = newCapacity;
+  refCount.resize(capacity, 0);
+  return true;
+}
+
+ssize_t PagePool::allocate(size_t num) {
+  ssize_t first = -1;
+  size_t i, run;
+
+  pthread_mutex_lock(&lock);
+
+  // Prefer recycling a run of freed blocks so compacting views doesn't grow
+  // the file every time
+  if(num && freeBlocks.size() >= num) {
+    std::sort(freeBlocks.begin(), freeBlocks.end());
+    for(i = 0, run = 0; i < freeBlocks.size(); i++) {
+      if(i && freeBlocks[i] == freeBlocks[i - 1] + 1) run++;
+      else run = 1;
+      if(run == num) {
+        first = freeBlocks[i + 1 - num];
+        freeBlocks.erase(freeBlocks.begin() + (i + 1 - num),
+                         freeBlocks.begin() + (i + 1));
+        for(run = 0; run < num; run++) refCount[first + run] = 1;
+        break;
+      }
+    }
+  }
+
+  if(first < 0 && reserve(numBlocks + num)) {
+    first = numBlocks;
+    for(size_t i = 0; i < num; i++) refCount[numBlocks++] = 1;
+  }
+  pthread_mutex_unlock(&lock);
+  return first;
+}
+
+ssize_t PagePool::allocate() {
+  ssize_t block;
+
+  pthread_mutex_lock(&lock);
+  if(freeBlocks.size()) {
+    block = freeBlocks.back();
+    freeBlocks.pop_back();
+    refCount[block] = 1;
+  }
+  else if(reserve(numBlocks + 1)) {
+    block = numBlocks++;
+    refCount[block] = 1;
+  }
+  else block = -1;
+  pthread_mutex_unlock(&lock);
+  return block;
+}
+
+void PagePool::get(const std::vector<size_t> &blocks) {
+  pthread_mutex_lock(&lock);
+  for(auto block : blocks) refCount[block]++;
+  pthread_mutex_unlock(&lock);
+}
+
+void PagePool::put(size_t block) {
+  pthread_mutex_lock(&lock);
+  assert(refCount[block] && "Dropping unreferenced block");
+  if(--refCount[block] == 0) freeBlocks.push_back(block);
+  pthread_mutex_unlock(&lock);
+}
+
+void PagePool::put(const std::vector<size_t> &blocks) {
+  pthread_mutex_lock(&lock);
+  for(auto block : blocks) {
+    assert(refCount[block] && "Dropping unreferenced block");
+    if(--refCount[block] == 0) freeBlocks.push_back(block);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+bool PagePool::exclusive(size_t block) {
+  bool single;
+  pthread_mutex_lock(&lock);
+  single = (refCount[block] == 1);
+  pthread_mutex_unlock(&lock);
+  return single;
+}
+
+CowRegion::CowRegion(uintptr_t start,
+                     size_t len,
+                     size_t fileLen,
+                     byte_iterator data)
+    : MemoryRegion(start, len), pool(new PagePool),
+      pageStart(PAGE_DOWN(start)) {
+  size_t numPages = PAGE_ALIGN_LEN(start, len) / PAGESZ;
+  ssize_t first;
+
+  assert(data.getLength() >= fileLen && "Invalid CowRegion");
+  fileLen = std::min<size_t>(len, fileLen);
+  if((first = pool->allocate(numPages)) < 0)
+    ERROR("could not allocate pages for copy-on-write region" << std::endl);
+  blocks.reserve(numPages);
+  for(size_t i = 0; i < numPages; i++) blocks.push_back(first + i);
+  pthread_mutex_init(&lock, nullptr);
+  if(!mapView())
+    ERROR("could not map copy-on-write region" << std::endl);
+
+  // Freshly-allocated blocks are zero-filled, only copy in on-disk data
+  memcpy(&view[start - pageStart], *data, fileLen);
+}
+
+CowRegion::CowRegion(const CowRegion &rhs)
+    : MemoryRegion(rhs.start, rhs.len), pool(rhs.pool),
+      pageStart(rhs.pageStart), blocks(rhs.blocks) {
+  pool->get(blocks);
+  pthread_mutex_init(&lock, nullptr);
+
+  // Every run of blocks costs a mapping, and the number of mappings per
+  // process is limited.  Rather than carrying a fragmented layout into every
+  // copy, copy the data into contiguous blocks & map it all at once.  Do the
+  // same if sharing the blocks can't be mapped, e.g., at the mapping limit.
+  if(rhs.runs > maxViewRuns || !mapView()) {
+    if(!compact(rhs.view) || !mapView())
+      ERROR("could not map copy-on-write region" << std::endl);
+  }
+}
+
+CowRegion::~CowRegion() {
+  if(view) munmap(view, blocks.size() * PAGESZ);
+  pool->put(blocks);
+  pthread_mutex_destroy(&lock);
+}
+
+bool CowRegion::mapView() {
+  size_t i, run, size = blocks.size() * PAGESZ;
+  void *ret;
+
+  // Reserve the entire view up front so the blocks land contiguously, then
+  // map each run of consecutive blocks over it
+  view = (unsigned char *)mmap(nullptr, size, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(view == MAP_FAILED) {
+    view = nullptr;
+    return false;
+  }
+
+  for(i = 0, runs = 0; i < blocks.size(); i += run, runs++) {
+    for(run = 1; i + run < blocks.size(); run++)
+      if(blocks[i + run] != blocks[i] + run) break;
+    ret = mmap(&view[i * PAGESZ], run * PAGESZ, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, pool->getFd(), blocks[i] * PAGESZ);
+    if(ret == MAP_FAILED) {
+      munmap(view, size);
+      view = nullptr;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CowRegion::compact(const unsigned char *data) {
+  size_t i, size = blocks.size() * PAGESZ;
+  std::vector<size_t> newBlocks;
+  ssize_t first, written;
+
+  if((first = pool->allocate(blocks.size())) < 0) return false;
+  newBlocks.reserve(blocks.size());
+  for(i = 0; i < blocks.size(); i++) newBlocks.push_back(first + i);
+
+  for(i = 0; i < size; i += written) {
+    written = pwrite(pool->getFd(), data + i, size - i, first * PAGESZ + i);
+    if(written <= 0) {
+      pool->put(newBlocks);
+      return false;
+    }
+  }
+
+  pool->put(blocks);
+  blocks = std::move(newBlocks);
+  return true;
+}
+
+size_t CowRegion::breaksAround(size_t page) const {
+  size_t breaks = 0;
+  if(page && blocks[page] != blocks[page - 1] + 1) breaks++;
+  if(page + 1 < blocks.size() && blocks[page + 1] != blocks[page] + 1)
+    breaks++;
+  return breaks;
+}
+
+bool CowRegion::unshare(size_t page) {
+  unsigned char *pageData = &view[page * PAGESZ];
+  ssize_t block;
+  void *ret;
+
+  if(pool->exclusive(blocks[page])) return true;
+  if((block = pool->allocate()) < 0) return false;
+
+  // Copy the current contents into the new block before swapping it into the
+  // view, other regions keep mapping the original block
+  if(pwrite(pool->getFd(), pageData, PAGESZ, block * PAGESZ) != PAGESZ) {
+    pool->put(block);
+    return false;
+  }
+  ret = mmap(pageData, PAGESZ, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, pool->getFd(), block * PAGESZ);
+  if(ret == MAP_FAILED) {
+    pool->put(block);
+    return false;
+  }
+
+  pool->put(blocks[page]);
+  runs -= breaksAround(page);
+  blocks[page] = block;
+  runs += breaksAround(page);
+  return true;
+}
+
+MemoryRegion *CowRegion::copy() const { return new CowRegion(*this); }
+
+size_t CowRegion::populate(uintptr_t address,
+                           std::vector<char> &buffer,
+                           size_t offset) const {
+  ssize_t regOffset = address - start;
+  ssize_t copyLen = std::min<ssize_t>(buffer.size() - offset, len - regOffset);
+  assert(copyLen >= 0 && "Invalid offset or address not contained in region");
+  memcpy(&buffer[offset], &view[address - pageStart], copyLen);
+  return copyLen;
+}
+
+byte_iterator CowRegion::getData(uintptr_t address) {
+  ssize_t regOffset = address - start;
+  assert(len - regOffset >= 0 && "Invalid address");
+  if(regOffset >= 0)
+    return byte_iterator(&view[address - pageStart], len - regOffset);
+  else return byte_iterator::empty();
+}
+
+byte_iterator CowRegion::getWritableData(uintptr_t address, size_t len) {
+  ssize_t regOffset = address - start;
+  uintptr_t page, end;
+  bool success = true;
+
+  if(regOffset < 0 || !contains(address)) return byte_iterator::empty();
+  end = address + std::min<size_t>(len, this->len - regOffset);
+
+  // Writers of neighboring data may share boundary pages; make sure only one
+  // of them duplicates each page
+  pthread_mutex_lock(&lock);
+  for(page = PAGE_DOWN(address); page < end && success; page += PAGESZ)
+    success = unshare((page - pageStart) / PAGESZ);
+  pthread_mutex_unlock(&lock);
+
+  if(success) return getData(address);
+  else return byte_iterator::empty();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // MemoryWindow implementation
 ///////////////////////////////////////////////////////////////////////////////
@@ -173,3 +452,11 @@ byte_iterator MemoryWindow::getData(uintptr_t address) {
   else return byte_iterator::empty();
 }
 
+byte_iterator MemoryWindow::getWritableData(uintptr_t address, size_t len) {
+  ssize_t regNum = findRight<MemoryRegionPtr, uintptr_t,
+                             regionContains, lessThanRegion>
+                            (&regions[0], regions.size(), address);
+  if(regNum >= 0 && regions[regNum]->contains(address))
+    return regions[regNum]->getWritableData(address, len);
+  else return byte_iterator::empty();
+}
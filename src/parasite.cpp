@@ -2,6 +2,7 @@
 // include log.h!
 #include <unistd.h>
 #include <cassert>
+#include <cstring>
 extern "C" {
 #include <compel/compel.h>
 }
@@ -57,6 +58,15 @@ int parasite::stealUFFD(struct parasite_ctl *ctx) {
   return uffd;
 }
 
+int parasite::passCodeFD(struct parasite_ctl *ctx, int fd) {
+  union parasiteArgs *args;
+  if(compel_rpc_call(SET_CODE_FD, ctx) ||
+     compel_util_send_fd(ctx, fd) ||
+     compel_rpc_sync(SET_CODE_FD, ctx)) return -1;
+  args = compel_parasite_args(ctx, union parasiteArgs);
+  return args->codeFd;
+}
+
 ret_t parasite::cure(struct parasite_ctl **ctx)
 {
   if(compel_cure(*ctx) == 0) {
@@ -72,6 +82,24 @@ ret_t parasite::syscall(struct parasite_ctl *ctx, long syscall, long &sysRet,
   return ret == 0 ? ret_t::Success : ret_t::CompelSyscallFailed;
 }
 
+ret_t parasite::syscalls(struct parasite_ctl *ctx,
+                         struct parasiteSyscall *calls,
+                         size_t num) {
+  size_t i, cur;
+  union parasiteArgs *args = compel_parasite_args(ctx, union parasiteArgs);
+
+  for(i = 0; i < num; i += cur) {
+    cur = num - i < MAX_BATCHED_SYSCALLS ? num - i : MAX_BATCHED_SYSCALLS;
+    args->batch.num = cur;
+    memcpy(args->batch.calls, &calls[i], sizeof(*calls) * cur);
+    if(compel_rpc_call_sync(SYSCALL_BATCH, ctx))
+      return ret_t::CompelSyscallFailed;
+    memcpy(&calls[i], args->batch.calls, sizeof(*calls) * cur);
+    if(args->batch.num != cur) return ret_t::CompelSyscallFailed;
+  }
+  return ret_t::Success;
+}
+
 uintptr_t parasite::infectAddress(struct parasite_ctl *ctx) {
   struct infect_ctx *ictx = compel_infect_ctx(ctx);
   if(ictx) return ictx->syscall_ip;
@@ -5,6 +5,8 @@
  *   - Create userfaultfd file descriptors
  *   - Change memory mappings
  *   - Evicting pages to force new page faults for randomization
+ *   - Receive file descriptors containing pre-rendered code
+ *   - Execute batches of system calls
  *
  * Author: Rob Lyerly <rlyerly@vt.edu>
  * Date: 1/8/2019
@@ -17,6 +19,8 @@
 #undef COMPEL_PLUGIN_STD_STD_H__
 #include <compel/plugins/plugin-fds.h>
 
+#include <errno.h>
+
 #include "parasite.h"
 
 #define ERROR( fmt, ... ) \
@@ -42,12 +46,57 @@ static int createAndSendUFFD(void) {
   return ret;
 }
 
+static int receiveCodeFD(union parasiteArgs *args) {
+  int fd;
+  if((fd = fds_recv_fd()) < 0) {
+    ERROR("could not receive code descriptor\n");
+    return -1;
+  }
+  DEBUG("received code descriptor %d\n", fd);
+  args->codeFd = fd;
+  return 0;
+}
+
+static long doSyscall(const struct parasiteSyscall *call) {
+  const long *a = call->args;
+  switch(call->nr) {
+  case __NR_mmap:
+    return (long)sys_mmap((void *)a[0], a[1], a[2], a[3], a[4], a[5]);
+  case __NR_munmap: return sys_munmap((void *)a[0], a[1]);
+  case __NR_mprotect: return sys_mprotect((void *)a[0], a[1], a[2]);
+  case __NR_madvise: return sys_madvise(a[0], a[1], a[2]);
+  default:
+    ERROR("unsupported system call %ld\n", call->nr);
+    return -ENOSYS;
+  }
+}
+
+static int runSyscalls(union parasiteArgs *args) {
+  unsigned long i;
+  struct parasiteSyscall *call;
+
+  // Stop at the first failing call (raw system calls return -errno);
+  // chameleon checks how many calls were run.
+  for(i = 0; i < args->batch.num; i++) {
+    call = &args->batch.calls[i];
+    call->ret = doSyscall(call);
+    if(call->ret < 0 && call->ret >= -4095) {
+      DEBUG("system call %ld failed: %ld\n", call->nr, call->ret);
+      break;
+    }
+  }
+  args->batch.num = i;
+  return 0;
+}
+
 int parasite_trap_cmd(int cmd, void *args) { return 0; }
 void parasite_cleanup(void) {}
 int parasite_daemon_cmd(int cmd, void *args) {
   switch(cmd) {
   default: DEBUG("Unknown command: %d\n", cmd); return 0;
   case GET_UFFD: return createAndSendUFFD();
+  case SET_CODE_FD: return receiveCodeFD((union parasiteArgs *)args);
+  case SYSCALL_BATCH: return runSyscalls((union parasiteArgs *)args);
   }
 }
 
@@ -1,5 +1,8 @@
+#include <algorithm>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
 #include <unistd.h>
@@ -7,6 +10,7 @@
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
@@ -23,6 +27,32 @@ using namespace chameleon;
  */
 size_t Process::defaultStackSize = 8 * 1024 * 1024;
 
+/*
+ * Events reported to the calling tracer thread for tasks other than the ones
+ * being waited on, e.g., a forked child's initial stop arriving before the
+ * fork event or events from another process traced by the same thread.  Only
+ * the tracer thread can wait for a task, so events are saved per-thread until
+ * claimed by the task's Process object (or by takeStrayStop()).
+ */
+static thread_local std::vector<std::pair<pid_t, int>> strayEvents;
+
+/**
+ * Claim a saved event for a task.
+ * @param task the task's ID
+ * @param wstatus output argument set to the event's wait status
+ * @return true if an event was saved for the task or false otherwise
+ */
+static bool takeStrayEvent(pid_t task, int &wstatus) {
+  for(auto it = strayEvents.begin(); it != strayEvents.end(); ++it) {
+    if(it->first == task) {
+      wstatus = it->second;
+      strayEvents.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
 /*
  * Note: compel's API is a little obtuse -- compel_prepare() allocates a
  * context and compel_infect() controls the child, whereas compel_cure() both
@@ -39,6 +69,7 @@ size_t Process::defaultStackSize = 8 * 1024 * 1024;
  */
 [[noreturn]] static void execChild(char **argv, int socket) {
   bool err = false;
+  sigset_t mask;
   pid_t me;
 
   // Wait for the parent to attach
@@ -55,6 +86,13 @@ size_t Process::defaultStackSize = 8 * 1024 * 1024;
     abort();
   }
 
+  // Don't pass chameleon's signal mask on to the application
+  sigemptyset(&mask);
+  if(sigprocmask(SIG_SETMASK, &mask, nullptr)) {
+    perror("Could not reset signal mask for application");
+    abort();
+  }
+
   // Let's do the dang thing
   execv(argv[0], argv);
   perror("Could not exec application");
@@ -83,9 +121,8 @@ ret_t Process::forkAndExec() {
     close(sockets[1]);
     return ret_t::ForkFailed;
   }
-  pid = child;
+  pid = tid = child;
   status = Running;
-  nthreads = 1;
 
   DEBUGMSG("forked child " << pid << std::endl);
 
@@ -110,15 +147,22 @@ ret_t Process::forkAndExec() {
   return initForkedChild();
 }
 
-ret_t Process::initForkedChild() {
+ret_t Process::initForkedChild(bool stopped) {
   ret_t code;
 
   // Wait for the child to reach a trace-stop & initialize
-  if((code = waitInternal(false)) != ret_t::Success) return code;
+  if(stopped) {
+    status = Stopped;
+    signal = SIGSTOP;
+    stopReason = stop_t::Other;
+  }
+  else if((code = waitInternal(false)) != ret_t::Success) return code;
   if(!(parasite = parasite::initialize(pid))) return ret_t::CompelInitFailed;
   if(sem_init(&handoff, 0, 0)) return ret_t::TraceSetupFailed;
   if((code = initializeStack()) != ret_t::Success) return code;
   if((code = initializeMemFD()) != ret_t::Success) return code;
+  threads.clear();
+  threads.emplace_back(pid, stackBounds);
 
   // TODO: without reading the registers, we get a floating-point exception
   // when using x87 (which may appear in odd places like printf).  Maybe it
@@ -131,22 +175,300 @@ ret_t Process::initForkedChild() {
   return ret_t::Success;
 }
 
-ret_t Process::traceThread(pid_t pid) {
-  // TODO handle multi-threading
-  return ret_t::NotImplemented;
+ret_t Process::attachRunning() {
+  char buf[128], *end;
+  DIR *dir;
+  struct dirent *ent;
+  struct user_regs_struct regs;
+  std::vector<pid_t> seen;
+  std::vector<std::pair<pid_t, int>> seized;
+  uintptr_t sp, mid;
+  pid_t thread, waited;
+  int wstatus;
+  bool found;
+  ret_t code;
+
+  DEBUGMSG("attaching to running process " << pid << std::endl);
+
+  if(status != Running || pid <= 0) return ret_t::InvalidState;
+  if((code = attach()) != ret_t::Success) return code;
+
+  // Seize & stop the rest of the threads.  Threads that haven't been seized
+  // yet may create new threads which aren't traced, so keep scanning the
+  // thread group until no new threads show up.
+  snprintf(buf, sizeof(buf), "/proc/%d/task", pid);
+  do {
+    found = false;
+    if(!(dir = opendir(buf))) return ret_t::FileOpenFailed;
+    while((ent = readdir(dir))) {
+      thread = strtol(ent->d_name, &end, 10);
+      if(*end || thread <= 0 || thread == pid ||
+         std::find(seen.begin(), seen.end(), thread) != seen.end()) continue;
+      seen.push_back(thread);
+      found = true;
+
+      // The thread may exit at any point before it stops
+      if(!trace::attach(thread, true) || !trace::interrupt(thread)) continue;
+      do {
+        waited = waitpid(thread, &wstatus, __WALL);
+      } while(waited == -1 && errno == EINTR);
+      if(waited == -1 || !WIFSTOPPED(wstatus)) continue;
+      if(!trace::traceProcessControl(thread)) {
+        closedir(dir);
+        return ret_t::PtraceFailed;
+      }
+      seized.emplace_back(thread, wstatus);
+    }
+    closedir(dir);
+  } while(found);
+
+  // With every thread stopped the process can be set up like a forked child
+  // whose initial stop was already reported
+  if((code = initForkedChild(true)) != ret_t::Success) return code;
+  allStopped = true;
+
+  // Unlike a newly-exec'd child, the main thread may already be using more
+  // of its stack than we can transform.  Stacks are transformed from one half
+  // of the bounds into the other, so everything from the stack pointer up to
+  // the top of the stack must fit in the top half.
+  if(!trace::getRegs(pid, regs)) return ret_t::PtraceFailed;
+  sp = arch::sp(regs);
+  mid = ROUND_DOWN((stackBounds.first + stackBounds.second) / 2, 16);
+  if(sp < mid || sp >= stackBounds.second) {
+    DEBUGMSG(pid << ": stack in use (0x" << std::hex << sp << " - 0x"
+             << stackBounds.second << ") doesn't fit in the top half of 0x"
+             << stackBounds.first << " - 0x" << stackBounds.second
+             << std::endl);
+    return ret_t::BadFormat;
+  }
+
+  // Events other than the interrupt are reported by the next wait
+  for(auto &s : seized) {
+    if((code = addThread(s.first, true)) != ret_t::Success) return code;
+    if(!trace::isInterruptStop(s.second)) {
+      threads.back().pending = true;
+      threads.back().pendingStatus = s.second;
+    }
+  }
+
+  DEBUGMSG("attached to " << pid << " with " << threads.size()
+           << " thread(s)" << std::endl);
+
+  return ret_t::Success;
+}
+
+/**
+ * Find the memory mapping containing an address in a process.
+ *
+ * @param pid the process' PID
+ * @param addr the address
+ * @param range output argument set to the mapping's address range
+ * @return true if found or false otherwise
+ */
+static bool findMapping(pid_t pid, uintptr_t addr, urange_t &range) {
+  char buf[128];
+  uintptr_t start, end;
+  std::string line;
+
+  snprintf(buf, sizeof(buf), "/proc/%d/maps", pid);
+  std::ifstream map(buf);
+  if(!map.is_open()) return false;
+
+  while(std::getline(map, line)) {
+    if(sscanf(line.c_str(), "%lx-%lx", &start, &end) != 2) continue;
+    if(start <= addr && addr < end) {
+      range.first = start;
+      range.second = end;
+      return true;
+    }
+  }
+  return false;
+}
+
+ret_t Process::traceThread(pid_t newThread) {
+  int wstatus;
+  pid_t waited;
+
+  // The thread's initial stop may have been reported before the clone event
+  if(findThread(newThread)) return ret_t::Success;
+
+  if(takeStrayEvent(newThread, wstatus)) waited = newThread;
+  else {
+    do {
+      waited = waitpid(newThread, &wstatus, __WALL);
+    } while(waited == -1 && errno == EINTR);
+  }
+  if(waited == -1 || !WIFSTOPPED(wstatus)) return ret_t::WaitFailed;
+  return addThread(newThread);
+}
+
+bool Process::takeStrayStop(pid_t child) {
+  for(auto it = strayEvents.begin(); it != strayEvents.end(); ++it) {
+    if(it->first == child && WIFSTOPPED(it->second)) {
+      strayEvents.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+void Process::saveStrayEvent(pid_t task, int wstatus)
+{ strayEvents.emplace_back(task, wstatus); }
+
+ret_t Process::waitAny(pid_t &task, int &wstatus, bool block) {
+  task = waitpid(-1, &wstatus, __WALL | __WNOTHREAD | (block ? 0 : WNOHANG));
+  if(task > 0) return ret_t::Success;
+  else if(task == 0 || errno == EINTR) {
+    task = -1;
+    return ret_t::Success;
+  }
+  DEBUGMSG("waiting for any tracee returned an error: " << strerror(errno)
+           << std::endl);
+  return ret_t::WaitFailed;
+}
+
+bool Process::ownsTask(pid_t task) {
+  char buf[128];
+
+  if(task == pid || findThread(task)) return true;
+
+  // New threads may report their initial stop before the clone event
+  snprintf(buf, sizeof(buf), "/proc/%d/task/%d", pid, task);
+  return access(buf, F_OK) == 0;
+}
+
+Process::Thread *Process::findThread(pid_t threadId) {
+  for(auto &thread : threads)
+    if(thread.tid == threadId) return &thread;
+  return nullptr;
+}
+
+ret_t Process::handleUnknownTask(pid_t task, int wstatus) {
+  char buf[128];
+
+  // Tasks in our thread group are new threads, otherwise it's either a new
+  // process or a task of another process traced by this thread
+  snprintf(buf, sizeof(buf), "/proc/%d/task/%d", pid, task);
+  if(WIFSTOPPED(wstatus) && access(buf, F_OK) == 0) return addThread(task);
+  DEBUGMSG(pid << ": saving event for task " << task << std::endl);
+  strayEvents.emplace_back(task, wstatus);
+  return ret_t::Success;
+}
+
+/* Maximum number of frames followed when finding a running thread's stack */
+static const size_t maxFrames = 4096;
+
+ret_t Process::addThread(pid_t newThread, bool running) {
+  struct user_regs_struct regs;
+  urange_t mapping;
+  uintptr_t sp, fp, top;
+  uint64_t next;
+  size_t i;
+
+  // New threads start executing at the top of the stack passed to clone().
+  // Anything above the initial stack pointer, e.g., thread-local storage,
+  // doesn't belong to the thread's frames and must be left alone.
+  if(!trace::getRegs(newThread, regs)) return ret_t::PtraceFailed;
+  sp = arch::sp(regs);
+  if(!findMapping(pid, sp, mapping)) return ret_t::BadFormat;
+  top = ROUND_DOWN(sp, 16);
+
+  // Threads that were already running have frames above their stack pointer
+  // but their initial stack pointer is long gone.  Follow the frame pointer
+  // chain up to the outermost frame instead.  Frame pointers must be aligned
+  // & strictly increase within the mapping; the chain ends at a null frame
+  // pointer, anything else means the thread isn't using frame pointers &
+  // its frames can't be found.
+  if(running) {
+    fp = arch::fp(regs);
+    for(i = 0; fp; i++) {
+      if(i == maxFrames || fp < top || fp % sizeof(uint64_t) ||
+         fp + 2 * sizeof(uint64_t) > mapping.second ||
+         read(fp, next) != ret_t::Success ||
+         (next && next <= fp)) {
+        DEBUGMSG(pid << ": bad frame pointer chain for thread " << newThread
+                 << " at 0x" << std::hex << fp << std::endl);
+        return ret_t::BadFormat;
+      }
+      top = fp + 2 * sizeof(uint64_t); /* saved frame pointer & return addr */
+      fp = next;
+    }
+    top = ROUND_UP(top, 16);
+  }
+  threads.emplace_back(newThread, urange_t(mapping.first, top));
+
+  DEBUGMSG(pid << ": tracing thread " << newThread << ", stack bounds: 0x"
+           << std::hex << mapping.first << " - 0x" << top << std::endl);
+
+  // Leave the thread stopped if the rest of the threads are stopped
+  if(allStopped) return ret_t::Success;
+  if(!trace::resume(newThread, trace::Continue, 0)) return ret_t::PtraceFailed;
+  threads.back().stopped = false;
+  return ret_t::Success;
+}
+
+void Process::removeThread(pid_t threadId) {
+  for(auto it = threads.begin(); it != threads.end(); ++it) {
+    if(it->tid == threadId) {
+      DEBUGMSG(pid << ": thread " << threadId << " exited" << std::endl);
+      threads.erase(it);
+      break;
+    }
+  }
+  if(tid == threadId) tid = pid;
+}
+
+bool Process::takeEvent(pid_t &task, int &wstatus) {
+  // Report events consumed while stopping threads or while waiting for other
+  // tasks before waiting for new ones
+  for(auto &t : threads) {
+    if(t.pending) {
+      t.pending = false;
+      task = t.tid;
+      wstatus = t.pendingStatus;
+      return true;
+    }
+  }
+  if(takeStrayEvent(pid, wstatus)) {
+    task = pid;
+    return true;
+  }
+  for(auto &t : threads) {
+    if(takeStrayEvent(t.tid, wstatus)) {
+      task = t.tid;
+      return true;
+    }
+  }
+  return false;
 }
 
 ret_t Process::waitInternal(bool reinject) {
   int wstatus;
-  unsigned long childPid;
+  pid_t waited = -1;
   sigset_t block;
   ret_t retval = ret_t::Success;
 
   // Return immediately if the process is already stopped/exited
   if(status != Running) return ret_t::Success;
 
-  // Wait for the child and update the status based on returned values
-  if(waitpid(pid, &wstatus, 0) == -1) {
+  // Wait for the child and update the status based on returned values.  Once
+  // the child has started other threads, wait for events from any of them.
+  while(true) {
+    if(!takeEvent(waited, wstatus)) {
+      waited = waitpid(threads.size() > 1 ? -1 : pid, &wstatus,
+                       __WALL | __WNOTHREAD);
+      if(waited == -1) break;
+    }
+    if(waited == pid) break;
+    else if(!findThread(waited)) {
+      if((retval = handleUnknownTask(waited, wstatus)) != ret_t::Success)
+        return retval;
+    }
+    else if(WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) removeThread(waited);
+    else break;
+  }
+
+  if(waited == -1) {
     if(errno == EINTR) {
       // Prevent whomever interrupted us from interrupting us again while
       // trying to interrupt the child
@@ -175,37 +497,73 @@ ret_t Process::waitInternal(bool reinject) {
       DEBUGMSG("waiting for child returned an error" << std::endl);
     }
   }
-  else {
-    if(WIFEXITED(wstatus)) {
-      status = Exited;
-      exit = WEXITSTATUS(wstatus);
-    }
-    else if(WIFSIGNALED(wstatus)) {
-      status = SignalExit;
-      signal = WTERMSIG(wstatus);
-    }
-    else if(WIFSTOPPED(wstatus)) {
-      status = Stopped;
-      signal = WSTOPSIG(wstatus);
-      stopReason = trace::stopReason(wstatus);
-      if(stopReason == stop_t::Clone ||
-         stopReason == stop_t::Fork) {
-        if(trace::getEventMessage(pid, childPid)) newTaskPid = childPid;
-        else retval = ret_t::PtraceFailed;
-      }
-      // Don't reinject SIGTRAP -- it's a syscall invoked by the application
-      reinjectSignal = reinject && (signal != SIGTRAP);
-    }
-    else {
-      status = Unknown;
-      retval = ret_t::WaitFailed;
-      DEBUGMSG("unknown wait status" << std::endl);
+  else retval = recordEvent(waited, wstatus, reinject);
+
+  return retval;
+}
+
+ret_t Process::recordEvent(pid_t task, int wstatus, bool reinject) {
+  unsigned long childPid;
+  Thread *thread;
+  ret_t retval = ret_t::Success;
+
+  tid = task;
+  regsTid = -1;
+  regsDirty = false;
+  if(WIFEXITED(wstatus)) {
+    status = Exited;
+    exit = WEXITSTATUS(wstatus);
+  }
+  else if(WIFSIGNALED(wstatus)) {
+    status = SignalExit;
+    signal = WTERMSIG(wstatus);
+  }
+  else if(WIFSTOPPED(wstatus)) {
+    status = Stopped;
+    signal = WSTOPSIG(wstatus);
+    stopReason = trace::stopReason(wstatus);
+    if((thread = findThread(tid))) thread->stopped = true;
+    if(stopReason == stop_t::Clone ||
+       stopReason == stop_t::Fork) {
+      if(trace::getEventMessage(tid, childPid)) newTaskPid = childPid;
+      else retval = ret_t::PtraceFailed;
     }
+    // Don't reinject SIGTRAP -- it's a syscall invoked by the application.
+    // Interrupt stops aren't signal deliveries, don't reinject those either.
+    reinjectSignal = reinject && (signal != SIGTRAP) &&
+                     !trace::isInterruptStop(wstatus);
+  }
+  else {
+    status = Unknown;
+    retval = ret_t::WaitFailed;
+    DEBUGMSG("unknown wait status" << std::endl);
   }
 
   return retval;
 }
 
+ret_t Process::deliver(pid_t task, int wstatus) {
+  if(status != Running) return ret_t::InvalidState;
+  if(task != pid) {
+    if(!findThread(task)) return handleUnknownTask(task, wstatus);
+    else if(WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+      removeThread(task);
+      return ret_t::Success;
+    }
+  }
+  return recordEvent(task, wstatus, true);
+}
+
+ret_t Process::pollEvent() {
+  int wstatus;
+  pid_t task;
+  ret_t code;
+
+  while(status == Running && takeEvent(task, wstatus))
+    if((code = deliver(task, wstatus)) != ret_t::Success) return code;
+  return ret_t::Success;
+}
+
 ret_t Process::initializeStack() {
   size_t dashPos, spacePos;
   char buf[128];
@@ -259,6 +617,7 @@ ret_t Process::initializeMemFD() {
 
 ret_t Process::cureAndInitParasite() {
   ret_t code;
+  if((code = invalidateRegs()) != ret_t::Success) return code;
   if(parasite) {
     if((code = parasite::cure(&parasite)) != ret_t::Success) return code;
     if(!(parasite = parasite::initialize(pid))) return ret_t::CompelInitFailed;
@@ -277,15 +636,81 @@ ret_t Process::restoreInterrupt() {
 
 ret_t Process::interrupt() {
   ret_t code = ret_t::Success;
+  ssize_t i;
 
   // TODO copy compel_wait_task() for a more robust implementation
-  if(!trace::interrupt(pid)) return ret_t::PtraceFailed;
-  if((code = waitInternal(false)) != ret_t::Success) return code;
-  if(status != Stopped) return ret_t::InterruptFailed;
+  if(threads.empty()) {
+    if(!trace::interrupt(pid)) return ret_t::PtraceFailed;
+    if((code = waitInternal(false)) != ret_t::Success) return code;
+    if(status != Stopped) return ret_t::InterruptFailed;
+    status = Interrupted;
+    return ret_t::Success;
+  }
+
+  // Stop the world -- interrupt every running thread & wait for each to stop.
+  // Wait for the main thread last, as it can't report its exit until all
+  // other threads have been reaped.
+  for(auto &thread : threads)
+    if(!thread.stopped && !trace::interrupt(thread.tid))
+      return ret_t::PtraceFailed;
+  for(i = threads.size() - 1; i >= 0; i--) {
+    if(threads[i].stopped) continue;
+    code = waitForInterrupt(threads[i]);
+    if(code == ret_t::DoesNotExist) {
+      // Other threads exiting is fine, but the child's gone if the main
+      // thread exited
+      if(status == Exited || status == SignalExit)
+        return ret_t::InterruptFailed;
+    }
+    else if(code != ret_t::Success) return code;
+  }
+
+  tid = pid;
+  signal = SIGTRAP;
+  stopReason = stop_t::Other;
+  reinjectSignal = false;
+  allStopped = true;
   status = Interrupted;
   return ret_t::Success;
 }
 
+ret_t Process::waitForInterrupt(Thread &thread) {
+  int wstatus;
+  pid_t waited, threadId = thread.tid;
+
+  if(takeStrayEvent(threadId, wstatus)) waited = threadId;
+  else {
+    do {
+      waited = waitpid(threadId, &wstatus, __WALL);
+    } while(waited == -1 && errno == EINTR);
+  }
+  if(waited == -1) return ret_t::WaitFailed;
+
+  if(WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+    if(threadId == pid) {
+      if(WIFEXITED(wstatus)) {
+        status = Exited;
+        exit = WEXITSTATUS(wstatus);
+      }
+      else {
+        status = SignalExit;
+        signal = WTERMSIG(wstatus);
+      }
+    }
+    else removeThread(threadId);
+    return ret_t::DoesNotExist;
+  }
+
+  // The thread may have stopped for another reason before the interrupt was
+  // delivered; save the event so it's reported by the next wait.
+  thread.stopped = true;
+  if(!trace::isInterruptStop(wstatus)) {
+    thread.pending = true;
+    thread.pendingStatus = wstatus;
+  }
+  return ret_t::Success;
+}
+
 ret_t Process::signalProcess(int signo) const
 { return kill(pid, signo) == 0 ? ret_t::Success : ret_t::SignalFailed; }
 
@@ -301,9 +726,31 @@ ret_t Process::resume(trace::resume_t type) {
   case SignalExit: return ret_t::DoesNotExist;
 
   default:
-    if(reinjectSignal) success = trace::resume(pid, type, signal);
-    else success = trace::resume(pid, type, 0);
+    // Write back any modified registers before the thread runs
+    if(invalidateRegs() != ret_t::Success) return ret_t::PtraceFailed;
+
+    // Restart the rest of the world if it was stopped
+    if(allStopped) {
+      for(auto &thread : threads) {
+        if(thread.tid == tid || !thread.stopped || thread.pending) continue;
+        if(!trace::resume(thread.tid, trace::Continue, 0))
+          return ret_t::PtraceFailed;
+        thread.stopped = false;
+      }
+      allStopped = false;
+    }
+
+    // Leave the selected thread stopped if it has an event to report
+    Thread *thread = findThread(tid);
+    if(thread && thread->pending) {
+      status = Running;
+      return ret_t::Success;
+    }
+
+    if(reinjectSignal) success = trace::resume(tid, type, signal);
+    else success = trace::resume(tid, type, 0);
     if(success) {
+      if(thread) thread->stopped = false;
       status = Running;
       return ret_t::Success;
     }
@@ -311,6 +758,127 @@ ret_t Process::resume(trace::resume_t type) {
   }
 }
 
+ret_t Process::selectThread(pid_t threadId) {
+  Thread *thread = findThread(threadId);
+  if(!thread) return ret_t::DoesNotExist;
+  if(!thread->stopped) return ret_t::InvalidState;
+  if(regsTid != threadId && invalidateRegs() != ret_t::Success)
+    return ret_t::PtraceFailed;
+  tid = threadId;
+  reinjectSignal = false;
+  return ret_t::Success;
+}
+
+ret_t Process::resumeThread(pid_t threadId, trace::resume_t type) {
+  Thread *thread = findThread(threadId);
+  if(!thread) return ret_t::DoesNotExist;
+  if(!thread->stopped || thread->pending) return ret_t::InvalidState;
+  if(regsTid == threadId && invalidateRegs() != ret_t::Success)
+    return ret_t::PtraceFailed;
+  if(!trace::resume(threadId, type, 0)) return ret_t::PtraceFailed;
+  thread->stopped = false;
+  return ret_t::Success;
+}
+
+ret_t Process::waitThreads(pid_t &stoppedId, int &stopSignal,
+                           uint64_t timeout) {
+  int wstatus;
+  pid_t waited;
+  uint64_t now, deadline;
+  Thread *thread;
+  ret_t code;
+  struct timespec pause = { 0, 0 };
+
+  if((deadline = Timer::timestamp()) == UINT64_MAX)
+    return ret_t::NoTimestamp;
+  deadline += timeout * 1000;
+
+  while(true) {
+    // Events may have been saved while waiting for another process' tasks
+    waited = 0;
+    for(auto &t : threads) {
+      if(!t.stopped && takeStrayEvent(t.tid, wstatus)) {
+        waited = t.tid;
+        break;
+      }
+    }
+    if(!waited) waited = waitpid(-1, &wstatus, __WALL | __WNOTHREAD | WNOHANG);
+    if(waited == -1) {
+      if(errno == EINTR) continue;
+      return ret_t::WaitFailed;
+    }
+    else if(waited == 0) {
+      // Measure against the clock, sleeping & polling take longer than asked
+      if((now = Timer::timestamp()) == UINT64_MAX) return ret_t::NoTimestamp;
+      if(now >= deadline) {
+        stoppedId = -1;
+        return ret_t::Success;
+      }
+      pause.tv_nsec = std::min<uint64_t>(deadline - now, 10000);
+      nanosleep(&pause, nullptr);
+      continue;
+    }
+
+    if(!(thread = findThread(waited))) {
+      if((code = handleUnknownTask(waited, wstatus)) != ret_t::Success)
+        return code;
+      continue;
+    }
+
+    stoppedId = waited;
+    if(WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+      if(waited == pid) {
+        if(WIFEXITED(wstatus)) {
+          status = Exited;
+          exit = WEXITSTATUS(wstatus);
+        }
+        else {
+          status = SignalExit;
+          signal = WTERMSIG(wstatus);
+        }
+        return ret_t::DoesNotExist;
+      }
+      removeThread(waited);
+      stopSignal = -1;
+      return ret_t::Success;
+    }
+
+    // Save events & signals destined for the application so the next wait
+    // reports them; callers only consume the stop itself.
+    thread->stopped = true;
+    stopSignal = WSTOPSIG(wstatus);
+    if(trace::isEventStop(wstatus) ||
+       (stopSignal != SIGTRAP && !trace::isInterruptStop(wstatus))) {
+      thread->pending = true;
+      thread->pendingStatus = wstatus;
+    }
+    return ret_t::Success;
+  }
+}
+
+ret_t Process::interruptThread(pid_t threadId, int &stopSignal) {
+  Thread *thread = findThread(threadId);
+  ret_t code;
+
+  if(!thread) return ret_t::DoesNotExist;
+  if(thread->stopped) {
+    stopSignal = 0;
+    return ret_t::Success;
+  }
+  if(!trace::interrupt(threadId)) return ret_t::PtraceFailed;
+  if((code = waitForInterrupt(*thread)) != ret_t::Success) return code;
+
+  // The thread may have hit a breakpoint before the interrupt arrived
+  stopSignal = 0;
+  if(thread->pending && WIFSTOPPED(thread->pendingStatus) &&
+     WSTOPSIG(thread->pendingStatus) == SIGTRAP &&
+     !trace::isEventStop(thread->pendingStatus)) {
+    thread->pending = false;
+    stopSignal = SIGTRAP;
+  }
+  return ret_t::Success;
+}
+
 ret_t Process::continueToNextSignal() {
   ret_t retcode = resume(trace::Continue);
   if(retcode != ret_t::Success) return retcode;
@@ -349,6 +917,7 @@ ret_t Process::attachHandoff() {
   if(!trace::attach(pid, true)) return ret_t::PtraceFailed;
   if((code = cureAndInitParasite()) != ret_t::Success) return code;
   status = Stopped;
+  for(auto &thread : threads) thread.stopped = true;
 
   // Note: traceProcessControl() *must* be called after attaching from the
   // handoff; these options are clobbered if set before the handing-off thread
@@ -359,18 +928,22 @@ ret_t Process::attachHandoff() {
 }
 
 ret_t Process::detach() {
+  invalidateRegs();
   close(uffd);
   close(memFD);
-  pid = newTaskPid = -1;
   status = Ready;
   exit = 0;
   stopReason = stop_t::Other;
   reinjectSignal = false;
   uffd = -1;
-  nthreads = 0;
   parasite::cure(&parasite);
   sem_destroy(&handoff);
+  for(auto &thread : threads)
+    if(thread.tid != pid) trace::detach(thread.tid);
   trace::detach(pid);
+  pid = tid = newTaskPid = -1;
+  threads.clear();
+  allStopped = false;
   return ret_t::Success;
 }
 
@@ -378,9 +951,11 @@ ret_t Process::detachHandoff() {
   ret_t code;
 
   // Daemonize the child the wait for us to reattach
+  if((code = invalidateRegs()) != ret_t::Success) return code;
   if(parasite::infect(parasite, 1) != ret_t::Success)
     return ret_t::CompelInfectFailed;
   status = Running;
+  for(auto &thread : threads) thread.stopped = false;
 
   // At this point the child is asleep waiting for compel commands, but
   // detaching requires it to be in a trace-stop state.  Interrupt & detach.
@@ -425,78 +1000,113 @@ stop_t Process::getStopReason() const {
   else return stop_t::Other;
 }
 
-ret_t Process::readRegs(struct user_regs_struct &regs) const {
+ret_t Process::cacheRegs() const {
+  ret_t code;
+
   if(!traceable()) return ret_t::InvalidState;
-  else if(!trace::getRegs(pid, regs)) return ret_t::PtraceFailed;
-  else return ret_t::Success;
+  if(regsTid == tid) return ret_t::Success;
+  if((code = invalidateRegs()) != ret_t::Success) return code;
+  if(!trace::getRegs(tid, cachedRegs)) return ret_t::PtraceFailed;
+  regsTid = tid;
+  return ret_t::Success;
+}
+
+ret_t Process::flushRegs() const {
+  if(!regsDirty) return ret_t::Success;
+  if(!trace::setRegs(regsTid, cachedRegs)) return ret_t::PtraceFailed;
+  regsDirty = false;
+  return ret_t::Success;
+}
+
+ret_t Process::invalidateRegs() const {
+  ret_t code = flushRegs();
+  regsTid = -1;
+  regsDirty = false;
+  return code;
+}
+
+ret_t Process::readRegs(struct user_regs_struct &regs) const {
+  ret_t code;
+  if((code = cacheRegs()) != ret_t::Success) return code;
+  regs = cachedRegs;
+  return ret_t::Success;
 }
 
 ret_t Process::readFPRegs(struct user_fpregs_struct &regs) const {
   if(!traceable()) return ret_t::InvalidState;
-  else if(!trace::getFPRegs(pid, regs)) return ret_t::PtraceFailed;
+  else if(!trace::getFPRegs(tid, regs)) return ret_t::PtraceFailed;
   else return ret_t::Success;
 }
 
 ret_t Process::writeRegs(struct user_regs_struct &regs) const {
+  ret_t code;
   if(!traceable()) return ret_t::InvalidState;
-  else if(!trace::setRegs(pid, regs)) return ret_t::PtraceFailed;
-  else return ret_t::Success;
+  if(regsTid != tid && (code = invalidateRegs()) != ret_t::Success)
+    return code;
+  cachedRegs = regs;
+  regsTid = tid;
+  regsDirty = true;
+  return ret_t::Success;
 }
 
 ret_t Process::writeFPRegs(struct user_fpregs_struct &regs) const {
   if(!traceable()) return ret_t::InvalidState;
-  else if(!trace::setFPRegs(pid, regs)) return ret_t::PtraceFailed;
+  else if(!trace::setFPRegs(tid, regs)) return ret_t::PtraceFailed;
   else return ret_t::Success;
 }
 
-// TODO the functions that only access a single register (i.e., get/setPC())
-// should be converted to use PTRACE_PEEKUSER/POKUSER rather than bulk
-// reading/writing the entire register set
-
 uintptr_t Process::getPC() const {
-  struct user_regs_struct regs;
-  if(!traceable()) return 0;
-  if(!trace::getRegs(pid, regs)) return ret_t::PtraceFailed;
-  return arch::pc(regs);
+  if(cacheRegs() != ret_t::Success) return 0;
+  return arch::pc(cachedRegs);
 }
 
 ret_t Process::setPC(uintptr_t newPC) const {
-  struct user_regs_struct regs;
-  if(!traceable()) return ret_t::InvalidState;
-  if(!trace::getRegs(pid, regs)) return ret_t::PtraceFailed;
-  arch::pc(regs, newPC);
-  if(!trace::setRegs(pid, regs)) return ret_t::PtraceFailed;
+  ret_t code;
+  if((code = cacheRegs()) != ret_t::Success) return code;
+  arch::pc(cachedRegs, newPC);
+  regsDirty = true;
   return ret_t::Success;
 }
 
 uintptr_t Process::getSP() const {
-  struct user_regs_struct regs;
-  if(!traceable() || !trace::getRegs(pid, regs)) return 0;
-  return arch::sp(regs);
+  if(cacheRegs() != ret_t::Success) return 0;
+  return arch::sp(cachedRegs);
 }
 
 ret_t Process::setSP(uintptr_t newSP) const {
-  struct user_regs_struct regs;
+  ret_t code;
+  if((code = cacheRegs()) != ret_t::Success) return code;
+  arch::sp(cachedRegs, newSP);
+  regsDirty = true;
+  return ret_t::Success;
+}
+
+ret_t Process::setHardwareBreakpoints(const std::vector<uintptr_t> &addrs)
+  const {
+  std::vector<std::pair<size_t, uint64_t>> writes;
+
   if(!traceable()) return ret_t::InvalidState;
-  if(!trace::getRegs(pid, regs)) return ret_t::PtraceFailed;
-  arch::sp(regs, newSP);
-  if(!trace::setRegs(pid, regs)) return ret_t::PtraceFailed;
+  if(addrs.size() > arch::numHardwareBreakpoints()) return ret_t::BadFormat;
+
+  arch::hardwareBreakpointRegs(addrs, writes);
+  for(auto &w : writes)
+    if(!trace::setUser(tid, w.first, w.second)) return ret_t::PtraceFailed;
+
   return ret_t::Success;
 }
 
 ret_t Process::setFuncCallRegs(long a1, long a2, long a3,
                                long a4, long a5, long a6) const {
-  struct user_regs_struct regs;
-  if(!traceable()) return ret_t::InvalidState;
-  if(!trace::getRegs(pid, regs)) return ret_t::PtraceFailed;
-  arch::marshalFuncCall(regs, a1, a2, a3, a4, a5, a6);
-  if(!trace::setRegs(pid, regs)) return ret_t::PtraceFailed;
+  ret_t code;
+  if((code = cacheRegs()) != ret_t::Success) return code;
+  arch::marshalFuncCall(cachedRegs, a1, a2, a3, a4, a5, a6);
+  regsDirty = true;
   return ret_t::Success;
 }
 
 ret_t Process::read(uintptr_t addr, uint64_t &data) const {
   if(!traceable()) return ret_t::InvalidState;
-  if(!trace::getMem(pid, addr, data)) {
+  if(!trace::getMem(tid, addr, data)) {
     DEBUGMSG("ptrace read failed at address 0x" << std::hex << addr << ": "
              << strerror(errno) << std::endl);
     return ret_t::PtraceFailed;
@@ -507,7 +1117,7 @@ ret_t Process::read(uintptr_t addr, uint64_t &data) const {
 void Process::dumpMem(uintptr_t addr) const {
   if(traceable()) {
     uint64_t data;
-    if(trace::getMem(pid, addr, data)) {
+    if(trace::getMem(tid, addr, data)) {
       DEBUGMSG("memory @ 0x" << std::hex << addr << ": " << data << std::endl);
     }
     else {
@@ -523,15 +1133,10 @@ ret_t Process::readRegion(uintptr_t addr, byte_iterator &buffer) const {
 
   if(!traceable()) return ret_t::InvalidState;
 
-  if(lseek(memFD, addr, SEEK_SET) == -1) {
-    DEBUGMSG("could not seek to address 0x" << std::hex << addr << ": "
-             << strerror(errno) << std::endl);
-    return ret_t::ReadFailed;
-  }
-
-  bytesRead = ::read(memFD, (void *)*buffer, buffer.getLength());
+  bytesRead = pread(memFD, (void *)*buffer, buffer.getLength(), addr);
   if(bytesRead < 0) {
-    DEBUGMSG("error reading child memory: " << strerror(errno) << std::endl);
+    DEBUGMSG("error reading child memory at 0x" << std::hex << addr << ": "
+             << strerror(errno) << std::endl);
     return ret_t::ReadFailed;
   }
   else if((size_t)bytesRead < buffer.getLength())
@@ -539,9 +1144,12 @@ ret_t Process::readRegion(uintptr_t addr, byte_iterator &buffer) const {
   else return ret_t::Success;
 }
 
+ret_t Process::readRegions(const RegionList &regions) const
+{ return transferRegions(regions, false); }
+
 ret_t Process::write(uintptr_t addr, uint64_t data) const {
   if(!traceable()) return ret_t::InvalidState;
-  if(!trace::setMem(pid, addr, data)) {
+  if(!trace::setMem(tid, addr, data)) {
     DEBUGMSG("ptrace write failed at address 0x" << std::hex << addr << ": "
              << strerror(errno) << std::endl);
     return ret_t::PtraceFailed;
@@ -554,15 +1162,10 @@ ret_t Process::writeRegion(uintptr_t addr, const byte_iterator &buffer) const {
 
   if(!traceable()) return ret_t::InvalidState;
 
-  if(lseek(memFD, addr, SEEK_SET) == -1) {
-    DEBUGMSG("could not seek to address 0x" << std::hex << addr << ": "
-             << strerror(errno) << std::endl);
-    return ret_t::WriteFailed;
-  }
-
-  bytesWritten = ::write(memFD, (void *)*buffer, buffer.getLength());
+  bytesWritten = pwrite(memFD, (void *)*buffer, buffer.getLength(), addr);
   if(bytesWritten < 0) {
-    DEBUGMSG("error writing child memory: " << strerror(errno) << std::endl);
+    DEBUGMSG("error writing child memory at 0x" << std::hex << addr << ": "
+             << strerror(errno) << std::endl);
     return ret_t::WriteFailed;
   }
   else if((size_t)bytesWritten < buffer.getLength())
@@ -570,11 +1173,59 @@ ret_t Process::writeRegion(uintptr_t addr, const byte_iterator &buffer) const {
   else return ret_t::Success;
 }
 
-ret_t Process::getSyscallNumber(long &data) const {
-  struct user_regs_struct regs;
+ret_t Process::writeRegions(const RegionList &regions) const
+{ return transferRegions(regions, true); }
+
+ret_t Process::transferRegions(const RegionList &regions, bool write) const {
+  size_t i, j, num, done;
+  ssize_t bytes;
+  byte_iterator buffer;
+  std::vector<struct iovec> local, remote;
+  ret_t code;
+
   if(!traceable()) return ret_t::InvalidState;
-  if(!trace::getRegs(pid, regs)) return ret_t::PtraceFailed;
-  data = arch::syscallNumber(regs);
+
+  num = std::min(regions.size(), (size_t)IOV_MAX);
+  local.resize(num);
+  remote.resize(num);
+  for(i = 0; i < regions.size(); ) {
+    num = std::min(regions.size() - i, (size_t)IOV_MAX);
+    for(j = 0; j < num; j++) {
+      local[j].iov_base = (void *)*regions[i + j].second;
+      local[j].iov_len = regions[i + j].second.getLength();
+      remote[j].iov_base = (void *)regions[i + j].first;
+      remote[j].iov_len = local[j].iov_len;
+    }
+
+    if(write)
+      bytes = process_vm_writev(pid, &local[0], num, &remote[0], num, 0);
+    else bytes = process_vm_readv(pid, &local[0], num, &remote[0], num, 0);
+
+    // Transfers stop at the first region that couldn't be accessed; skip the
+    // regions which were transferred in their entirety
+    for(done = 0; bytes > 0 && done < num; done++) {
+      if((size_t)bytes < local[done].iov_len) break;
+      bytes -= local[done].iov_len;
+    }
+    i += done;
+    if(done == num) continue;
+
+    // The memory file ignores page protections; use it for the region that
+    // failed before trying the rest of the regions again
+    buffer = regions[i].second;
+    if(write) code = writeRegion(regions[i].first, buffer);
+    else code = readRegion(regions[i].first, buffer);
+    if(code != ret_t::Success) return code;
+    i++;
+  }
+
+  return ret_t::Success;
+}
+
+ret_t Process::getSyscallNumber(long &data) const {
+  ret_t code;
+  if((code = cacheRegs()) != ret_t::Success) return code;
+  data = arch::syscallNumber(cachedRegs);
   return ret_t::Success;
 }
 
@@ -585,8 +1236,8 @@ void Process::dumpRegs(std::ostream &os) const {
     WARN("cannot dump registers - invalid state" << std::endl);
     return;
   }
-  if(trace::getRegs(pid, regs)) arch::dumpRegs(os, regs);
-  if(trace::getFPRegs(pid, fpregs)) arch::dumpFPRegs(os, fpregs);
+  if(readRegs(regs) == ret_t::Success) arch::dumpRegs(os, regs);
+  if(trace::getFPRegs(tid, fpregs)) arch::dumpFPRegs(os, fpregs);
 }
 
 ret_t Process::stealUserfaultfd() {
@@ -596,7 +1247,8 @@ ret_t Process::stealUserfaultfd() {
 
   DEBUGMSG(pid << ": stealing userfault from child" << std::endl);
 
-  retcode = parasite::infect(parasite, nthreads);
+  if((retcode = invalidateRegs()) != ret_t::Success) return retcode;
+  retcode = parasite::infect(parasite, threads.size());
   if(retcode != ret_t::Success) return retcode;
   if((uffd = parasite::stealUFFD(parasite)) == -1)
     return ret_t::CompelActionFailed;
@@ -604,3 +1256,35 @@ ret_t Process::stealUserfaultfd() {
   return ret_t::Success;
 }
 
+ret_t Process::passCodeFile(int fd, int &childFd) {
+  ret_t retcode;
+
+  if(!traceable()) return ret_t::InvalidState;
+
+  DEBUGMSG(pid << ": passing code file descriptor " << fd << " to child"
+           << std::endl);
+
+  if((retcode = invalidateRegs()) != ret_t::Success) return retcode;
+  retcode = parasite::infect(parasite, threads.size());
+  if(retcode != ret_t::Success) return retcode;
+  if((childFd = parasite::passCodeFD(parasite, fd)) == -1)
+    return ret_t::CompelActionFailed;
+  if((retcode = cureAndInitParasite()) != ret_t::Success) return retcode;
+  return ret_t::Success;
+}
+
+ret_t Process::runSyscalls(struct parasiteSyscall *calls, size_t num) {
+  ret_t retcode, cureCode;
+
+  if(!traceable()) return ret_t::InvalidState;
+
+  DEBUGMSG_VERBOSE(pid << ": running " << num << " system call(s) in child"
+                   << std::endl);
+
+  if((retcode = invalidateRegs()) != ret_t::Success) return retcode;
+  retcode = parasite::infect(parasite, threads.size());
+  if(retcode != ret_t::Success) return retcode;
+  retcode = parasite::syscalls(parasite, calls, num);
+  cureCode = cureAndInitParasite();
+  return retcode != ret_t::Success ? retcode : cureCode;
+}
@@ -455,9 +455,9 @@ RandomizedFunction::RandomizedFunction(const Binary &binary,
                                        const function_record *func,
                                        size_t maxPadding,
                                        MemoryWindow &mw)
-  : binary(binary), func(func), maxFrameSize(UINT32_MAX),
-    prevRandFrameSize(func->frame_size), randomizedFrameSize(func->frame_size),
-    maxPadding(maxPadding) {
+  : binary(binary), func(func), analysis(new Analysis),
+    maxFrameSize(UINT32_MAX), prevRandFrameSize(func->frame_size),
+    randomizedFrameSize(func->frame_size), maxPadding(maxPadding) {
   int offset;
   arch::RegType type;
   Binary::slot_iterator si = binary.getStackSlots(func);
@@ -468,6 +468,7 @@ RandomizedFunction::RandomizedFunction(const Binary &binary,
 
   curRand = &_a;
   prevRand = &_b;
+  std::vector<std::pair<int, const stack_slot *>> &slots = analysis->slots;
   slots.reserve(si.getLength());
 
   for(; !si.end(); ++si) {
@@ -487,22 +488,43 @@ RandomizedFunction::RandomizedFunction(const Binary &binary,
 RandomizedFunction::RandomizedFunction(const RandomizedFunction &rhs,
                                        MemoryWindow &mw)
   : binary(rhs.binary), func(rhs.func), maxFrameSize(rhs.maxFrameSize),
-    transformAddrs(rhs.transformAddrs), slots(rhs.slots), _a(rhs._a),
-    _b(rhs._b), seen(rhs.seen), randomizedFrameSize(rhs.randomizedFrameSize),
+    _a(rhs._a), _b(rhs._b), randomizedFrameSize(rhs.randomizedFrameSize),
     maxPadding(rhs.maxPadding) {
-  // Copy the instructions and point raw bits to the new code buffer
-  if(!rhs.instrs.empty()) {
-    size_t instrSize;
-    funcData = mw.getData(func->addr);
-    byte *cur;
-    //DEBUG(byte *end);
-    byte *end;
-    instrs = rhs.instrs;
+  size_t instrSize;
+  byte *cur;
+  //DEBUG(byte *end);
+  byte *end;
 
+  funcData = mw.getData(func->addr);
+
+  // Once patch sites are recorded the analysis is never modified, share it
+  // and only copy the instructions we re-encode at every randomization
+  if(rhs.analysis->patchable) {
+    analysis = rhs.analysis;
+    patchInstrs.reserve(rhs.patchInstrs.size());
+    auto instrIt = rhs.patchInstrs.begin();
+    for(const PatchSite &site : analysis->patchSites) {
+      if(!site.reencode) continue;
+      assert(instrIt != rhs.patchInstrs.end() && "Invalid function copy");
+      assert(instr_raw_bits_valid(*instrIt) && "Bits not set");
+      instrSize = instr_length(GLOBAL_DCONTEXT, *instrIt);
+      patchInstrs.push_back(instr_clone(GLOBAL_DCONTEXT, *instrIt));
+      instr_set_raw_bits(patchInstrs.back(), funcData[0] + site.offset,
+                         instrSize);
+      ++instrIt;
+    }
+  }
+  else analysis.reset(new Analysis(*rhs.analysis));
+
+  // Otherwise, we're going to rewrite our own copy of the instructions.  Copy
+  // them and point raw bits to the new code buffer.
+  SparseInstrList &instrs = analysis->instrs;
+  const SparseInstrList &rhsInstrs = rhs.analysis->instrs;
+  if(!rhs.analysis->patchable && !instrs.empty()) {
     assert(funcData[0] && funcData.getLength() >= func->code_size &&
            "Copying from invalid RandomizedFunction");
 
-    auto rhsRunIt = rhs.instrs.begin();
+    auto rhsRunIt = rhsInstrs.begin();
     for(auto runIt = instrs.begin(), re = instrs.end();
         runIt != re;
         runIt++, rhsRunIt++) {
@@ -548,6 +570,61 @@ RandomizedFunction::RandomizedFunction(const RandomizedFunction &rhs,
   for(auto &r : rhs.regions) regions.emplace_back(r->copy());
 }
 
+RandomizedFunction::RandomizedFunction(const RandomizedFunction &rhs,
+                                       MemoryWindow &mw,
+                                       const std::vector<SlotMap> &slots,
+                                       uint32_t frameSize)
+  : binary(rhs.binary), func(rhs.func), analysis(rhs.analysis),
+    maxFrameSize(rhs.maxFrameSize), _a(slots), _b(slots),
+    prevSortedByRand(slots.size()), prevRand(&_b), curRand(&_a),
+    prevRandFrameSize(frameSize), randomizedFrameSize(frameSize),
+    maxPadding(rhs.maxPadding) {
+  byte *cur, *real, *next;
+  instr_t *instr, *orig;
+
+  assert(analysis->patchable && "Copying function without patch sites");
+  funcData = mw.getData(func->addr);
+  assert(funcData[0] && funcData.getLength() >= func->code_size &&
+         "No data for function");
+
+  // Re-encoded instructions must match the layout of the code we're starting
+  // from; rather than copying rhs's versions (which may be mid-randomization),
+  // decode them from the code
+  for(const PatchSite &site : analysis->patchSites) {
+    if(!site.reencode) continue;
+    cur = funcData[0] + site.offset;
+    real = (byte *)func->addr + site.offset;
+    instr = instr_create(GLOBAL_DCONTEXT);
+    patchInstrs.push_back(instr);
+    next = decode_from_copy(GLOBAL_DCONTEXT, cur, real, instr);
+    assert(next && "Could not decode patch site");
+    instr_set_raw_bits(instr, cur, next - cur);
+    orig = &analysis->instrs[site.run].instrs[site.instr];
+    instr_set_note(instr, instr_get_note(orig));
+  }
+
+  // Start from the analyzed regions, the next randomization lays them out
+  regions.reserve(analysis->regions.size());
+  for(auto &r : analysis->regions) regions.emplace_back(r->copy());
+}
+
+RandomizedFunction::~RandomizedFunction() {
+  for(auto instr : patchInstrs) instr_destroy(GLOBAL_DCONTEXT, instr);
+}
+
+void RandomizedFunction::setPatchSites(std::vector<PatchSite> &&sites) {
+  analysis->patchSites = std::move(sites);
+  analysis->patchable = true;
+
+  // Re-encoded instructions are the only ones still modified by later
+  // randomizations, give this copy its own version of them
+  for(const PatchSite &site : analysis->patchSites) {
+    if(!site.reencode) continue;
+    instr_t *instr = &analysis->instrs[site.run].instrs[site.instr];
+    patchInstrs.push_back(instr_clone(GLOBAL_DCONTEXT, instr));
+  }
+}
+
 /**
  * Copy slot remapping information from a stack region into another vector.
  * @param r a stack region
@@ -630,6 +707,10 @@ ret_t RandomizedFunction::finalizeAnalysis() {
   ret_t ret = rewritePrologueAndEpilogue();
   if(ret != ret_t::Success) return ret;
 
+  // Save the analyzed layout for copies starting from other randomizations
+  analysis->regions.reserve(regions.size());
+  for(const auto &r : regions) analysis->regions.emplace_back(r->copy());
+
   DEBUG(
     if(!verifySlots(*curRand)) return ret_t::AnalysisFailed;
 
@@ -764,14 +845,19 @@ int RandomizedFunction::getOriginalOffset(int prev) const {
   return offset;
 }
 
-int RandomizedFunction::getRandomizedOffset(int orig) const {
+int RandomizedFunction::getRandomizedOffset(int orig) const
+{ return getRandomizedOffset(*curRand, orig); }
+
+int RandomizedFunction::getRandomizedOffset(const std::vector<SlotMap> &slots,
+                                            int orig) {
   int offset = INT32_MAX;
   ssize_t idx;
 
+  if(slots.empty()) return offset;
   idx = findRight<SlotMap, int, slotMapContains, lessThanSlotMap>
-                 (&curRand->at(0), curRand->size(), orig);
-  if(idx >= 0 && slotMapContains(&curRand->at(idx), orig))
-    offset = orig - curRand->at(idx).original + curRand->at(idx).randomized;
+                 (&slots[0], slots.size(), orig);
+  if(idx >= 0 && slotMapContains(&slots[idx], orig))
+    offset = orig - slots[idx].original + slots[idx].randomized;
   return offset;
 }
 
@@ -798,6 +884,8 @@ lessThanSlot(const std::pair<int, const stack_slot *> *slot, int offset)
 { return offset < slot->first; }
 
 std::pair<int, const stack_slot *> RandomizedFunction::findSlot(int offset) {
+  const std::vector<std::pair<int, const stack_slot *>> &slots =
+    analysis->slots;
   ssize_t idx = findRight<std::pair<int, const stack_slot *>, int,
                           slotContains, lessThanSlot>
                          (&slots[0], slots.size(), offset);
@@ -820,6 +908,8 @@ slotContainsInclusive(const std::pair<int, const stack_slot *> *slot,
 
 std::pair<int, const stack_slot *>
 RandomizedFunction::findSlotEndInclusive(int offset) {
+  const std::vector<std::pair<int, const stack_slot *>> &slots =
+    analysis->slots;
   ssize_t idx = findRight<std::pair<int, const stack_slot *>, int,
                           slotContainsInclusive, lessThanSlot>
                          (&slots[0], slots.size(), offset);
@@ -42,6 +42,14 @@ stop_t trace::stopReason(int wstatus) {
   else return stop_t::Other;
 }
 
+bool trace::isInterruptStop(int wstatus) {
+  return (wstatus >> 16) == PTRACE_EVENT_STOP;
+}
+
+bool trace::isEventStop(int wstatus) {
+  return (wstatus >> 16) && (wstatus >> 16) != PTRACE_EVENT_STOP;
+}
+
 bool trace::resume(pid_t tracee, resume_t type, int signal) {
   enum __ptrace_request req;
   switch(type) {
@@ -102,3 +110,8 @@ bool trace::setMem(pid_t tracee, uintptr_t addr, uint64_t data) {
   else return false;
 }
 
+bool trace::setUser(pid_t tracee, size_t offset, uint64_t data) {
+  if(ptrace(PTRACE_POKEUSER, tracee, offset, data) == 0) return true;
+  else return false;
+}
+
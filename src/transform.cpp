@@ -1,7 +1,15 @@
+#include <algorithm>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <linux/memfd.h>
 #include <linux/userfaultfd.h>
 
 #include "transform.h"
@@ -16,29 +24,232 @@ using namespace chameleon;
 static std::vector<unsigned char> intPage(PAGESZ);
 
 /**
- * Handle a fault by passing a previously-randomized code page pointer to the
- * kernel.
+ * Serve a single page to the kernel.  The caller must hold the code window
+ * lock.
  *
  * @param CT code transformer
  * @param uffd userfaultfd file descriptor for user-space fault handling
- * @param msg description of faulting region
+ * @param pageAddr page-aligned faulting address
  * @param pageBuf a page-sized buffer used to hold page data
+ * @param intPageAddr address of the interrupt page
  * @return a return code describing the outcome
  */
-static inline ret_t handleFault(CodeTransformer *CT,
-                                int uffd,
-                                const struct uffd_msg &msg,
-                                std::vector<char> &pageBuf,
-                                uintptr_t intPageAddr) {
-  uintptr_t pageAddr = PAGE_DOWN(msg.arg.pagefault.address), data;
-  ret_t code = ret_t::Success;
+static inline ret_t servePage(CodeTransformer *CT,
+                              int uffd,
+                              uintptr_t pageAddr,
+                              std::vector<char> &pageBuf,
+                              uintptr_t intPageAddr) {
+  uintptr_t data;
+  ret_t code;
 
-  assert(msg.event == UFFD_EVENT_PAGEFAULT && "Invalid message type");
-  DEBUGMSG(CT->getProcessPid() << ": handling fault @ 0x" << std::hex
-           << pageAddr << ", flags=" << msg.arg.pagefault.flags << ", ptid="
-           << std::dec << msg.arg.pagefault.feat.ptid
-           << (pageAddr == intPageAddr ? " (interrupt page)" : "")
-           << std::endl);
+  if(pageAddr != intPageAddr) {
+    if((code = CT->randomizePage(pageAddr)) != ret_t::Success) return code;
+    if(!(data = CT->zeroCopy(pageAddr))) {
+      if((code = CT->project(pageAddr, pageBuf)) != ret_t::Success)
+        return code;
+      data = (uintptr_t)&pageBuf[0];
+    }
+  }
+  else data = (uintptr_t)&intPage[0];
+
+  // Another thread may have faulted on & been served the page already (e.g.,
+  // the page was requested in a previous batch), which the kernel reports as
+  // EEXIST; the faulting thread is woken either way.
+  if(!uffd::copy(uffd, data, pageAddr) && errno != EEXIST)
+    return ret_t::UffdCopyFailed;
+  return ret_t::Success;
+}
+
+namespace {
+
+/**
+ * Fault-ahead prefetcher.  Records the order in which code pages are faulted
+ * in during each randomization epoch.  When a page faults in the following
+ * epoch, eagerly serve the pages that followed it in the previous epoch, or if
+ * the page was not faulted in the previous epoch, the next sequential pages.
+ *
+ * Note: userfaultfd doesn't notify us about accesses to pages that are already
+ * present, so we can't directly observe whether a prefetched page was used.
+ * Prefetched pages are carried into the next epoch's history, but a page only
+ * prefetched in two consecutive epochs is dropped so that it has to fault
+ * again to stay; mispredictions don't stay in the history for good.  Faults
+ * on pages in the history are counted as misses, i.e., pages that were
+ * predicted but not prefetched in time.
+ *
+ * Only used by the fault handling thread.
+ */
+class FaultPrefetcher {
+public:
+  FaultPrefetcher(size_t depth, uintptr_t start, uintptr_t end,
+                  uintptr_t intPageAddr)
+    : depth(depth), start(PAGE_DOWN(start)), end(PAGE_UP(end)),
+      intPageAddr(intPageAddr), epoch(0), historyPrefetched(0),
+      seqPrefetched(0), faults(0), misses(0) {}
+
+  /**
+   * Notify the prefetcher of the code window's current epoch.  If it has
+   * changed, the sequence recorded for the last epoch becomes the history used
+   * for prediction.
+   * @param curEpoch the code window's current epoch
+   */
+  void setEpoch(size_t curEpoch) {
+    std::unordered_set<uintptr_t> prefetchedOnly;
+    if(curEpoch == epoch) return;
+    epoch = curEpoch;
+    prevSeq.clear();
+    prevPos.clear();
+    for(auto &entry : curSeq) {
+      if(entry.second) {
+        if(prevPrefetchedOnly.count(entry.first)) continue;
+        prefetchedOnly.insert(entry.first);
+      }
+      prevPos.emplace(entry.first, prevSeq.size());
+      prevSeq.push_back(entry.first);
+    }
+    prevPrefetchedOnly.swap(prefetchedOnly);
+    curSeq.clear();
+    installed.clear();
+  }
+
+  /**
+   * Record that a page was served in response to a fault.
+   * @param page page address
+   */
+  void recordFault(uintptr_t page) {
+    if(!installed.insert(page).second) return;
+    curSeq.emplace_back(page, false);
+    faults++;
+    if(prevPos.count(page)) misses++;
+  }
+
+  /**
+   * Record that a page was prefetched.
+   * @param page page address
+   * @param fromHistory whether the page was predicted from the history rather
+   *                    than sequentially
+   */
+  void recordPrefetch(uintptr_t page, bool fromHistory) {
+    if(!installed.insert(page).second) return;
+    curSeq.emplace_back(page, true);
+    if(fromHistory) historyPrefetched++;
+    else seqPrefetched++;
+  }
+
+  /**
+   * Predict which pages will fault after a given page.
+   * @param page a page that just faulted
+   * @param toPrefetch output argument populated with pages to serve
+   * @return true if the pages were predicted from the history or false if
+   *         they're the next sequential pages
+   */
+  bool predict(uintptr_t page, std::vector<uintptr_t> &toPrefetch) const {
+    std::unordered_map<uintptr_t, size_t>::const_iterator it;
+    size_t i;
+
+    toPrefetch.clear();
+    if((it = prevPos.find(page)) != prevPos.end()) {
+      for(i = it->second + 1;
+          i < prevSeq.size() && toPrefetch.size() < depth;
+          i++)
+        if(shouldPrefetch(prevSeq[i])) toPrefetch.push_back(prevSeq[i]);
+      return true;
+    }
+    else {
+      for(page += PAGESZ; page < end && toPrefetch.size() < depth;
+          page += PAGESZ)
+        if(shouldPrefetch(page)) toPrefetch.push_back(page);
+      return false;
+    }
+  }
+
+  size_t getNumHistoryPrefetched() const { return historyPrefetched; }
+  size_t getNumSequentialPrefetched() const { return seqPrefetched; }
+  size_t getNumFaults() const { return faults; }
+  size_t getNumMisses() const { return misses; }
+
+private:
+  /* Maximum number of pages to prefetch per fault */
+  const size_t depth;
+
+  /* Code region served by the fault handler & the interrupt page */
+  const uintptr_t start, end, intPageAddr;
+
+  /* Epoch for which the current sequence is being recorded */
+  size_t epoch;
+
+  /* Page sequences for the previous & current epochs.  Pages in the current
+     sequence are marked if they were prefetched rather than faulted in. */
+  std::vector<uintptr_t> prevSeq;
+  std::vector<std::pair<uintptr_t, bool>> curSeq;
+  std::unordered_map<uintptr_t, size_t> prevPos;
+
+  /* Pages in the previous sequence which were only prefetched */
+  std::unordered_set<uintptr_t> prevPrefetchedOnly;
+
+  /* Pages already served in the current epoch */
+  std::unordered_set<uintptr_t> installed;
+
+  /* Statistics */
+  size_t historyPrefetched, seqPrefetched, faults, misses;
+
+  bool shouldPrefetch(uintptr_t page) const {
+    return page >= start && page < end && page != intPageAddr &&
+           !installed.count(page);
+  }
+};
+
+}
+
+/**
+ * Handle a batch of faults by passing previously-randomized code page pointers
+ * to the kernel.  Multiple threads in the child may fault on the same page, so
+ * de-duplicate page addresses before serving them.  If a prefetcher is
+ * supplied, eagerly serve the pages predicted to fault next.
+ *
+ * @param CT code transformer
+ * @param uffd userfaultfd file descriptor for user-space fault handling
+ * @param msg descriptions of faulting regions
+ * @param nmsg number of messages in msg
+ * @param pages scratch space used to collect unique faulting pages
+ * @param pageBuf a page-sized buffer used to hold page data
+ * @param intPageAddr address of the interrupt page
+ * @param prefetcher fault-ahead prefetcher, or nullptr if disabled
+ * @param handled number of pages successfully served
+ * @return a return code describing the outcome
+ */
+static inline ret_t handleFaults(CodeTransformer *CT,
+                                 int uffd,
+                                 const struct uffd_msg *msg,
+                                 size_t nmsg,
+                                 std::vector<uintptr_t> &pages,
+                                 std::vector<char> &pageBuf,
+                                 uintptr_t intPageAddr,
+                                 FaultPrefetcher *prefetcher,
+                                 size_t &handled) {
+  uintptr_t pageAddr;
+  ret_t code = ret_t::Success, lockCode;
+  std::vector<uintptr_t> toPrefetch;
+  size_t i, numFaulted;
+  bool fromHistory;
+
+  // De-duplicate while preserving the order in which pages faulted (batches
+  // are small, so a linear search is fine)
+  pages.clear();
+  for(i = 0; i < nmsg; i++) {
+    // TODO for Linux 4.11+, handle UFFD_EVENT_FORK, UFFD_EVENT_REMAP,
+    // UFFD_EVENT_REMOVE, UFFD_EVENT_UNMAP
+    if(msg[i].event != UFFD_EVENT_PAGEFAULT) continue;
+    pageAddr = PAGE_DOWN(msg[i].arg.pagefault.address);
+    DEBUGMSG(CT->getProcessPid() << ": handling fault @ 0x" << std::hex
+             << pageAddr << ", flags=" << msg[i].arg.pagefault.flags
+             << ", ptid=" << std::dec << msg[i].arg.pagefault.feat.ptid
+             << (pageAddr == intPageAddr ? " (interrupt page)" : "")
+             << std::endl);
+    if(std::find(pages.begin(), pages.end(), pageAddr) == pages.end())
+      pages.push_back(pageAddr);
+  }
+  if(pages.empty()) return ret_t::Success;
+  numFaulted = pages.size();
 
   DEBUG_VERBOSE(
     // Print the PC causing the fault.  We can't directly interrupt/read child
@@ -53,149 +264,641 @@ static inline ret_t handleFault(CodeTransformer *CT,
   )
 
   // Lock the code window so that if a re-randomization occurs while we're
-  // handling the fault we don't accidentally serve stale code
+  // handling the faults we don't accidentally serve stale code.  Lock once for
+  // the entire batch so all pages come from the same randomization.
   if((code = CT->lockCodeWindow()) != ret_t::Success) return code;
-
-  if(pageAddr != intPageAddr) {
-    if(!(data = CT->zeroCopy(pageAddr))) {
-      if((code = CT->project(pageAddr, pageBuf)) != ret_t::Success)
-        return code;
-      data = (uintptr_t)&pageBuf[0];
+  if(prefetcher) prefetcher->setEpoch(CT->getCodeEpoch());
+  for(i = 0; i < numFaulted; i++) {
+    if(servePage(CT, uffd, pages[i], pageBuf, intPageAddr) == ret_t::Success) {
+      if(prefetcher) prefetcher->recordFault(pages[i]);
+      CT->samplePage(pages[i]);
+      handled++;
+    }
+    else {
+      DEBUGMSG("could not serve page @ 0x" << std::hex << pages[i] << std::dec
+               << std::endl);
+      code = ret_t::UffdCopyFailed;
     }
   }
-  else data = (uintptr_t)&intPage[0];
 
-  if(!uffd::copy(uffd, data, pageAddr)) code = ret_t::UffdCopyFailed;
-  if((code = CT->unlockCodeWindow()) != ret_t::Success) return code;
+  // Serve pages we think will be touched next.  Failing to prefetch isn't an
+  // error, the page will be served when the child faults on it.
+  if(prefetcher) {
+    for(i = 0; i < numFaulted; i++) {
+      fromHistory = prefetcher->predict(pages[i], toPrefetch);
+      for(auto page : toPrefetch) {
+        if(servePage(CT, uffd, page, pageBuf, intPageAddr) != ret_t::Success)
+          break;
+        DEBUGMSG_VERBOSE(CT->getProcessPid() << ": prefetched page @ 0x"
+                         << std::hex << page << std::dec << std::endl);
+        prefetcher->recordPrefetch(page, fromHistory);
+
+        // Code predicted well never faults, count it as executing so it isn't
+        // treated as cold
+        CT->samplePage(page);
+      }
+    }
+  }
+  if((lockCode = CT->unlockCodeWindow()) != ret_t::Success) return lockCode;
 
   return code;
 }
 
 /**
- * Fault handling event loop.  Runs asynchronously to main application.
- * @param arg pointer to CodeTransformer object
- * @return nullptr always
+ * Read any remaining fault messages that are already pending without blocking,
+ * up to the size of the message buffer.
+ *
+ * @param uffd userfaultfd file descriptor
+ * @param msg message buffer
+ * @param nread number of messages already in the buffer, updated with the
+ *              number of additional messages read
+ * @param nfaults capacity of the message buffer
  */
-static void *handleFaultsAsync(void *arg) {
-  CodeTransformer *CT = (CodeTransformer *)arg;
-  int uffd = CT->getUserfaultfd();
-  size_t nfaults = CT->getNumFaultsBatched(), toHandle, i, handled = 0;
+static inline void drainPendingFaults(int uffd,
+                                      struct uffd_msg *msg,
+                                      size_t &nread,
+                                      size_t nfaults) {
+  struct pollfd pfd = { uffd, POLLIN, 0 };
   ssize_t bytesRead;
-  uintptr_t intPage = CT->getIntPageAddr();
-  pid_t me = syscall(SYS_gettid), cpid = CT->getProcessPid();
-  struct uffd_msg *msg = new struct uffd_msg[nfaults];
-  std::vector<char> pageBuf(PAGESZ);
-  Timer t;
 
-  assert(CT && "Invalid CodeTransformer object");
-  assert(uffd >= 0 && "Invalid userfaultfd file descriptor");
-  assert(msg && "Page fault message buffer allocation failed");
+  while(nread < nfaults && poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN)) {
+    bytesRead = read(uffd, &msg[nread],
+                     sizeof(struct uffd_msg) * (nfaults - nread));
+    if(bytesRead <= 0) break;
+    nread += bytesRead / sizeof(struct uffd_msg);
+  }
+}
+
+namespace chameleon {
+
+/**
+ * A single thread serving code page faults for every code transformer.  Each
+ * transformer's userfaultfd is registered with an epoll instance; the loop
+ * thread reads & serves faults from whichever descriptors are ready, so the
+ * number of fault handling threads doesn't grow with the number of children.
+ * The loop thread is started when the first transformer is added & stopped
+ * when the last is removed.
+ */
+class FaultLoop {
+public:
+  /**
+   * Start serving faults for a code transformer.
+   * @param CT code transformer
+   * @return a return code describing the outcome
+   */
+  static ret_t add(CodeTransformer *CT);
+
+  /**
+   * Stop serving faults for a code transformer.  Once this returns the loop
+   * thread no longer touches the transformer.
+   * @param CT code transformer
+   */
+  static void remove(CodeTransformer *CT);
+
+private:
+  /* A transformer's userfaultfd & its fault handling state */
+  struct Source {
+    CodeTransformer *CT;
+    int uffd;
+    bool hungUp;
+    bool active; /* The loop thread is serving faults */
+    std::vector<struct uffd_msg> msg;
+    std::unique_ptr<FaultPrefetcher> prefetcher;
+    size_t handled, batches;
+    Timer t;
+  };
+
+  /* Serializes starting & stopping the loop thread */
+  static pthread_mutex_t setupLock;
 
-  // TODO race condition - if child handler calls cleanup() before we can set
-  // our PID, we may be orphaned.  Need to signal child handler we've finished
-  // initialization
-  CT->setFaultHandlerPid(me);
+  /* Protects the sources; the loop thread marks sources active & serves them
+     without the lock */
+  static pthread_mutex_t lock;
+  static pthread_cond_t idle;
+  static std::unordered_map<uint64_t, std::unique_ptr<Source>> sources;
+  static uint64_t nextId; /* 0 is reserved for the wakeup descriptor */
 
-  DEBUGMSG("chameleon thread " << me << " is handling faults for " << cpid
-           << ", reading from uffd=" << uffd << ", batching " << nfaults
-           << " fault(s)" << std::endl);
+  static int epfd, wakeFd;
+  static bool running, stopping;
+  static pthread_t thread;
 
-  while(!CT->shouldFaultHandlerExit()) {
-    bytesRead = read(uffd, msg, sizeof(struct uffd_msg) * nfaults);
-    if(bytesRead >= 0) {
-      t.start();
-      toHandle = bytesRead / sizeof(struct uffd_msg);
-      for(i = 0; i < toHandle; i++) {
-        // TODO for Linux 4.11+, handle UFFD_EVENT_FORK, UFFD_EVENT_REMAP,
-        // UFFD_EVENT_REMOVE, UFFD_EVENT_UNMAP
-        if(msg[i].event != UFFD_EVENT_PAGEFAULT) continue;
-        if(handleFault(CT, uffd, msg[i], pageBuf, intPage) != ret_t::Success) {
-          INFO("could not handle fault, limping ahead..." << std::endl);
-          continue;
-        }
-        handled++;
+  static void serve(Source &src, std::vector<uintptr_t> &pages,
+                    std::vector<char> &pageBuf);
+  static void *loop(void *arg);
+};
+
+}
+
+pthread_mutex_t FaultLoop::setupLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t FaultLoop::lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t FaultLoop::idle = PTHREAD_COND_INITIALIZER;
+std::unordered_map<uint64_t, std::unique_ptr<FaultLoop::Source>>
+  FaultLoop::sources;
+uint64_t FaultLoop::nextId = 1;
+int FaultLoop::epfd = -1, FaultLoop::wakeFd = -1;
+bool FaultLoop::running = false, FaultLoop::stopping = false;
+pthread_t FaultLoop::thread;
+
+void FaultLoop::serve(Source &src,
+                      std::vector<uintptr_t> &pages,
+                      std::vector<char> &pageBuf) {
+  CodeTransformer *CT = src.CT;
+  size_t nfaults = src.msg.size(), toHandle;
+  ssize_t bytesRead;
+  struct epoll_event ev;
+
+  bytesRead = read(src.uffd, &src.msg[0], sizeof(struct uffd_msg) * nfaults);
+  if(bytesRead <= 0) {
+    if(bytesRead < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+    // The child's address space is gone, stop polling the descriptor until
+    // the transformer is removed
+    DEBUGMSG(CT->getProcessPid() << ": userfaultfd hung up" << std::endl);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, src.uffd, &ev);
+    src.hungUp = true;
+    return;
+  }
+
+  src.t.start();
+  toHandle = bytesRead / sizeof(struct uffd_msg);
+  if(nfaults > 1) drainPendingFaults(src.uffd, &src.msg[0], toHandle, nfaults);
+  if(handleFaults(CT, src.uffd, &src.msg[0], toHandle, pages, pageBuf,
+                  CT->getIntPageAddr(), src.prefetcher.get(), src.handled)
+     != ret_t::Success)
+    INFO("could not handle fault(s), limping ahead..." << std::endl);
+  src.batches++;
+  src.t.end(true);
+  DEBUGMSG_VERBOSE(CT->getProcessPid() << ": fault handling time: "
+                   << src.t.elapsed(Timer::Micro) << " us for " << toHandle
+                   << " fault(s), " << pages.size() << " unique page(s)"
+                   << std::endl);
+}
+
+void *FaultLoop::loop(void *arg) {
+  const size_t maxEvents = 64;
+  struct epoll_event events[maxEvents];
+  std::vector<uintptr_t> pages;
+  std::vector<char> pageBuf(PAGESZ);
+  std::vector<Source *> ready;
+  uint64_t wakeups;
+  int nevents, i;
+#ifdef DEBUG_BUILD
+  pid_t me = syscall(SYS_gettid);
+#endif
+
+  DEBUGMSG("chameleon thread " << me << " is handling faults" << std::endl);
+
+  while(true) {
+    nevents = epoll_wait(epfd, events, maxEvents, -1);
+    if(nevents < 0) {
+      if(errno == EINTR) continue;
+      DEBUGMSG("epoll_wait failed: " << strerror(errno) << std::endl);
+      break;
+    }
+
+    // Mark every ready source active under the lock; sources removed since
+    // epoll_wait() returned are no longer in the map & are skipped
+    if(pthread_mutex_lock(&lock)) break;
+    if(stopping) {
+      pthread_mutex_unlock(&lock);
+      break;
+    }
+    ready.clear();
+    for(i = 0; i < nevents; i++) {
+      if(!events[i].data.u64) {
+        if(read(wakeFd, &wakeups, sizeof(wakeups)) < 0);
+        continue;
       }
-      t.end(true);
-      DEBUGMSG_VERBOSE("fault handling time: " << t.elapsed(Timer::Micro)
-                       << " us for " << toHandle << " fault(s)" << std::endl);
+      auto it = sources.find(events[i].data.u64);
+      if(it == sources.end() || it->second->hungUp) continue;
+      it->second->active = true;
+      ready.push_back(it->second.get());
+    }
+    if(pthread_mutex_unlock(&lock)) break;
+
+    // Serve without the lock, which may take a while when randomizing
+    // lazily, so adding & removing transformers isn't held up.  remove()
+    // waits for an active source before freeing it.
+    for(auto src : ready) {
+      serve(*src, pages, pageBuf);
+      pthread_mutex_lock(&lock);
+      src->active = false;
+      pthread_cond_broadcast(&idle);
+      pthread_mutex_unlock(&lock);
     }
-    else if(errno != EINTR) DEBUGMSG("read failed (return=" << bytesRead
-                                     << "), trying again..." << std::endl);
   }
-  delete [] msg;
 
   DEBUGMSG("fault handler " << me << " exiting" << std::endl);
-  INFO(cpid << ": fault handling: " << t.totalElapsed(Timer::Micro)
-       << " us for " << handled << " fault(s)" << std::endl);
 
   return nullptr;
 }
 
+ret_t FaultLoop::add(CodeTransformer *CT) {
+  Source *src;
+  uint64_t id;
+  int flags;
+  struct epoll_event ev;
+  ret_t code = ret_t::Success;
+
+  if(pthread_mutex_lock(&setupLock)) return ret_t::LockFailed;
+  if(!running) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    stopping = false;
+    if(epfd < 0 || wakeFd < 0 ||
+       epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev) ||
+       pthread_create(&thread, nullptr, loop, nullptr)) {
+      if(epfd >= 0) close(epfd);
+      if(wakeFd >= 0) close(wakeFd);
+      epfd = wakeFd = -1;
+      pthread_mutex_unlock(&setupLock);
+      return ret_t::FaultHandlerFailed;
+    }
+    running = true;
+  }
+
+  src = new Source;
+  src->CT = CT;
+  src->uffd = CT->getUserfaultfd();
+  src->hungUp = src->active = false;
+  src->msg.resize(CT->getNumFaultsBatched());
+  src->handled = src->batches = 0;
+  if(CT->getPrefetchDepth())
+    src->prefetcher.reset(new FaultPrefetcher(CT->getPrefetchDepth(),
+                                              CT->getCodeStart(),
+                                              CT->getCodeEnd(),
+                                              CT->getIntPageAddr()));
+
+  // The loop thread is the only reader, but another descriptor may become
+  // ready in between epoll_wait() & read(), so never block reading
+  flags = fcntl(src->uffd, F_GETFL);
+  if(flags < 0 || fcntl(src->uffd, F_SETFL, flags | O_NONBLOCK)) {
+    delete src;
+    pthread_mutex_unlock(&setupLock);
+    return ret_t::FaultHandlerFailed;
+  }
+
+  if(pthread_mutex_lock(&lock)) {
+    delete src;
+    pthread_mutex_unlock(&setupLock);
+    return ret_t::LockFailed;
+  }
+  id = nextId++;
+  sources[id].reset(src);
+  ev.events = EPOLLIN;
+  ev.data.u64 = id;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, src->uffd, &ev)) {
+    sources.erase(id);
+    code = ret_t::FaultHandlerFailed;
+  }
+  if(pthread_mutex_unlock(&lock)) code = ret_t::LockFailed;
+  if(pthread_mutex_unlock(&setupLock)) code = ret_t::LockFailed;
+
+  DEBUGMSG(CT->getProcessPid() << ": handling faults from uffd="
+           << CT->getUserfaultfd() << ", batching "
+           << CT->getNumFaultsBatched() << " fault(s)" << std::endl);
+
+  return code;
+}
+
+void FaultLoop::remove(CodeTransformer *CT) {
+  std::unique_ptr<Source> src;
+  struct epoll_event ev;
+  uint64_t wakeup = 1;
+  pid_t cpid = CT->getProcessPid();
+
+  if(pthread_mutex_lock(&setupLock)) return;
+  if(pthread_mutex_lock(&lock)) {
+    pthread_mutex_unlock(&setupLock);
+    return;
+  }
+  for(auto it = sources.begin(); it != sources.end(); ++it) {
+    if(it->second->CT != CT) continue;
+    src = std::move(it->second);
+    sources.erase(it);
+    break;
+  }
+
+  // The loop thread may be serving the source without the lock, wait for it
+  // to finish.  The source is out of the map so it won't be picked up again.
+  if(src) {
+    while(src->active) pthread_cond_wait(&idle, &lock);
+    if(!src->hungUp) epoll_ctl(epfd, EPOLL_CTL_DEL, src->uffd, &ev);
+  }
+
+  // Stop the loop thread once nobody's left to serve
+  if(running && sources.empty()) {
+    stopping = true;
+    if(write(wakeFd, &wakeup, sizeof(wakeup)) < 0);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, nullptr);
+    close(epfd);
+    close(wakeFd);
+    epfd = wakeFd = -1;
+    running = false;
+  }
+  else pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&setupLock);
+
+  if(!src) return;
+  INFO(cpid << ": fault handling: " << src->t.totalElapsed(Timer::Micro)
+       << " us for " << src->handled << " page(s) in " << src->batches
+       << " batch(es)" << std::endl);
+  if(src->prefetcher)
+    INFO(cpid << ": fault prefetching: "
+         << src->prefetcher->getNumHistoryPrefetched() << " page(s) "
+         "prefetched from history, "
+         << src->prefetcher->getNumSequentialPrefetched() << " sequentially, "
+         << src->prefetcher->getNumFaults() << " fault(s), "
+         << src->prefetcher->getNumMisses() << " miss(es) on predicted pages"
+         << std::endl);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Re-randomizing code
 ///////////////////////////////////////////////////////////////////////////////
 
-void *randomizeCodeAsync(void *arg) {
-  size_t scrambles = 0;
+/**
+ * Scrambler worker thread main loop.
+ * @param arg the worker
+ * @return nullptr
+ */
+static void *scrambleWorkerAsync(void *arg) {
+  CodeTransformer::ScrambleWorker *worker =
+    (CodeTransformer::ScrambleWorker *)arg;
+  DEBUGMSG("chameleon thread " << syscall(SYS_gettid) << " is scrambler worker "
+           << worker->id << " for " << worker->CT->getProcessPid()
+           << std::endl);
+  worker->CT->runScrambleWorker(*worker);
+  return nullptr;
+}
+
+/**
+ * Analysis worker thread, claims & analyzes functions until none remain.
+ * @param arg the functions being analyzed
+ * @return nullptr
+ */
+static void *analysisWorkerAsync(void *arg) {
+  CodeTransformer::AnalysisWork *work = (CodeTransformer::AnalysisWork *)arg;
+  DEBUGMSG("chameleon thread " << syscall(SYS_gettid) << " is analysis worker "
+           << "for " << work->CT->getProcessPid() << std::endl);
+  work->CT->runAnalysisWorker(*work);
+  return nullptr;
+}
+
+/**
+ * Entry point for threads transforming the child's stacks.
+ * @param arg a CodeTransformer object
+ * @return nullptr
+ */
+static void *transformWorkerAsync(void *arg) {
   CodeTransformer *CT = (CodeTransformer *)arg;
-  sem_t *scramble = CT->getScrambleSem(),
-        *finishedScrambling = CT->getFinishedScrambleSem();
-  pid_t me = syscall(SYS_gettid), cpid = CT->getProcessPid();
-  MemoryWindow &nextCode = CT->getNextCodeWindow();
-  Timer t;
-  ret_t code;
+  DEBUGMSG("chameleon thread " << syscall(SYS_gettid) << " is stack "
+           "transformation worker for " << CT->getProcessPid() << std::endl);
+  CT->runTransformWorker();
+  return nullptr;
+}
 
-  // TODO race condition - if child handler calls cleanup() before we can set
-  // our PID, we may be orphaned.  Need to signal child handler we've finished
-  // initialization
-  CT->setScramberPid(me);
-  if(MASK_INT(sem_wait(scramble))) {
-    DEBUGMSG(cpid << ": scramber could not wait for re-randomization signal"
-             << std::endl);
-    return nullptr;
-  }
+// Number of threads shared by all code transformers generating epochs
+size_t sharedScramblers = 1;
 
-  DEBUGMSG("chameleon thread " << me << " is scrambling code for " << cpid
-           << std::endl);
+namespace chameleon {
 
-  while(!CT->shouldScramblerExit()) {
-    t.start();
+/**
+ * A fixed-size pool of threads generating epochs for every code transformer.
+ * Transformers request an epoch whenever an entry of their ring frees up; the
+ * pool generates requested epochs one at a time per transformer, cycling
+ * through transformers with outstanding requests so that no child starves the
+ * others.  The threads are started when the first transformer is added &
+ * stopped when the last is removed.
+ */
+class ScramblerPool {
+public:
+  /**
+   * Start generating epochs for a code transformer.
+   * @param CT code transformer
+   * @return a return code describing the outcome
+   */
+  static ret_t add(CodeTransformer *CT);
+
+  /**
+   * Request that the pool generate another epoch for a code transformer.  The
+   * transformer's finished scrambling semaphore is posted once generated.
+   * @param CT code transformer
+   * @return a return code describing the outcome
+   */
+  static ret_t request(CodeTransformer *CT);
+
+  /**
+   * Stop generating epochs for a code transformer, waiting for any epoch
+   * currently being generated.  Once this returns the pool no longer touches
+   * the transformer.
+   * @param CT code transformer
+   * @return true if the transformer had been added or false otherwise
+   */
+  static bool remove(CodeTransformer *CT);
+
+  /**
+   * Return whether the pool failed to generate an epoch for a code
+   * transformer, in which case it generates no more.
+   * @param CT code transformer
+   * @return true if generating an epoch failed or false otherwise
+   */
+  static bool failed(CodeTransformer *CT);
+
+private:
+  /* A transformer's outstanding requests & statistics */
+  struct Client {
+    size_t pending; /* Requested epochs not yet being generated */
+    bool active; /* A thread is generating an epoch */
+    bool failed;
+    size_t scrambles;
+    Timer t;
+  };
 
-    nextCode.copy(CT->getCodeWindow());
-    code = CT->randomizeFunctions(nextCode);
-    if(code != ret_t::Success) {
-      // We need to signal to the child handler that the scrambler exited due
-      // to a failure.  Destroy the semaphore so at the next call to
-      // rerandomize(), the child handler's call to sem_wait() fails.
-      sem_destroy(finishedScrambling);
-      break;
-    }
-    scrambles++;
+  /* Serializes starting & stopping the threads */
+  static pthread_mutex_t setupLock;
 
-    t.end(true);
-    DEBUGMSG_VERBOSE("code randomization time: " << t.elapsed(Timer::Micro)
-                     << " us" << std::endl);
+  /* Protects the clients & queue */
+  static pthread_mutex_t lock;
+  static pthread_cond_t work, idle;
+  static std::unordered_map<CodeTransformer *, Client> clients;
+  static std::deque<CodeTransformer *> queue;
 
-    if(sem_post(finishedScrambling)) {
-      DEBUGMSG(cpid << ": scrambler could not signal finished randomizing"
-               << std::endl);
-      break;
+  static std::vector<pthread_t> threads;
+  static bool stopping;
+
+  static void *loop(void *arg);
+};
+
+}
+
+pthread_mutex_t ScramblerPool::setupLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ScramblerPool::lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ScramblerPool::work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t ScramblerPool::idle = PTHREAD_COND_INITIALIZER;
+std::unordered_map<CodeTransformer *, ScramblerPool::Client>
+  ScramblerPool::clients;
+std::deque<CodeTransformer *> ScramblerPool::queue;
+std::vector<pthread_t> ScramblerPool::threads;
+bool ScramblerPool::stopping = false;
+
+void *ScramblerPool::loop(void *arg) {
+  CodeTransformer *CT;
+#ifdef DEBUG_BUILD
+  pid_t me = syscall(SYS_gettid);
+#endif
+  ret_t code;
+
+  DEBUGMSG("chameleon thread " << me << " is scrambling code" << std::endl);
+
+  if(pthread_mutex_lock(&lock)) return nullptr;
+  while(true) {
+    while(!stopping && queue.empty()) pthread_cond_wait(&work, &lock);
+    if(stopping) break;
+
+    // Clients stay in the map while active (see remove()), so the reference
+    // remains valid while generating without the lock
+    CT = queue.front();
+    queue.pop_front();
+    Client &client = clients[CT];
+    client.pending--;
+    client.active = true;
+    pthread_mutex_unlock(&lock);
+
+    client.t.start();
+    code = CT->generateEpoch();
+    client.t.end(true);
+    DEBUGMSG_VERBOSE(CT->getProcessPid() << ": code randomization time: "
+                     << client.t.elapsed(Timer::Micro) << " us"
+                     << std::endl);
+
+    pthread_mutex_lock(&lock);
+    client.active = false;
+    if(code == ret_t::Success && !sem_post(CT->getFinishedScrambleSem())) {
+      client.scrambles++;
+      if(client.pending) queue.push_back(CT);
     }
-    if(MASK_INT(sem_wait(scramble))) {
-      DEBUGMSG(cpid << ": scrambler could not wait for re-randomization signal"
+    else {
+      // We need to signal to the child handler that the scrambler failed.
+      // Post the semaphore so that the child handler's next call to
+      // rerandomize() wakes up & sees the failure.  The semaphore belongs to
+      // the transformer, which destroys it when cleaning up.
+      DEBUGMSG(CT->getProcessPid() << ": could not generate epoch"
                << std::endl);
-      sem_destroy(finishedScrambling);
-      break;
+      client.failed = true;
+      client.pending = 0;
+      sem_post(CT->getFinishedScrambleSem());
     }
+    pthread_cond_broadcast(&idle);
   }
+  pthread_mutex_unlock(&lock);
 
   DEBUGMSG("scrambler " << me << " exiting" << std::endl);
-  INFO(cpid << ": async code randomization: " << t.totalElapsed(Timer::Micro)
-       << " us for " << scrambles << " randomization(s)" << std::endl);
 
   return nullptr;
 }
 
+ret_t ScramblerPool::add(CodeTransformer *CT) {
+  size_t i;
+  pthread_t thread;
+  ret_t code = ret_t::Success;
+
+  if(pthread_mutex_lock(&setupLock)) return ret_t::LockFailed;
+  if(threads.empty()) {
+    stopping = false;
+    for(i = 0; i < std::max<size_t>(sharedScramblers, 1); i++) {
+      if(pthread_create(&thread, nullptr, loop, nullptr)) {
+        if(threads.empty()) {
+          pthread_mutex_unlock(&setupLock);
+          return ret_t::ScramblerFailed;
+        }
+        WARN("could only start " << i << " shared scrambler thread(s)"
+             << std::endl);
+        break;
+      }
+      threads.push_back(thread);
+    }
+  }
+
+  if(pthread_mutex_lock(&lock)) code = ret_t::LockFailed;
+  else {
+    Client &client = clients[CT];
+    client.pending = client.scrambles = 0;
+    client.active = client.failed = false;
+    if(pthread_mutex_unlock(&lock)) code = ret_t::LockFailed;
+  }
+  if(pthread_mutex_unlock(&setupLock)) code = ret_t::LockFailed;
+  return code;
+}
+
+ret_t ScramblerPool::request(CodeTransformer *CT) {
+  if(pthread_mutex_lock(&lock)) return ret_t::LockFailed;
+  auto it = clients.find(CT);
+  if(it != clients.end() && !it->second.failed) {
+    // Clients with outstanding requests are either queued or active, in
+    // which case the generating thread re-queues them
+    if(!it->second.pending && !it->second.active) {
+      queue.push_back(CT);
+      pthread_cond_signal(&work);
+    }
+    it->second.pending++;
+  }
+  if(pthread_mutex_unlock(&lock)) return ret_t::LockFailed;
+  return ret_t::Success;
+}
+
+bool ScramblerPool::remove(CodeTransformer *CT) {
+  pid_t cpid = CT->getProcessPid();
+  size_t scrambles = 0;
+  uint64_t elapsed = 0;
+  bool found = false;
+
+  if(pthread_mutex_lock(&setupLock)) return false;
+  if(pthread_mutex_lock(&lock)) {
+    pthread_mutex_unlock(&setupLock);
+    return false;
+  }
+  auto it = clients.find(CT);
+  if(it != clients.end()) {
+    found = true;
+    queue.erase(std::remove(queue.begin(), queue.end(), CT), queue.end());
+    it->second.pending = 0;
+    while(it->second.active) pthread_cond_wait(&idle, &lock);
+    scrambles = it->second.scrambles;
+    elapsed = it->second.t.totalElapsed(Timer::Micro);
+    clients.erase(it);
+  }
+
+  // Stop the threads once nobody's left to scramble for
+  if(!threads.empty() && clients.empty()) {
+    stopping = true;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&lock);
+    for(auto &thread : threads) pthread_join(thread, nullptr);
+    threads.clear();
+  }
+  else pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&setupLock);
+
+  if(found)
+    INFO(cpid << ": async code randomization: " << elapsed << " us for "
+         << scrambles << " randomization(s)" << std::endl);
+  return found;
+}
+
+bool ScramblerPool::failed(CodeTransformer *CT) {
+  bool failed = false;
+
+  if(pthread_mutex_lock(&lock)) return true;
+  auto it = clients.find(CT);
+  if(it != clients.end()) failed = it->second.failed;
+  pthread_mutex_unlock(&lock);
+  return failed;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CodeTransformer implementation
 ///////////////////////////////////////////////////////////////////////////////
@@ -209,6 +912,21 @@ bool allIdentityRand = false; // all functions use identity randomization
 const char *identityRandFilename = nullptr;
 static std::unordered_set<uintptr_t> identityRand;
 
+// Directory in which to cache analysis results across launches
+const char *analysisCacheDir = nullptr;
+
+// Switch code between randomizations by mapping pre-rendered code from a
+// memory-backed file rather than by dropping code & serving page faults
+bool mapCodeFromFile = false;
+
+// Advance the child to transformation points by trampolining the current
+// function's return through the interrupt page rather than with breakpoints
+bool returnTrampolines = false;
+
+// Randomize functions as their code pages fault rather than generating every
+// function's randomization ahead of each switch
+bool lazyRandomization = false;
+
 // TODO hack, badSitesFilename & badSites should be removed
 const char *badSitesFilename = nullptr;
 static std::unordered_set<uintptr_t> badSites;
@@ -259,12 +977,12 @@ void CodeTransformer::globalInitialize() {
   if(badSitesFilename) parseAddrsInFile(badSitesFilename, badSites, "banishing");
 }
 
-ret_t CodeTransformer::initialize(bool randomize) {
+ret_t CodeTransformer::initialize(bool randomize, bool running) {
   ret_t retcode;
   Timer t;
 
-  if(batchedFaults != 1) {
-    DEBUGMSG("currently can only handle 1 fault at a time" << std::endl);
+  if(!batchedFaults) {
+    DEBUGMSG("must handle at least 1 fault at a time" << std::endl);
     return ret_t::InvalidTransformConfig;
   }
 
@@ -277,6 +995,8 @@ ret_t CodeTransformer::initialize(bool randomize) {
   const Binary::Segment &codeSeg = binary.getCodeSegment();
   retcode = populateCodeWindow(codeSec, codeSeg);
   if(retcode != ret_t::Success) return retcode;
+  intPageAddr = PAGE_DOWN(parasite::infectAddress(proc.getParasiteCtl()));
+  if(running) originalCode.copy(codeWindow);
   if(randomize) {
     // Initialize transformation metadata, analyze code & do initial
     // randomization
@@ -286,19 +1006,48 @@ ret_t CodeTransformer::initialize(bool randomize) {
     if(!rewriteMetadata) return ret_t::BadTransformMetadata;
     retcode = analyzeFunctions();
     if(retcode != ret_t::Success) return retcode;
-    t.start();
-    retcode = randomizeFunctions(codeWindow);
+    retcode = initializeScrambleWorkers();
     if(retcode != ret_t::Success) return retcode;
-    t.end();
-    INFO(proc.getPid() << ": initial randomization: "
-         << t.elapsed(Timer::Micro) << " us" << std::endl);
+
+    // A running child's stacks are laid out for the original code, which
+    // functions describe until they're first randomized.  Leave the code as-is
+    // and let the first epoch randomize it.
+    if(running) {
+      snapshotLayouts(runningSlots, runningFrameSizes);
+      originalSlots = runningSlots;
+      originalFrameSizes = runningFrameSizes;
+    }
+    else {
+      t.start();
+      retcode = randomizeFunctions(codeWindow);
+      if(retcode != ret_t::Success) return retcode;
+      t.end();
+      INFO(proc.getPid() << ": initial randomization: "
+           << t.elapsed(Timer::Micro) << " us" << std::endl);
+      snapshotLayouts(runningSlots, runningFrameSizes);
+
+      // Functions whose instructions kept their sizes when first randomized
+      // are only patched from here on, so their patch sites are valid for the
+      // code of every epoch
+      stablePatchSites = !lazyRandomization;
+      for(auto &RF : functions)
+        if(!RF.second->hasPatchSites()) stablePatchSites = false;
+    }
+
+    // Set up the code file before kicking off the scrambler, which renders
+    // into the code file if available.  Lazy randomization relies on code
+    // faulting in from the code window.
+    if(mapCodeFromFile && !lazyRandomization &&
+       initializeCodeFile() == ret_t::Success) {
+      retcode = renderCode(codeWindow, codeSlot);
+      if(retcode != ret_t::Success) return retcode;
+    }
 
     if((retcode = initializeScrambler()) != ret_t::Success) return retcode;
   }
 
   // Prepare the code region inside the child by setting up correct page
   // permissions
-  intPageAddr = PAGE_DOWN(parasite::infectAddress(proc.getParasiteCtl()));
   retcode = remapCodeSegment(codeSec.address(), codeSec.size());
   if(retcode != ret_t::Success) return retcode;
   return initializeFaultHandling();
@@ -306,77 +1055,118 @@ ret_t CodeTransformer::initialize(bool randomize) {
 
 ret_t CodeTransformer::initializeFromExisting(CodeTransformer &rhs,
                                               bool randomize) {
-  ret_t retcode;
-  struct prevInfo {
-    std::vector<SlotMap> prevRand;
-    uint32_t prevRandFrameSize;
-  };
-  std::unordered_map<uintptr_t, prevInfo> prevRand;
-
-  // Copy existing code & randomization information (if requested)
+  size_t i;
+  bool locked;
+  pthread_mutex_t *lock;
+
+  // The other child is executing using randomization epoch "n" (meaning the
+  // forked child is as well) but the other transformer's scramblers may be
+  // generating later epochs, randomizing its functions as we copy them.  If
+  // patch sites are valid for every epoch, copy functions from their
+  // analysis & the layouts of epoch "n" without waiting for the scramblers.
+  // Otherwise we need the functions' current randomization, so copy them
+  // while neither the scramblers nor (if randomizing lazily) the fault
+  // handler are running.
+  locked = randomize && (lazyRandomization || !rhs.stablePatchSites);
+  lock = lazyRandomization ? &rhs.windowLock : &rhs.scrambleLock;
+  if(locked && pthread_mutex_lock(lock)) return ret_t::LockFailed;
+
+  // Copy the code the other transformer's child is running, which the forked
+  // child inherited.  The thread that forked is stopped at the fork so the
+  // other child can't switch to different code underneath us, but when
+  // randomizing lazily its other threads' faults rewrite the code window.
   codeStart = rhs.codeStart;
   codeEnd = rhs.codeEnd;
   codeWindow.copy(rhs.codeWindow);
   if(randomize) {
-    // We're going to copy the randomization information from the other
-    // CodeTransformer, but that transformer's scrambler could still be
-    // working.  Wait for it to finish before copying to avoid races.
-    if(MASK_INT(sem_wait(&rhs.finishedScrambling)))
-      return ret_t::SemaphoreFailed;
-
-    // The handoff is a little janky.  We've got original code transformer
-    // "rhs" who's working for the parent and current code transformer "this"
-    // who's working for the child.  The parent is currently executing using
-    // randomization epoch "n" (meaning the child is as well since we've
-    // forked) and that's what we're copying into our code window.  However
-    // rhs's scrambler has generated epoch "n+1", setting the instructions in
-    // the randomized functions (which we're copying) to that epoch.  Thus,
-    // when we kick off this' scrambler, it will generate epoch "n+2"; however,
-    // the child is still executing using epoch "n" and thus has execution
-    // state in that format.  After kicking off our scrambler, manually reset
-    // the previous randomization back to epoch "n".
-
 #ifdef DEBUG_BUILD
     curStackBase = rhs.curStackBase;
 #endif
     rewriteMetadata = rhs.rewriteMetadata;
     slotPadding = rhs.slotPadding;
-    for(auto &RF : rhs.functions) {
-      functions.emplace(RF.first, RF.second->copy(codeWindow));
-      prevInfo &prev = prevRand[RF.first];
-      prev.prevRand = RF.second->getPrevRandSlots();
-      prev.prevRandFrameSize = RF.second->getPrevRandFrameSize();
+
+    // Functions share the other transformer's analysis, only copying the
+    // state needed to randomize them separately
+    if(locked) {
+      for(auto &RF : rhs.functions)
+        functions.emplace(RF.first, RF.second->copy(codeWindow));
     }
-    if((retcode = initializeScrambler()) != ret_t::Success) return retcode;
+    else {
+      for(i = 0; i < rhs.functionIndex.size(); i++) {
+        const RandomizedFunction *info = rhs.functionIndex[i].info;
+        functions.emplace(rhs.functionStarts[i],
+                          info->copy(codeWindow, rhs.runningSlots[i],
+                                     rhs.runningFrameSizes[i]));
+      }
+    }
+    stablePatchSites = rhs.stablePatchSites && !locked;
+    buildFunctionIndex();
+    runningSlots = rhs.runningSlots;
+    runningFrameSizes = rhs.runningFrameSizes;
+    for(i = 0; i < functionIndex.size(); i++)
+      functionIndex[i].epoch = rhs.functionIndex[i].epoch;
+    pendingFunctions = rhs.pendingFunctions;
+    codeEpoch = rhs.codeEpoch;
+    if(locked && pthread_mutex_unlock(lock)) return ret_t::LockFailed;
+    numEpochs = rhs.numEpochs;
+    numShards = rhs.numShards;
+    coldPeriod = rhs.coldPeriod;
+
+    // Children's epochs are generated by the shared scrambler threads, which
+    // parallelize across children rather than within each child, so don't
+    // start per-child scrambler workers
+    scrambleThreads = 1;
+  }
 
-    // TODO separate this out into a separate function that can be called after
-    // returning so that we don't block the parent waiting for the child to
-    // finish its first randomization
-    if(MASK_INT(sem_wait(&finishedScrambling))) return ret_t::SemaphoreFailed;
-    for(auto &F : functions) {
-      prevInfo &prev = prevRand[F.first];
-      F.second->setPrevRandSlots(prev.prevRand);
-      F.second->setPrevRandFrameSize(prev.prevRandFrameSize);
+  // The rest of the set up happens in finishInitialization(), which must not
+  // touch the other transformer as its child may exit in the meantime
+  inheritedCodeFile = rhs.mapsCodeFromFile();
+  originalCode.copy(rhs.originalCode);
+  originalSlots = rhs.originalSlots;
+  originalFrameSizes = rhs.originalFrameSizes;
+  intPageAddr = rhs.intPageAddr;
+  batchedFaults = rhs.batchedFaults;
+  prefetchDepth = rhs.prefetchDepth;
+  return ret_t::Success;
+}
+
+ret_t CodeTransformer::finishInitialization(bool randomize) {
+  ret_t retcode;
+
+  if(randomize) {
+    // The child inherited a private mapping of the other transformer's code
+    // file, which will be overwritten by its scrambler.  Give the child its
+    // own code file before kicking off our scrambler, which generates the
+    // child's next epoch while it runs the inherited code.
+    if(inheritedCodeFile && initializeCodeFile() == ret_t::Success) {
+      retcode = renderCode(codeWindow, codeSlot);
+      if(retcode != ret_t::Success) return retcode;
     }
-    if(sem_post(&finishedScrambling)) return ret_t::SemaphoreFailed;
 
-    // We're not actually consuming the other CodeTransformer's randomization -
-    // at the next re-randomization, it'll have code ready to go
-    if(sem_post(&rhs.finishedScrambling)) return ret_t::SemaphoreFailed;
+    if((retcode = initializeScrambler()) != ret_t::Success) return retcode;
   }
 
   // Drop the existing code pages to force the new child to bring in pages from
   // the new buffer; we should have inherited the correct page permissions for
-  // handling faults from the parent.
-  intPageAddr = rhs.intPageAddr;
-  if((retcode = dropCode()) != ret_t::Success) return retcode;
-  batchedFaults = rhs.batchedFaults;
+  // handling faults from the parent.  If the parent mapped code from a file,
+  // either map our own code file or go back to an anonymous mapping suitable
+  // for serving faults.
+  if(mapsCodeFromFile()) retcode = mapCodeSlot(codeSlot);
+  else if(inheritedCodeFile)
+    retcode = remapCodeSegment(codeStart, codeEnd - codeStart);
+  else retcode = dropCode();
+  if(retcode != ret_t::Success) return retcode;
   return initializeFaultHandling();
 }
 
 ret_t CodeTransformer::initializeFaultHandling() {
   ret_t retcode;
 
+  if(pthread_mutex_init(&windowLock, nullptr)) return ret_t::LockFailed;
+
+  // Code pages are always present when mapped from the code file
+  if(mapsCodeFromFile()) return ret_t::Success;
+
   // Grab a userfaultfd descriptor & register code pages
   retcode = proc.stealUserfaultfd();
   if(retcode != ret_t::Success) return retcode;
@@ -388,99 +1178,199 @@ ret_t CodeTransformer::initializeFaultHandling() {
                            codeSec.size()))
     return ret_t::UffdRegisterFailed;
 
-  // Initialize thread for handling faults
-  if(pthread_mutex_init(&windowLock, nullptr)) return ret_t::LockFailed;
-  if(pthread_create(&faultHandler, nullptr, handleFaultsAsync, this))
-    return ret_t::FaultHandlerFailed;
-
-  return ret_t::Success;
+  // Serve faults from the loop shared by all transformers
+  return FaultLoop::add(this);
 }
 
 ret_t CodeTransformer::initializeScrambler() {
-  // Set up a buffer for transforming the child's stack & kick of the
-  // re-randomization thread
+  size_t i;
+  ret_t code;
+
+  // Set up a buffer for transforming the child's stack & the ring of epochs
+  // and ask the shared scramblers to fill the ring from the code the child is
+  // running
   const urange_t &bounds = proc.getStackBounds();
   stackMem.reset(new unsigned char[bounds.second - bounds.first]);
-  if(sem_init(&scramble, 0, 1) || sem_init(&finishedScrambling, 0, 0))
-    return ret_t::ScramblerFailed;
-  if(pthread_create(&scrambler, nullptr, randomizeCodeAsync, this))
+  if(lazyRandomization) return ret_t::Success;
+  buildShards();
+  epochs.reset(new Epoch[numEpochs]);
+  nextEpoch = scrambleEpoch = scrambleShard = 0;
+  renderSlot = (codeSlot + 1) % (numEpochs + 1);
+  lastCode.copy(codeWindow);
+  if(pthread_mutex_init(&scrambleLock, nullptr)) return ret_t::LockFailed;
+  if(sem_init(&finishedScrambling, 0, 0)) return ret_t::ScramblerFailed;
+  if((code = ScramblerPool::add(this)) != ret_t::Success) return code;
+  for(i = 0; i < numEpochs; i++)
+    if((code = ScramblerPool::request(this)) != ret_t::Success) return code;
+  return ret_t::Success;
+}
+
+/**
+ * Sort functions by decreasing code size.
+ * @param a first function
+ * @param b second function
+ * @return true if a is larger than b or false otherwise
+ */
+static bool largerFunction(const RandomizedFunctionPtr *a,
+                           const RandomizedFunctionPtr *b) {
+  return (*a)->getFunctionRecord()->code_size >
+         (*b)->getFunctionRecord()->code_size;
+}
+
+ret_t CodeTransformer::initializeScrambleWorkers() {
+  size_t i, j, numWorkers = std::min(scrambleThreads, functions.size());
+  std::vector<RandomizedFunctionPtr *> bySize;
+  ScrambleWorker *worker;
+
+  if(numWorkers <= 1) return ret_t::Success;
+
+  // Deal functions out largest-first so that every worker starts with a
+  // similar amount of code; stealing evens out whatever skew remains
+  bySize.reserve(functions.size());
+  for(auto &it : functions) bySize.push_back(&it.second);
+  std::sort(bySize.begin(), bySize.end(), largerFunction);
+  scrambleOrder.reserve(functions.size());
+
+  if(sem_init(&scrambleStart, 0, 0) || sem_init(&scrambleDone, 0, 0))
     return ret_t::ScramblerFailed;
+  for(i = 0; i < numWorkers; i++) {
+    worker = new ScrambleWorker;
+    scrambleWorkers.emplace_back(worker);
+    worker->CT = this;
+    worker->id = i;
+    worker->first = scrambleOrder.size();
+    for(j = i; j < bySize.size(); j += numWorkers)
+      scrambleOrder.push_back(bySize[j]);
+    worker->last = scrambleOrder.size();
+    worker->code = ret_t::Success;
+    if(pthread_mutex_init(&worker->lock, nullptr)) return ret_t::LockFailed;
+    if(i && pthread_create(&worker->thread, nullptr, scrambleWorkerAsync,
+                           worker)) {
+      // Hand the worker's functions to the previous worker & carry on with
+      // the threads we've got
+      WARN("could only start " << i << " scrambler thread(s)" << std::endl);
+      pthread_mutex_destroy(&worker->lock);
+      scrambleWorkers.pop_back();
+      for(j = i + 1; j < numWorkers; j++)
+        for(size_t k = j; k < bySize.size(); k += numWorkers)
+          scrambleOrder.push_back(bySize[k]);
+      scrambleWorkers.back()->last = scrambleOrder.size();
+      break;
+    }
+  }
+
+  DEBUGMSG("randomizing " << functions.size() << " function(s) with "
+           << scrambleWorkers.size() << " thread(s)" << std::endl);
+
   return ret_t::Success;
 }
 
+void CodeTransformer::stopScrambleWorkers() {
+  if(scrambleWorkers.empty()) return;
+
+  scrambleWorkersExit = true;
+  for(size_t i = 1; i < scrambleWorkers.size(); i++) sem_post(&scrambleStart);
+  for(size_t i = 1; i < scrambleWorkers.size(); i++)
+    pthread_join(scrambleWorkers[i]->thread, nullptr);
+  for(auto &worker : scrambleWorkers) pthread_mutex_destroy(&worker->lock);
+  sem_destroy(&scrambleStart);
+  sem_destroy(&scrambleDone);
+  scrambleWorkers.clear();
+  scrambleOrder.clear();
+}
+
 ret_t CodeTransformer::cleanup() {
   pid_t pid = proc.getPid();
 
-  faultHandlerExit = true;
-  proc.detach(); // detaching closes the userfaultfd file descriptor
-  if(faultHandlerPid > 0) {
-    // Interrupt the fault handling thread if the thread was already blocking
-    // on a read before closing the userfaultfd file descriptor
-    pthread_kill(faultHandler, SIGINT);
-    pthread_join(faultHandler, nullptr);
-  }
+  // Stop serving faults before detaching closes the userfaultfd file
+  // descriptor
+  FaultLoop::remove(this);
+  proc.detach();
   pthread_mutex_destroy(&windowLock);
 
-  scramblerExit = true;
-  if(scramblerPid > 0) {
-    // Unblock if scrambler was blocked waiting for the re-randomization signal
-    sem_post(&scramble);
-    pthread_join(scrambler, nullptr);
-    sem_destroy(&scramble);
+  if(ScramblerPool::remove(this) || restoringCode) {
     sem_destroy(&finishedScrambling);
+    pthread_mutex_destroy(&scrambleLock);
   }
+  stopScrambleWorkers();
+  stopTransformWorkers();
+
+  if(codeFd >= 0) close(codeFd);
 
   DEBUG(
     codeStart = codeEnd = 0;
     functions.clear();
+    epochs.reset();
+    lastCode.clear();
     slotPadding = 0;
-    faultHandlerPid = scramblerPid = 0;
-    batchedFaults = 0;
+    batchedFaults = prefetchDepth = 0;
     intPageAddr = 0;
     curStackBase = 0;
   )
 
-  if(numRandomizations)
+  if(numRandomizations) {
     INFO(pid << ": switching to new randomization: " << rerandomizeTime
          << " us for " << numRandomizations << " switches" << std::endl);
+    INFO(pid << ": switching code (" << (mapsCodeFromFile() ? "mapping file"
+                                                            : "dropping pages")
+         << "): " << codeSwitchTime << " us for " << numRandomizations
+         << " switches" << std::endl);
+    if(!mapsCodeFromFile())
+      INFO(pid << ": dropped " << droppedPages << " code page(s) for "
+           << numRandomizations << " switches" << std::endl);
+    if(hwAdvances)
+      INFO(pid << ": advancing to transformation points (hardware "
+           "breakpoints): " << hwAdvanceTime << " us for " << hwAdvances
+           << " switches" << std::endl);
+    if(swAdvances)
+      INFO(pid << ": advancing to transformation points (breakpoint "
+           "instructions): " << swAdvanceTime << " us for " << swAdvances
+           << " switches" << std::endl);
+    if(trampolineAdvances)
+      INFO(pid << ": advancing to transformation points (return "
+           "trampolines): " << trampolineAdvanceTime << " us for "
+           << trampolineAdvances << " switches" << std::endl);
+    if(coldPeriod > 1 && scrambleGeneration)
+      INFO(pid << ": hotness-driven re-randomization: " << scrambledFunctions
+           << " function(s) re-randomized over " << scrambleGeneration
+           << " epoch(s) (" << functionIndex.size() << " function(s) total)"
+           << std::endl);
+    if(lazyRandomization)
+      INFO(pid << ": lazily randomized " << lazyRandomizations
+           << " function(s) over " << numRandomizations << " switches"
+           << std::endl);
+    for(auto &stats : pauseByThreads)
+      INFO(pid << ": stop-the-world pause with " << stats.first
+           << " thread(s): " << stats.second.second / stats.second.first
+           << " us average over " << stats.second.first << " switches"
+           << std::endl);
+  }
 
   return ret_t::Success;
 }
 
 static func_rand_info getFunctionInfoCallback(void *rawCT, uintptr_t addr) {
   CodeTransformer *CT = (CodeTransformer *)rawCT;
-  RandomizedFunction *info;
   func_rand_info cinfo;
-  cinfo.old_frame_size = UINT64_MAX;
 
   // Skip sites explicitly marked as evil
   // TODO this is a hack that should be removed
-  if(badSites.count(addr)) {
+  if(!badSites.empty() && badSites.count(addr)) {
     DEBUGMSG_VERBOSE(" -> preventing transforming bad site at 0x" << std::hex
                      << addr << std::endl);
     memset(&cinfo, 0, sizeof(cinfo));
     return cinfo;
   }
 
-  info = CT->getRandomizedFunctionInfo(addr);
-  if(info) {
-    cinfo.found = true;
-    auto &oldSlots = info->getPrevRandSlots();
-    auto &newSlots = info->getRandomizedSlots();
-    cinfo.old_frame_size = info->getPrevRandFrameSize();
-    cinfo.new_frame_size = info->getRandomizedFrameSize();
-    cinfo.num_old_slots = oldSlots.size();
-    cinfo.old_rand_slots = (const slotmap *)&oldSlots[0];
-    cinfo.num_new_slots = newSlots.size();
-    cinfo.new_rand_slots = (const slotmap *)&newSlots[0];
-  }
-  else memset(&cinfo, 0, sizeof(cinfo));
-
+  if(CT->getRandInfo(addr, cinfo)) return cinfo;
+  memset(&cinfo, 0, sizeof(cinfo));
   return cinfo;
 }
 
 // TODO BANDAGE! compel's APIs restore the thread context from when it was
-// initialized, not from when we do a syscall (applies to the following 2 APIs)
+// initialized, not from when we do a syscall (applies to the following 2 APIs).
+// Note that readRegs()/writeRegs() are served by Process' register cache, so
+// restoring the context only costs a single write before the child resumes.
 
 ret_t CodeTransformer::mapMemory(uintptr_t start,
                                  size_t len,
@@ -509,6 +1399,56 @@ ret_t CodeTransformer::unmapMemory(uintptr_t start, size_t len) const {
   return ret_t::Success;
 }
 
+/* Batches with fewer system calls are injected one call at a time -- infecting
+   the child with the parasite costs a few injected calls of its own */
+static const size_t minBatchedSyscalls = 4;
+
+/**
+ * Build a system call descriptor.
+ * @param nr system call number
+ * @param a1-6 arguments to the system call
+ * @return the system call descriptor
+ */
+static struct parasiteSyscall makeSyscall(long nr,
+                                          long a1 = 0, long a2 = 0,
+                                          long a3 = 0, long a4 = 0,
+                                          long a5 = 0, long a6 = 0) {
+  struct parasiteSyscall call = { nr, { a1, a2, a3, a4, a5, a6 }, 0 };
+  return call;
+}
+
+ret_t CodeTransformer::runSyscalls(
+                          std::vector<struct parasiteSyscall> &calls) const {
+  ret_t code = ret_t::Success;
+  struct user_regs_struct regs;
+
+  if(calls.empty()) return ret_t::Success;
+
+  // TODO BANDAGE! compel's APIs restore the thread context from when it was
+  // initialized, not from when we do a syscall
+  if((code = proc.readRegs(regs)) != ret_t::Success) return code;
+
+  if(calls.size() >= minBatchedSyscalls)
+    code = proc.runSyscalls(&calls[0], calls.size());
+  else {
+    for(auto &call : calls) {
+      code = parasite::syscall(proc.getParasiteCtl(), call.nr, call.ret,
+                               call.args[0], call.args[1], call.args[2],
+                               call.args[3], call.args[4], call.args[5]);
+      if(code != ret_t::Success) break;
+      if(call.ret < 0 && call.ret >= -4095) {
+        code = ret_t::CompelSyscallFailed;
+        break;
+      }
+    }
+  }
+  if(code != ret_t::Success) return code;
+
+  // TODO BANDAGE! compel's APIs restore the thread context from when it was
+  // initialized, not from when we do a syscall
+  return proc.writeRegs(regs);
+}
+
 ret_t CodeTransformer::changeProtection(uintptr_t start,
                                         size_t len,
                                         int prot) const {
@@ -537,6 +1477,52 @@ ret_t CodeTransformer::changeProtection(uintptr_t start,
   return ret_t::Success;
 }
 
+/**
+ * Split a stack into 2 halves and rewrite from the half currently in use to
+ * the other half.  The buffer mirrors the stack, i.e., the child's address
+ * bounds.first corresponds to the start of the buffer.
+ *
+ * @param bounds the stack's usable region in the child
+ * @param buf buffer holding the stack
+ * @param sp the current stack pointer
+ * @param childSrcBase output argument set to the base of the current stack
+ *                     in the child
+ * @param bufSrcBase output argument set to the base of the current stack in
+ *                   the buffer
+ * @param childDstBase output argument set to the base of the transformed
+ *                     stack in the child
+ * @param bufDstBase output argument set to the base of the transformed stack
+ *                   in the buffer
+ * @return an iterator to space in the buffer for reading in the current stack
+ */
+static byte_iterator splitStack(const urange_t &bounds,
+                                unsigned char *buf,
+                                uintptr_t sp,
+                                uintptr_t &childSrcBase,
+                                uintptr_t &bufSrcBase,
+                                uintptr_t &childDstBase,
+                                uintptr_t &bufDstBase) {
+  uintptr_t mid, rawBuf = (uintptr_t)buf;
+  size_t stackSize;
+
+  assert(sp >= bounds.first && sp < bounds.second && "Invalid stack pointer");
+
+  mid = ROUND_DOWN((bounds.first + bounds.second) / 2, 16);
+  if(sp >= mid) { // Currently using top half
+    childSrcBase = bounds.second;
+    childDstBase = mid;
+    stackSize = bounds.second - sp;
+  }
+  else { // Currently using bottom half
+    childSrcBase = mid;
+    childDstBase = bounds.second;
+    stackSize = mid - sp;
+  }
+  bufSrcBase = rawBuf + (childSrcBase - bounds.first);
+  bufDstBase = rawBuf + (childDstBase - bounds.first);
+  return byte_iterator(buf + (sp - bounds.first), stackSize);
+}
+
 #ifdef DEBUG_BUILD
 
 #define FOURMB (4 * 1024 * 1024)
@@ -549,171 +1535,594 @@ byte_iterator CodeTransformer::calcStackBounds(uintptr_t sp,
   uintptr_t rawBuf;
   size_t stackSize;
 
-  // TODO maybe roll this back to the beginning after 1000 switches or so
-  if(sp > 0x5fffff000000) { // First re-randomization
-    const urange_t &stackBounds = proc.getStackBounds();
-    childSrcBase = stackBounds.second;
+  // TODO maybe roll this back to the beginning after 1000 switches or so
+  if(sp > 0x5fffff000000) { // First re-randomization
+    const urange_t &stackBounds = proc.getStackBounds();
+    childSrcBase = stackBounds.second;
+  }
+  else childSrcBase = curStackBase;
+  childDstBase = curStackBase + FOURMB;
+  stackSize = childSrcBase - sp;
+  rawBuf = (uintptr_t)stackMem.get();
+  bufSrcBase = rawBuf + FOURMB;
+  bufDstBase = rawBuf + (2 * FOURMB);
+  return byte_iterator((unsigned char *)rawBuf + FOURMB - stackSize,
+                       stackSize);
+}
+
+byte_iterator CodeTransformer::mapInNewStackRegion(uintptr_t childSrcBase,
+                                                   uintptr_t childDstBase,
+                                                   size_t stackSize) {
+  unsigned char *rawBuf = stackMem.get();
+  std::vector<struct parasiteSyscall> calls;
+
+  // Map in the new stack space and unmap the old
+  calls.push_back(makeSyscall(SYS_mmap, childDstBase - FOURMB, FOURMB,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0));
+  // Don't unmap the very first stack region as it contains extra information,
+  // e.g., environment variables, auxiliary vector
+  if(numRandomizations)
+    calls.push_back(makeSyscall(SYS_munmap, childSrcBase - FOURMB, FOURMB));
+  if(runSyscalls(calls) != ret_t::Success ||
+     (uintptr_t)calls[0].ret != childDstBase - FOURMB)
+    return byte_iterator::empty();
+  return byte_iterator(rawBuf + (2 * FOURMB) - stackSize, stackSize);
+}
+
+#else
+
+byte_iterator CodeTransformer::calcStackBounds(uintptr_t sp,
+                                               uintptr_t &childSrcBase,
+                                               uintptr_t &bufSrcBase,
+                                               uintptr_t &childDstBase,
+                                               uintptr_t &bufDstBase) {
+  return splitStack(proc.getStackBounds(), stackMem.get(), sp, childSrcBase,
+                    bufSrcBase, childDstBase, bufDstBase);
+}
+
+#endif
+
+ret_t CodeTransformer::initializeTransformWorkers() {
+  size_t numWorkers = usableCPUs();
+  pthread_t worker;
+
+  // The tracer transforms stacks as well
+  numWorkers = std::min(numWorkers, stackTransforms.size()) - 1;
+  if(!numWorkers || transformWorkers.size()) return ret_t::Success;
+
+  if(sem_init(&transformStart, 0, 0) || sem_init(&transformDone, 0, 0))
+    return ret_t::ScramblerFailed;
+  for(size_t i = 0; i < numWorkers; i++) {
+    if(pthread_create(&worker, nullptr, transformWorkerAsync, this)) {
+      WARN("could only start " << i << " stack transformation thread(s)"
+           << std::endl);
+      break;
+    }
+    transformWorkers.push_back(worker);
+  }
+
+  DEBUGMSG(proc.getPid() << ": transforming stacks with "
+           << transformWorkers.size() + 1 << " thread(s)" << std::endl);
+
+  return ret_t::Success;
+}
+
+void CodeTransformer::stopTransformWorkers() {
+  if(transformWorkers.empty()) return;
+
+  transformWorkersExit = true;
+  for(size_t i = 0; i < transformWorkers.size(); i++) sem_post(&transformStart);
+  for(auto &worker : transformWorkers) pthread_join(worker, nullptr);
+  sem_destroy(&transformStart);
+  sem_destroy(&transformDone);
+  transformWorkers.clear();
+}
+
+void CodeTransformer::transformNextStacks() {
+  size_t i;
+
+  while((i = __atomic_fetch_add(&nextTransform, 1, __ATOMIC_RELAXED)) <
+        stackTransforms.size()) {
+    StackTransform &st = stackTransforms[i];
+    st.code = arch::transformStack(this, getFunctionInfoCallback,
+                                   rewriteMetadata.get(), st.isReturn,
+                                   st.regs, st.childSrcBase, st.bufSrcBase,
+                                   st.childDstBase, st.bufDstBase);
+  }
+}
+
+void CodeTransformer::runTransformWorker() {
+  while(true) {
+    if(MASK_INT(sem_wait(&transformStart))) break;
+    if(transformWorkersExit) break;
+    transformNextStacks();
+    if(sem_post(&transformDone)) break;
+  }
+}
+
+ret_t CodeTransformer::transformStacks() {
+  size_t i, numWorkers = 0;
+  ret_t code;
+
+  // Threads may have been spawned since the last re-randomization; start
+  // workers as needed
+  if(stackTransforms.size() > 1) {
+    if((code = initializeTransformWorkers()) != ret_t::Success) return code;
+    numWorkers = std::min(transformWorkers.size(), stackTransforms.size() - 1);
   }
-  else childSrcBase = curStackBase;
-  childDstBase = curStackBase + FOURMB;
-  stackSize = childSrcBase - sp;
-  rawBuf = (uintptr_t)stackMem.get();
-  bufSrcBase = rawBuf + FOURMB;
-  bufDstBase = rawBuf + (2 * FOURMB);
-  return byte_iterator((unsigned char *)rawBuf + FOURMB - stackSize,
-                       stackSize);
+
+  nextTransform = 0;
+  for(i = 0; i < numWorkers; i++)
+    if(sem_post(&transformStart)) return ret_t::TransformFailed;
+  transformNextStacks();
+  for(i = 0; i < numWorkers; i++)
+    if(MASK_INT(sem_wait(&transformDone))) return ret_t::TransformFailed;
+
+  for(auto &st : stackTransforms) {
+    if(st.code != ret_t::Success) {
+      DEBUGMSG(proc.getPid() << ": could not transform thread " << st.tid
+               << "'s stack: " << retText(st.code) << std::endl);
+      return st.code;
+    }
+  }
+  return ret_t::Success;
 }
 
-byte_iterator CodeTransformer::mapInNewStackRegion(uintptr_t childSrcBase,
-                                                   uintptr_t childDstBase,
-                                                   size_t stackSize) {
+ret_t CodeTransformer::switchCode() {
+  Epoch &e = epochs[nextEpoch];
   ret_t code;
-  unsigned char *rawBuf = stackMem.get();
 
-  // Map in the new stack space and unmap the old
-  code = mapMemory(childDstBase - FOURMB, FOURMB, PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED);
-  if(code != ret_t::Success) return byte_iterator::empty();
-  // Don't unmap the very first stack region as it contains extra information,
-  // e.g., environment variables, auxiliary vector
-  if(numRandomizations) {
-    code = unmapMemory(childSrcBase - FOURMB, FOURMB);
-    if(code != ret_t::Success) return byte_iterator::empty();
+  // Switch the code window to the new randomized code and either map the
+  // pre-rendered code or drop the changed code pages (forcing fresh page
+  // faults).  The caller frees the epoch so the scrambler can generate
+  // another.
+  if((code = lockCodeWindow()) != ret_t::Success) return code;
+  codeWindow = e.code;
+  codeEpoch++;
+  if((code = unlockCodeWindow()) != ret_t::Success) return code;
+  runningSlots.swap(e.slots);
+  runningFrameSizes.swap(e.frameSizes);
+  nextEpoch = (nextEpoch + 1) % numEpochs;
+  if(mapsCodeFromFile()) {
+    if((code = mapCodeSlot(e.codeSlot)) != ret_t::Success) return code;
+    codeSlot = e.codeSlot;
+    return ret_t::Success;
   }
-  return byte_iterator(rawBuf + (2 * FOURMB) - stackSize, stackSize);
+  return dropCode(e.changedCode);
 }
 
-#else
+ret_t CodeTransformer::switchCodeLazily() {
+  ret_t code = ret_t::Success, lockCode;
 
-byte_iterator CodeTransformer::calcStackBounds(uintptr_t sp,
-                                               uintptr_t &childSrcBase,
-                                               uintptr_t &bufSrcBase,
-                                               uintptr_t &childDstBase,
-                                               uintptr_t &bufDstBase) {
-  uintptr_t mid, rawBuf;
-  size_t stackSize;
-  const urange_t &stackBounds = proc.getStackBounds();
+  // Write the code of functions randomized while transforming stacks & bump
+  // the epoch, then drop all code pages so the remaining functions are
+  // randomized as they fault back in
+  if((code = lockCodeWindow()) != ret_t::Success) return code;
+  for(auto idx : pendingFunctions) {
+    code = rewriteFunction(functions[functionStarts[idx]], codeWindow);
+    if(code != ret_t::Success) break;
+  }
+  pendingFunctions.clear();
+  codeEpoch++;
+  if((lockCode = unlockCodeWindow()) != ret_t::Success) return lockCode;
+  if(code != ret_t::Success) return code;
+  return dropCode();
+}
 
-  assert(sp >= stackBounds.first && sp < stackBounds.second &&
-         "Invalid stack pointer");
+ret_t CodeTransformer::generateEpoch() {
+  Epoch &e = epochs[scrambleEpoch];
+  urange_t shard(shardBounds[scrambleShard], shardBounds[scrambleShard + 1]);
+  ret_t code;
 
-  stackSize = stackBounds.second - stackBounds.first;
-  mid = (stackBounds.first + stackBounds.second) / 2;
-  rawBuf = (uintptr_t)stackMem.get();
-  if(sp >= mid) { // Currently using top half
-    bufSrcBase = rawBuf + stackSize;
-    childSrcBase = stackBounds.second;
-    bufDstBase = rawBuf + (stackSize / 2);
-    childDstBase = mid;
-    stackSize = stackBounds.second - sp;
+  // Randomized functions are shared with anybody copying this transformer's
+  // randomization (see initializeFromExisting()), keep them consistent
+  if(pthread_mutex_lock(&scrambleLock)) return ret_t::LockFailed;
+
+  // Build on the most recently generated epoch, as switches happen in order,
+  // and only re-randomize the next shard.  Every function is snapshotted as
+  // functions in other shards keep their layouts.
+  scrambleGeneration++;
+  if(coldPeriod > 1) selectHotFunctions(shard);
+  e.code.copy(lastCode);
+  code = randomizeFunctions(e.code, shard);
+  if(code == ret_t::Success) {
+    snapshotLayouts(e.slots, e.frameSizes);
+    if(mapsCodeFromFile()) {
+      e.codeSlot = renderSlot;
+      code = renderCode(e.code, renderSlot);
+      renderSlot = (renderSlot + 1) % (numEpochs + 1);
+    }
+    else code = findChangedCode(lastCode, e.code, shard, e.changedCode);
   }
-  else { // Currently using bottom half
-    bufSrcBase = rawBuf + (stackSize / 2);
-    childSrcBase = mid;
-    bufDstBase = rawBuf + stackSize;
-    childDstBase = stackBounds.second;
-    stackSize = mid - sp;
+  if(code == ret_t::Success) {
+    lastCode.copy(e.code);
+    scrambleEpoch = (scrambleEpoch + 1) % numEpochs;
+    scrambleShard = (scrambleShard + 1) % (shardBounds.size() - 1);
   }
-  return byte_iterator((unsigned char *)rawBuf + (sp - stackBounds.first),
-                       stackSize);
-}
 
-#endif
+  if(pthread_mutex_unlock(&scrambleLock)) return ret_t::LockFailed;
+  return code;
+}
 
 ret_t CodeTransformer::rerandomize() {
   typedef RandomizedFunction::TransformType TransformType;
-  uintptr_t sp, childSrcBase, bufSrcBase, childDstBase, bufDstBase;
-  size_t stackSize;
+  pid_t pid = proc.getPid();
+  size_t stackSize, numThreads = proc.getNumThreads();
   TransformType StopTy;
   ret_t code;
-  Timer t;
+  Timer t, switchTimer, pause;
+  byte_iterator stackBuf;
+  Process::RegionList regions;
 
   assert(proc.traceable() && "Invalid process state");
   t.start();
+  pause.start();
+
+  // We only have metadata at transformation points, advance the child's
+  // threads to transformation points where the stack transformation can
+  // bootstrap.
+  stackTransforms.clear();
+  if(numThreads > 1) {
+    code = advanceThreadsToTransformationPoints(t);
+    if(code != ret_t::Success) return code;
+  }
+  else {
+    code = advanceToTransformationPoint(StopTy, t);
+    if(code != ret_t::Success) return code;
+    stackTransforms.emplace_back();
+    stackTransforms.back().tid = pid;
+    stackTransforms.back().isReturn = StopTy == TransformType::Return;
+  }
 
-  // We only have metadata at transformation points, advance the child to a
-  // transformation point where the stack transformation can bootstrap.
-  code = advanceToTransformationPoint(StopTy, t);
-  if(code != ret_t::Success) return code;
-
-  // Read in the child's current stack.  We currently divide the stack into 2
-  // halves and rewrite from one half to the other.
-  if(!(sp = proc.getSP())) return ret_t::PtraceFailed;
-  byte_iterator stackBuf = calcStackBounds(sp, childSrcBase, bufSrcBase,
-                                           childDstBase, bufDstBase);
-  code = proc.readRegion(sp, stackBuf);
-  if(code != ret_t::Success) return code;
-
-  DEBUGMSG_VERBOSE("child stack pointer: 0x" << std::hex << sp << std::endl);
-
-  // Wait for code scrambler to finish next set of code
-  if(MASK_INT(sem_wait(&finishedScrambling))) return ret_t::RandomizeFailed;
+  // Read in each thread's registers & current stack (all stacks are read at
+  // once).  We currently divide stacks into 2 halves and rewrite from one
+  // half to the other.
+  for(auto &st : stackTransforms) {
+    if(numThreads > 1 && (code = proc.selectThread(st.tid)) != ret_t::Success)
+      return code;
+    if((code = proc.readRegs(st.regs)) != ret_t::Success) return code;
+    st.sp = arch::sp(st.regs);
+    if(st.tid == pid) {
+      st.bounds = proc.getStackBounds();
+      stackBuf = calcStackBounds(st.sp, st.childSrcBase, st.bufSrcBase,
+                                 st.childDstBase, st.bufDstBase);
+      st.buf = stackMem.get();
+    }
+    else {
+      for(auto &thread : proc.getThreads())
+        if(thread.tid == st.tid) st.bounds = thread.stackBounds;
+      if(st.sp < st.bounds.first || st.sp >= st.bounds.second) {
+        DEBUGMSG(pid << ": thread " << st.tid << "'s stack pointer 0x"
+                 << std::hex << st.sp << " is outside of its stack"
+                 << std::endl);
+        return ret_t::TransformFailed;
+      }
+      std::vector<unsigned char> &mem = threadStackMem[st.tid];
+      mem.resize(st.bounds.second - st.bounds.first);
+      st.buf = &mem[0];
+      stackBuf = splitStack(st.bounds, st.buf, st.sp, st.childSrcBase,
+                            st.bufSrcBase, st.childDstBase, st.bufDstBase);
+    }
+    regions.emplace_back(st.sp, stackBuf);
 
-  DEBUGMSG_VERBOSE("switching stack base from 0x" << std::hex << childSrcBase
-                   << " -> 0x" << childDstBase << std::endl);
+    DEBUGMSG_VERBOSE(st.tid << ": stack pointer: 0x" << std::hex << st.sp
+                     << ", switching stack base from 0x" << st.childSrcBase
+                     << " -> 0x" << st.childDstBase << std::endl);
+  }
+  if(numThreads > 1 && (code = proc.selectThread(pid)) != ret_t::Success)
+    return code;
+  if((code = proc.readRegions(regions)) != ret_t::Success) return code;
+
+  // Wait for the code scrambler to generate the next epoch, which is usually
+  // already waiting in the ring.  When randomizing lazily, functions are
+  // randomized as stacks are transformed.
+  if(!lazyRandomization) {
+    if(MASK_INT(sem_wait(&finishedScrambling))) return ret_t::RandomizeFailed;
+
+    // The pool posts once when it fails, keep it posted so later attempts
+    // fail rather than block
+    if(ScramblerPool::failed(this)) {
+      sem_post(&finishedScrambling);
+      return ret_t::RandomizeFailed;
+    }
+  }
 
-  // Transform the stack; transformStack() internally sets the register set
-  // (including swinging the SP) to the transformed registers
-  code = arch::transformStack(this, getFunctionInfoCallback,
-                              rewriteMetadata.get(),
-                              StopTy == TransformType::Return,
-                              childSrcBase, bufSrcBase,
-                              childDstBase, bufDstBase, sp);
-  if(code != ret_t::Success) {
+  // Transform the stacks.  Nothing has been written to the child yet, so if
+  // any thread's stack can't be transformed the child is left untouched.
+  if((code = transformStacks()) != ret_t::Success) {
     // We didn't switch the stack because the transform failed.  Restore
     // previously-consumed semaphore to avoid deadlocking when trying to
-    // re-randomize again.
-    sem_post(&finishedScrambling);
+    // re-randomize again.  Functions lazily randomized for the switch keep
+    // their layouts & code until the next attempt.
+    if(!lazyRandomization) sem_post(&finishedScrambling);
     return ret_t::TransformFailed;
   }
 
   // TODO if any of the following actions fail before switching to the new code
   // window we need to sem_post(&finishedScrambling) so we don't deadlock
 
-  stackSize = childDstBase - sp;
+  // Write the transformed registers (including swinging the SP) & stacks
+  // into the child's memory
+  regions.clear();
+  for(auto &st : stackTransforms) {
+    if(numThreads > 1 && (code = proc.selectThread(st.tid)) != ret_t::Success)
+      return code;
+    st.sp = arch::sp(st.regs);
+    stackSize = st.childDstBase - st.sp;
+    stackBuf = byte_iterator(st.buf + (st.sp - st.bounds.first), stackSize);
 #ifdef DEBUG_BUILD
-  stackBuf = mapInNewStackRegion(childSrcBase, childDstBase, stackSize);
-  if(!stackBuf.getLength()) return ret_t::RandomizeFailed;
-  curStackBase += FOURMB;
-#else
-  const urange_t &stackBounds = proc.getStackBounds();
-  stackBuf = byte_iterator(stackMem.get() + (sp - stackBounds.first),
-                           stackSize);
+    if(st.tid == pid) {
+      stackBuf = mapInNewStackRegion(st.childSrcBase, st.childDstBase,
+                                     stackSize);
+      if(!stackBuf.getLength()) return ret_t::RandomizeFailed;
+      curStackBase += FOURMB;
+    }
 #endif
 
-  // Write the transformed stack into the child's memory
-  code = proc.writeRegion(sp, stackBuf);
+    if((code = proc.writeRegs(st.regs)) != ret_t::Success) return code;
+    regions.emplace_back(st.sp, stackBuf);
+  }
+  if(numThreads > 1 && (code = proc.selectThread(pid)) != ret_t::Success)
+    return code;
+  if((code = proc.writeRegions(regions)) != ret_t::Success) return code;
+
+  // Every thread is now consistent with the new randomization, switch the
+  // code to match
+  switchTimer.start();
+  if(lazyRandomization) code = switchCodeLazily();
+  else code = switchCode();
   if(code != ret_t::Success) return code;
-
-  // Switch the code window to the new randomized code, drop the existing code
-  // pages (forcing fresh page faults) and kick off the next code randomization
-  if((code = lockCodeWindow()) != ret_t::Success) return code;
-  codeWindow = nextCodeWindow;
-  if((code = unlockCodeWindow()) != ret_t::Success) return code;
-  if((code = dropCode()) != ret_t::Success) return code;
-  if(sem_post(&scramble)) return ret_t::RandomizeFailed;
+  switchTimer.end();
+  codeSwitchTime += switchTimer.elapsed(Timer::Micro);
+  if(!lazyRandomization &&
+     (code = ScramblerPool::request(this)) != ret_t::Success)
+    return code;
 
   t.end(true);
+  pause.end();
   numRandomizations++;
   rerandomizeTime += t.totalElapsed(Timer::Micro);
+  std::pair<size_t, uint64_t> &stats = pauseByThreads[numThreads];
+  stats.first++;
+  stats.second += pause.elapsed(Timer::Micro);
 
-  DEBUGMSG_VERBOSE(proc.getPid() << ": switching to new randomization took "
+  DEBUGMSG_VERBOSE(pid << ": switching to new randomization took "
                    << t.elapsed(Timer::Micro) << " us" << std::endl);
 
   return ret_t::Success;
 }
 
+ret_t CodeTransformer::restoreOriginalCode(bool randomize) {
+  uintptr_t page;
+  const void *data;
+  std::vector<char> pageBuf(PAGESZ);
+  int uffd = proc.getUserfaultfd();
+  ret_t code;
+
+  if(!originalCode.numRegions() || lazyRandomization)
+    return ret_t::InvalidState;
+
+  if(randomize) {
+    // Stop the scramblers generating epochs & discard the ones waiting in the
+    // ring.  The next epoch becomes the original code, which rerandomize()
+    // transforms the child's stacks back into.
+    if(!restoringCode) {
+      ScramblerPool::remove(this);
+      restoringCode = true;
+    }
+    while(!sem_trywait(&finishedScrambling));
+
+    Epoch &e = epochs[nextEpoch];
+    e.code.copy(originalCode);
+    e.slots = originalSlots;
+    e.frameSizes = originalFrameSizes;
+    if(mapsCodeFromFile()) {
+      e.codeSlot = (codeSlot + 1) % (numEpochs + 1);
+      code = renderCode(e.code, e.codeSlot);
+    }
+    else code = findChangedCode(codeWindow, e.code,
+                                urange_t(codeStart, codeEnd), e.changedCode);
+    if(code != ret_t::Success) return code;
+    if(sem_post(&finishedScrambling)) return ret_t::SemaphoreFailed;
+    if((code = rerandomize()) != ret_t::Success) return code;
+  }
+
+  // A code file stays mapped after detaching, but pages served through the
+  // userfaultfd have to be in place before it's closed.  Stop serving faults
+  // & copy in every page not yet faulted in.
+  if(mapsCodeFromFile()) return ret_t::Success;
+  FaultLoop::remove(this);
+  for(page = PAGE_DOWN(codeStart); page < PAGE_UP(codeEnd); page += PAGESZ) {
+    if(!(data = (const void *)codeWindow.zeroCopy(page))) {
+      if((code = codeWindow.project(page, pageBuf)) != ret_t::Success)
+        return code;
+      data = &pageBuf[0];
+    }
+    if(!uffd::copy(uffd, (uintptr_t)data, page) && errno != EEXIST)
+      return ret_t::UffdCopyFailed;
+  }
+
+  DEBUGMSG(proc.getPid() << ": restored original code" << std::endl);
+
+  return ret_t::Success;
+}
+
+/**
+ * Find the entry for the function enclosing a program counter value in a flat
+ * function index.
+ *
+ * @param starts sorted starting addresses of the indexed functions
+ * @param entries index entries corresponding to the starting addresses
+ * @param pc a program counter value
+ * @return the index of the enclosing function or -1 if not found
+ */
+template<typename Entry>
+static inline ssize_t findIndexedFunction(const std::vector<uintptr_t> &starts,
+                                          const std::vector<Entry> &entries,
+                                          uintptr_t pc) {
+  auto it = std::upper_bound(starts.begin(), starts.end(), pc);
+  if(it == starts.begin()) return -1;
+  ssize_t idx = (it - starts.begin()) - 1;
+  if(pc >= entries[idx].end) return -1;
+  return idx;
+}
+
 RandomizedFunction *
 CodeTransformer::getRandomizedFunctionInfo(uintptr_t pc) const {
+  ssize_t idx = findIndexedFunction(functionStarts, functionIndex, pc);
+  if(idx < 0) return nullptr;
+  return functionIndex[idx].info;
+}
+
+bool CodeTransformer::getRandInfo(uintptr_t pc, func_rand_info &info) {
+  ssize_t idx = findIndexedFunction(functionStarts, functionIndex, pc);
+  const std::vector<SlotMap> *newSlots;
+  uint32_t newFrameSize;
+  ret_t code;
+
+  if(idx < 0) return false;
+
+  // The epoch being switched to has already been generated, the sample only
+  // counts towards epochs generated from here on
+  if(coldPeriod > 1)
+    __atomic_fetch_add(&functionIndex[idx].samples, 1, __ATOMIC_RELAXED);
+  if(lazyRandomization) {
+    // The function has a frame on the stack, randomize it for the epoch being
+    // switched to.  Stack transformation workers may get here concurrently.
+    if(lockCodeWindow() != ret_t::Success) return false;
+    code = randomizeForEpoch(idx, codeEpoch + 1, false);
+    if(unlockCodeWindow() != ret_t::Success || code != ret_t::Success)
+      return false;
+    newSlots = &functionIndex[idx].info->getRandomizedSlots();
+    newFrameSize = functionIndex[idx].info->getRandomizedFrameSize();
+  }
+  else {
+    newSlots = &epochs[nextEpoch].slots[idx];
+    newFrameSize = epochs[nextEpoch].frameSizes[idx];
+  }
+
+  memset(&info, 0, sizeof(func_rand_info));
+  info.found = true;
+  info.old_frame_size = runningFrameSizes[idx];
+  info.new_frame_size = newFrameSize;
+  info.num_old_slots = runningSlots[idx].size();
+  info.old_rand_slots = (const slotmap *)runningSlots[idx].data();
+  info.num_new_slots = newSlots->size();
+  info.new_rand_slots = (const slotmap *)newSlots->data();
+  return true;
+}
+
+ret_t CodeTransformer::randomizeForEpoch(size_t idx,
+                                         size_t epoch,
+                                         bool rewrite) {
+  IndexedFunction &F = functionIndex[idx];
+  ret_t code;
+
+  if(F.epoch >= epoch) return ret_t::Success;
+
+  RandomizedFunctionPtr &info = functions[functionStarts[idx]];
+  runningSlots[idx] = info->getRandomizedSlots();
+  runningFrameSizes[idx] = info->getRandomizedFrameSize();
+  if((code = randomizeSlots(info, rng)) != ret_t::Success) return code;
+  F.epoch = epoch;
+  lazyRandomizations++;
+
+  if(rewrite) return rewriteFunction(info, codeWindow);
+  pendingFunctions.push_back(idx);
+  return ret_t::Success;
+}
+
+void CodeTransformer::samplePage(uintptr_t page) {
+  size_t idx;
+
+  if(coldPeriod <= 1) return;
+  idx = std::upper_bound(functionStarts.begin(), functionStarts.end(), page) -
+        functionStarts.begin();
+  if(idx && functionIndex[idx - 1].end > page) idx--;
+  for(; idx < functionStarts.size() && functionStarts[idx] < page + PAGESZ;
+      idx++)
+    __atomic_fetch_add(&functionIndex[idx].samples, 1, __ATOMIC_RELAXED);
+}
+
+ret_t CodeTransformer::randomizePage(uintptr_t page) {
+  size_t idx;
+  ret_t code;
+
+  if(!lazyRandomization) return ret_t::Success;
+
+  // Randomize every function with code in the page, otherwise a function
+  // spanning several pages could be served code from different epochs.
+  // Start from the function enclosing the start of the page (if any).
+  idx = std::upper_bound(functionStarts.begin(), functionStarts.end(), page) -
+        functionStarts.begin();
+  if(idx && functionIndex[idx - 1].end > page) idx--;
+  for(; idx < functionStarts.size() && functionStarts[idx] < page + PAGESZ;
+      idx++) {
+    code = randomizeForEpoch(idx, codeEpoch, true);
+    if(code != ret_t::Success) return code;
+  }
+  return ret_t::Success;
+}
+
+void CodeTransformer::buildFunctionIndex() {
+  std::vector<std::pair<uintptr_t, RandomizedFunction *>> sorted;
   const function_record *fr;
-  RandomizedFunctionMap::const_iterator func;
 
-  fr = binary.getFunction(pc);
-  if(fr) {
-    func = functions.find(fr->addr);
-    if(func != functions.end()) return func->second.get();
+  sorted.reserve(functions.size());
+  for(auto &F : functions) sorted.emplace_back(F.first, F.second.get());
+  std::sort(sorted.begin(), sorted.end());
+
+  functionStarts.clear();
+  functionIndex.clear();
+  functionStarts.reserve(sorted.size());
+  functionIndex.reserve(sorted.size());
+  for(auto &F : sorted) {
+    fr = F.second->getFunctionRecord();
+    functionStarts.push_back(F.first);
+    functionIndex.emplace_back();
+    functionIndex.back().end = fr->addr + fr->code_size;
+    functionIndex.back().info = F.second;
+    functionIndex.back().epoch = 0;
+    functionIndex.back().samples = 0;
+  }
+}
+
+void CodeTransformer::buildShards() {
+  size_t i, total = 0, cur = 0;
+
+  shardBounds.clear();
+  if(functionIndex.empty()) {
+    shardBounds.assign(2, 0);
+    return;
+  }
+
+  // Close a shard once it holds its share of the code
+  for(auto &F : functionIndex) total += F.info->getFunctionRecord()->code_size;
+  shardBounds.push_back(functionStarts[0]);
+  for(i = 0; i < functionIndex.size() - 1; i++) {
+    cur += functionIndex[i].info->getFunctionRecord()->code_size;
+    if(shardBounds.size() < numShards &&
+       cur * numShards >= total * shardBounds.size())
+      shardBounds.push_back(functionStarts[i + 1]);
+  }
+  shardBounds.push_back(functionIndex.back().end);
+
+  DEBUGMSG(proc.getPid() << ": split code into " << shardBounds.size() - 1
+           << " shard(s)" << std::endl);
+}
+
+void
+CodeTransformer::snapshotLayouts(std::vector<std::vector<SlotMap>> &slots,
+                                 std::vector<uint32_t> &frameSizes) const {
+  size_t i;
+
+  slots.resize(functionIndex.size());
+  frameSizes.resize(functionIndex.size());
+  for(i = 0; i < functionIndex.size(); i++) {
+    slots[i] = functionIndex[i].info->getRandomizedSlots();
+    frameSizes[i] = functionIndex[i].info->getRandomizedFrameSize();
   }
-  return nullptr;
 }
 
 /* Adjust offset based on stack growth direction */
@@ -776,13 +2185,39 @@ static inline uint64_t replaceBits(uint64_t origBits,
   return (origBits & mask) | newBits;
 }
 
+/**
+ * Coalesce word-aligned addresses into a range per page, spanning from the
+ * first to the last word accessed in the page.
+ *
+ * @param words sorted word-aligned addresses
+ * @param ranges output argument populated with the ranges
+ * @return the total number of words covered by the ranges
+ */
+static size_t coalesceWords(const std::vector<uintptr_t> &words,
+                            std::vector<urange_t> &ranges) {
+  size_t numWords = 0;
+
+  ranges.clear();
+  for(auto word : words) {
+    if(!ranges.empty() && PAGE_DOWN(ranges.back().first) == PAGE_DOWN(word))
+      ranges.back().second = word + WORDSZ;
+    else ranges.emplace_back(word, word + WORDSZ);
+  }
+  for(auto &range : ranges) numWords += (range.second - range.first) / WORDSZ;
+  return numWords;
+}
+
 ret_t
 CodeTransformer::sprayTransformBreakpoints(const RandomizedFunction *info,
                      std::unordered_map<uintptr_t, uint64_t> &origData,
                      size_t &interruptSize) const {
-  uint64_t interrupt, origBits, newBits;
+  uint64_t interrupt;
   uintptr_t alignedAddr;
-  size_t position;
+  size_t i, position, offset;
+  std::vector<uintptr_t> words;
+  std::vector<urange_t> ranges;
+  std::vector<uint64_t> data;
+  Process::RegionList regions;
   auto &addrs = info->getTransformAddrs();
   ret_t code;
 
@@ -795,26 +2230,52 @@ CodeTransformer::sprayTransformBreakpoints(const RandomizedFunction *info,
 
   origData.clear();
   interrupt = arch::getInterruptInst(interruptSize);
-  for(auto addr = addrs.begin(); addr != addrs.end(); addr++) {
-    // Read & save original data, mask in interrupt instruction bits, and
-    // write the instruction back to the child's address space.  Note that
-    // ptrace requires reads/writes to be word aligned; make it so.
-    // TODO overwriting return instructions can inadvertently overwrite the
-    // start of other functions, may race with other threads spraying start of
-    // function (if added as transform point)
-    alignedAddr = ROUND_DOWN(addr->first, WORDSZ);
-    code = proc.read(alignedAddr, origBits);
-    if(code != ret_t::Success) {
-      // ptrace fails with EIO if the page data isn't already mapped; just warn
-      // the user & skip this randomization period rather than dying
-      if(errno == EIO) return ret_t::UnmappedMemory;
-      else return code;
+  if(addrs.empty()) return ret_t::Success;
+
+  // Read the words containing transformation points in a single request.
+  // Words in the same page are coalesced into a single range so they can be
+  // written back with one request per page.
+  for(auto &addr : addrs) words.push_back(ROUND_DOWN(addr.first, WORDSZ));
+  std::sort(words.begin(), words.end());
+  data.resize(coalesceWords(words, ranges));
+  for(i = 0, offset = 0; i < ranges.size(); i++) {
+    regions.emplace_back(ranges[i].first,
+      byte_iterator((unsigned char *)&data[offset],
+                    ranges[i].second - ranges[i].first));
+    offset += (ranges[i].second - ranges[i].first) / WORDSZ;
+  }
+  code = proc.readRegions(regions);
+  if(code != ret_t::Success) {
+    // Reads fail with EIO if the page data isn't already mapped; just warn
+    // the user & skip this randomization period rather than dying
+    if(errno == EIO || errno == EFAULT) return ret_t::UnmappedMemory;
+    else return code;
+  }
+
+  // Save original data & mask in interrupt instruction bits
+  // TODO overwriting return instructions can inadvertently overwrite the
+  // start of other functions, may race with other threads spraying start of
+  // function (if added as transform point)
+  for(i = 0, offset = 0; i < ranges.size(); i++) {
+    for(alignedAddr = ranges[i].first; alignedAddr < ranges[i].second;
+        alignedAddr += WORDSZ, offset++) {
+      origData[alignedAddr] = data[offset];
+      words[offset] = alignedAddr;
     }
+  }
+  words.resize(offset);
+  for(auto &addr : addrs) {
+    alignedAddr = ROUND_DOWN(addr.first, WORDSZ);
+    offset = std::lower_bound(words.begin(), words.end(), alignedAddr) -
+             words.begin();
+    position = addr.first - alignedAddr;
+    data[offset] = replaceBits(data[offset], interrupt, position,
+                               interruptSize);
+  }
 
-    origData[alignedAddr] = origBits;
-    position = addr->first - alignedAddr;
-    newBits = replaceBits(origBits, interrupt, position, interruptSize);
-    code = proc.write(alignedAddr, newBits);
+  // Code pages aren't writable by the child, write through the memory file
+  for(auto &region : regions) {
+    code = proc.writeRegion(region.first, region.second);
     if(code != ret_t::Success) return code;
   }
 
@@ -824,25 +2285,160 @@ CodeTransformer::sprayTransformBreakpoints(const RandomizedFunction *info,
 ret_t
 CodeTransformer::restoreTransformBreakpoints(const RandomizedFunction *info,
                const std::unordered_map<uintptr_t, uint64_t> &origData) const {
-  ret_t code = ret_t::Success;
-  for(auto data = origData.begin(); data != origData.end(); data++) {
-    assert(data->first == ROUND_DOWN(data->first, WORDSZ) &&
+  size_t i, offset;
+  std::vector<uintptr_t> words;
+  std::vector<urange_t> ranges;
+  std::vector<uint64_t> data;
+  ret_t code;
+
+  // Original data covers entire ranges sprayed in each page; write back each
+  // range with a single request
+  for(auto &orig : origData) {
+    assert(orig.first == ROUND_DOWN(orig.first, WORDSZ) &&
            "Unaligned transformation address");
-    code = proc.write(data->first, data->second);
-    if(code != ret_t::Success) break;
+    words.push_back(orig.first);
   }
-  return code;
+  std::sort(words.begin(), words.end());
+  data.resize(coalesceWords(words, ranges));
+  for(i = 0; i < words.size(); i++) data[i] = origData.at(words[i]);
+
+  for(i = 0, offset = 0; i < ranges.size(); i++) {
+    byte_iterator buf((unsigned char *)&data[offset],
+                      ranges[i].second - ranges[i].first);
+    code = proc.writeRegion(ranges[i].first, buf);
+    if(code != ret_t::Success) return code;
+    offset += (ranges[i].second - ranges[i].first) / WORDSZ;
+  }
+  return ret_t::Success;
+}
+
+uintptr_t
+CodeTransformer::findReturnAddressSlot(const RandomizedFunction *info,
+                                       uintptr_t pc) const {
+  int32_t offset;
+  ssize_t idx;
+  const std::vector<SlotMap> *slots;
+  uintptr_t slot;
+  bool foundPrologue = false, foundReturn = false;
+  struct user_regs_struct regs;
+
+  // The child is rewound to one of the function's returns after the
+  // trampoline fires
+  for(auto &addr : info->getTransformAddrs())
+    if(addr.second == RandomizedFunction::TransformType::Return)
+      foundReturn = true;
+  if(!foundReturn) return 0;
+
+  // The rewritten prologue sets up the frame pointer & moves the return
+  // address into its randomized slot, and the epilogue moves it back before
+  // returning; only the body in between can be trampolined
+  for(auto &run : info->getInstructions()) {
+    if(run.containsPrologue) {
+      if(pc < (uintptr_t)run.endAddr) return 0;
+      foundPrologue = true;
+    }
+    if(run.containsEpilogue && (uintptr_t)run.startAddr <= pc &&
+       pc < (uintptr_t)run.endAddr) return 0;
+  }
+  if(!foundPrologue) return 0;
+
+  // Slots not in the remapping aren't randomized.  When randomizing lazily,
+  // the running layout is the function's current layout unless it was
+  // randomized for a switch that hasn't happened yet.
+  idx = findIndexedFunction(functionStarts, functionIndex, pc);
+  if(idx < 0) return 0;
+  if(lazyRandomization && functionIndex[idx].epoch <= codeEpoch)
+    slots = &info->getRandomizedSlots();
+  else slots = &runningSlots[idx];
+  offset = RandomizedFunction::getRandomizedOffset(*slots,
+                                                   arch::returnAddressOffset());
+  if(offset == INT32_MAX) offset = arch::returnAddressOffset();
+  offset = slotOffsetFromRegister(0, arch::RegType::FramePointer, offset);
+  if(proc.readRegs(regs) != ret_t::Success) return 0;
+  slot = arch::fp(regs) + offset;
+
+  // Sanity check the slot is on the stack above the stack pointer
+  if(slot < arch::sp(regs) || slot >= proc.getStackBounds().second) return 0;
+  return slot;
+}
+
+/* Maximum time to wait for threads to reach transformation points, in us */
+static const uint64_t advanceTimeout = 10000;
+
+ret_t CodeTransformer::trampolineReturn(const RandomizedFunction *info,
+                                        uintptr_t slot,
+                                        RandomizedFunction::TransformType &Ty,
+                                        Timer &t) {
+  uint64_t retAddr;
+  uintptr_t pc, sp;
+  size_t interruptSize;
+  pid_t pid = proc.getPid(), stopped;
+  int signal;
+  ret_t code;
+
+  // Events the child has yet to report must be handled first
+  for(auto &thread : proc.getThreads())
+    if(thread.pending) return ret_t::AdvancingFailed;
+
+  // Redirect the function's return to the interrupt page & kick the child
+  // towards it.  The function may never return, so only wait for a bit before
+  // stopping the child wherever it is.
+  arch::getInterruptInst(interruptSize);
+  if((code = proc.read(slot, retAddr)) != ret_t::Success) return code;
+  if((code = proc.write(slot, intPageAddr)) != ret_t::Success) return code;
+
+  t.end(true);
+  code = proc.resumeThread(pid, trace::Continue);
+  if(code == ret_t::Success)
+    code = proc.waitThreads(stopped, signal, advanceTimeout);
+  if(code == ret_t::Success && stopped == -1)
+    code = proc.interruptThread(pid, signal);
+  t.start();
+  if(code == ret_t::DoesNotExist || !proc.traceable())
+    return ret_t::InvalidState; // Child exited
+  if(code != ret_t::Success) return code;
+  if(!(pc = proc.getPC())) return ret_t::PtraceFailed;
+
+  // If the child stopped for some other reason, put the return address back.
+  // The function may have unwound without returning (e.g., longjmp() or an
+  // exception), in which case the slot was popped & may be reused by other
+  // frames, so leave it alone.
+  if(pc != intPageAddr + interruptSize) {
+    DEBUGMSG_VERBOSE(pid << ": function didn't return through trampoline, "
+                     "stopped at 0x" << std::hex << pc << std::endl);
+    if(!(sp = proc.getSP())) return ret_t::PtraceFailed;
+    if(slot >= sp && (code = proc.write(slot, retAddr)) != ret_t::Success)
+      return code;
+    return ret_t::AdvancingFailed;
+  }
+
+  // The child popped its frame & returned.  Re-push the real return address
+  // & rewind the child to a return instruction in the function, which is
+  // indistinguishable from having stopped at that return.
+  sp = proc.getSP() - arch::initialFrameSize();
+  if((code = proc.write(slot, retAddr)) != ret_t::Success ||
+     (code = proc.write(sp, retAddr)) != ret_t::Success ||
+     (code = proc.setSP(sp)) != ret_t::Success) return code;
+  for(auto &addr : info->getTransformAddrs()) {
+    if(addr.second != RandomizedFunction::TransformType::Return) continue;
+    Ty = addr.second;
+    return proc.setPC(addr.first);
+  }
+  return ret_t::AdvancingFailed;
 }
 
 ret_t
 CodeTransformer::advanceToTransformationPoint(RandomizedFunction::TransformType &Ty,
-                                                              Timer &t) const {
+                                                              Timer &t) {
   typedef RandomizedFunction::TransformType TransformType;
-  uintptr_t pc;
-  size_t interruptSize;
+  uintptr_t pc, slot;
+  size_t interruptSize = 0;
+  bool hwBreakpoints, atEntry = false;
   const RandomizedFunction *info;
   const function_record *fr;
   std::unordered_map<uintptr_t, uint64_t> origData;
+  std::vector<uintptr_t> hwAddrs;
+  Timer advance;
   ret_t code, restoreCode;
 #ifdef DEBUG_BUILD
   pid_t cpid = proc.getPid();
@@ -859,15 +2455,61 @@ CodeTransformer::advanceToTransformationPoint(RandomizedFunction::TransformType
   // been called or is returning, allowing us to bootstrap transformation.
   if(pc != fr->addr) {
     Ty = info->getTransformationType(pc);
+    if(Ty == TransformType::None && returnTrampolines &&
+       (slot = findReturnAddressSlot(info, pc))) {
+      DEBUGMSG_VERBOSE(cpid << ": trampolining return from function at 0x"
+                       << std::hex << fr->addr << " (current address: 0x"
+                       << pc << ")" << std::endl);
+
+      advance.start();
+      code = trampolineReturn(info, slot, Ty, t);
+      if(code == ret_t::Success) {
+        advance.end();
+        trampolineAdvances++;
+        trampolineAdvanceTime += advance.elapsed(Timer::Micro);
+      }
+      else if(code != ret_t::AdvancingFailed) return code;
+      else {
+        // The function didn't return in time, e.g., it loops forever.  Fall
+        // back to breakpoints from wherever the child stopped.
+        for(auto &thread : proc.getThreads())
+          if(thread.pending) return ret_t::AdvancingFailed;
+        if(!(pc = proc.getPC())) return ret_t::PtraceFailed;
+        info = getRandomizedFunctionInfo(pc);
+        if(!info) return ret_t::NoTransformMetadata;
+        fr = info->getFunctionRecord();
+        if(pc == fr->addr) {
+          Ty = TransformType::CallSite;
+          atEntry = true;
+        }
+        else Ty = info->getTransformationType(pc);
+      }
+    }
     if(Ty == TransformType::None) {
-      DEBUGMSG_VERBOSE(cpid << ": inserting transformation breakpoints inside "
-                       "function at 0x" << std::hex << fr->addr <<
-                       " (current address: 0x" << pc << ")" << std::endl);
-
-      // Insert traps at transformation breakpoints & kick child towards them
-      code = sprayTransformBreakpoints(info, origData, interruptSize);
+      advance.start();
+
+      // If there are few enough transformation points, use hardware
+      // breakpoints rather than rewriting code.  Otherwise insert traps at
+      // transformation breakpoints.
+      hwBreakpoints = info->getTransformAddrs().size() <=
+                      arch::numHardwareBreakpoints();
+      if(hwBreakpoints) {
+        DEBUGMSG_VERBOSE(cpid << ": setting hardware breakpoints inside "
+                         "function at 0x" << std::hex << fr->addr <<
+                         " (current address: 0x" << pc << ")" << std::endl);
+        for(auto &addr : info->getTransformAddrs())
+          hwAddrs.push_back(addr.first);
+        code = proc.setHardwareBreakpoints(hwAddrs);
+      }
+      else {
+        DEBUGMSG_VERBOSE(cpid << ": inserting transformation breakpoints "
+                         "inside function at 0x" << std::hex << fr->addr <<
+                         " (current address: 0x" << pc << ")" << std::endl);
+        code = sprayTransformBreakpoints(info, origData, interruptSize);
+      }
       if(code != ret_t::Success) goto restore;
 
+      // Kick the child towards the breakpoints
       t.end(true);
       // TODO child may stop due to other signal instead of our transformation
       // breakpoints; need to keep continuing until we hit a breakpoint
@@ -881,23 +2523,36 @@ CodeTransformer::advanceToTransformationPoint(RandomizedFunction::TransformType
 
       // Figure out where child stopped & reset instruction address.  Note that
       // if we did *not* stop at a transformation point, we do *not* want to
-      // reset the instruction address - check that first.
+      // reset the instruction address - check that first.  Hardware
+      // breakpoints trap before executing the instruction and don't need to
+      // be rewound.
       pc -= interruptSize;
       if((Ty = info->getTransformationType(pc)) == TransformType::None) {
         code = ret_t::AdvancingFailed;
         goto restore;
       }
-      code = proc.setPC(pc);
+      if(!hwBreakpoints) code = proc.setPC(pc);
 
 restore:
-      restoreCode = restoreTransformBreakpoints(info, origData);
+      if(hwBreakpoints) restoreCode = proc.clearHardwareBreakpoints();
+      else restoreCode = restoreTransformBreakpoints(info, origData);
       if(restoreCode != ret_t::Success) return restoreCode;
       else if(code != ret_t::Success) return code;
+
+      advance.end();
+      if(hwBreakpoints) {
+        hwAdvances++;
+        hwAdvanceTime += advance.elapsed(Timer::Micro);
+      }
+      else {
+        swAdvances++;
+        swAdvanceTime += advance.elapsed(Timer::Micro);
+      }
     }
 
     // If we stopped at a call instruction, walk it into the called function in
     // preparation for transformation
-    if(Ty == TransformType::CallSite)
+    if(Ty == TransformType::CallSite && !atEntry)
       if((code = proc.singleStep()) != ret_t::Success) return code;
   }
   else Ty = TransformType::CallSite;
@@ -908,6 +2563,228 @@ restore:
   return ret_t::Success;
 }
 
+/* Breakpoints sprayed into a function & the original data they replaced */
+typedef std::pair<const RandomizedFunction *,
+                  std::unordered_map<uintptr_t, uint64_t>> SprayedFunction;
+
+/**
+ * Handle a thread stopping with SIGTRAP while advancing threads to
+ * transformation points.  If the thread hit one of its hardware breakpoints
+ * it's already at the transformation point; if it hit one of the sprayed
+ * breakpoints, rewind its instruction address to the breakpoint.
+ *
+ * @param proc the process
+ * @param tid the thread which stopped
+ * @param hwInfo function in which the thread's hardware breakpoints were set
+ *               or nullptr if the thread doesn't use hardware breakpoints
+ * @param interruptSize size of the breakpoint instruction
+ * @param sprayed functions into which breakpoints were sprayed
+ * @param Ty output argument set to the type of transformation point at which
+ *           the thread stopped
+ * @return a return code describing the outcome
+ */
+static ret_t
+reachedTransformBreakpoint(Process &proc, pid_t tid,
+                           const RandomizedFunction *hwInfo,
+                           size_t interruptSize,
+                           const std::vector<SprayedFunction> &sprayed,
+                           RandomizedFunction::TransformType &Ty) {
+  uintptr_t pc;
+  ret_t code;
+
+  if((code = proc.selectThread(tid)) != ret_t::Success) return code;
+  if(!(pc = proc.getPC())) return ret_t::PtraceFailed;
+  if(hwInfo && funcContains(hwInfo->getFunctionRecord(), pc) &&
+     (Ty = hwInfo->getTransformationType(pc)) !=
+     RandomizedFunction::TransformType::None) return ret_t::Success;
+  pc -= interruptSize;
+  for(auto &func : sprayed) {
+    if(!funcContains(func.first->getFunctionRecord(), pc)) continue;
+    if((Ty = func.first->getTransformationType(pc)) ==
+       RandomizedFunction::TransformType::None) break;
+    return proc.setPC(pc);
+  }
+  return ret_t::AdvancingFailed;
+}
+
+ret_t CodeTransformer::advanceThreadsToTransformationPoints(Timer &t) {
+  typedef RandomizedFunction::TransformType TransformType;
+  pid_t pid = proc.getPid(), stopped;
+  uintptr_t pc;
+  size_t i, interruptSize = 0, running = 0;
+  int signal;
+  bool usedHW = false;
+  const RandomizedFunction *info;
+  const function_record *fr;
+  std::vector<pid_t> tids;
+  std::vector<TransformType> types;
+  std::vector<bool> advancing, step, exited;
+  std::vector<const RandomizedFunction *> hwInfo;
+  std::vector<uintptr_t> hwAddrs;
+  std::vector<SprayedFunction> sprayed;
+  Timer advance;
+  ret_t code = ret_t::Success, restoreCode;
+
+  // Threads may have events we haven't reported to the user yet; let them be
+  // handled before trying to move threads around
+  for(auto &thread : proc.getThreads()) {
+    if(thread.pending) return ret_t::AdvancingFailed;
+    tids.push_back(thread.tid);
+  }
+  types.assign(tids.size(), TransformType::None);
+  advancing.assign(tids.size(), false);
+  step.assign(tids.size(), false);
+  exited.assign(tids.size(), false);
+  hwInfo.assign(tids.size(), nullptr);
+  advance.start();
+
+  // Figure out where each thread is.  Threads may already be at a
+  // transformation point (lucky!) or we have to forcibly advance them.
+  for(i = 0; i < tids.size(); i++) {
+    if((code = proc.selectThread(tids[i])) != ret_t::Success) return code;
+    if(!(pc = proc.getPC())) return ret_t::PtraceFailed;
+    info = getRandomizedFunctionInfo(pc);
+    if(!info) return ret_t::NoTransformMetadata;
+    fr = info->getFunctionRecord();
+
+    if(pc == fr->addr) types[i] = TransformType::CallSite;
+    else if((types[i] = info->getTransformationType(pc)) ==
+            TransformType::None) {
+      advancing[i] = true;
+
+      // If there are few enough transformation points, use hardware
+      // breakpoints.  Debug registers are per-thread so they never touch the
+      // code other threads are running.
+      if(info->getTransformAddrs().size() <= arch::numHardwareBreakpoints()) {
+        DEBUGMSG_VERBOSE(tids[i] << ": setting hardware breakpoints inside "
+                         "function at 0x" << std::hex << fr->addr
+                         << " (current address: 0x" << pc << ")"
+                         << std::endl);
+        hwInfo[i] = info;
+        usedHW = true;
+        hwAddrs.clear();
+        for(auto &addr : info->getTransformAddrs())
+          hwAddrs.push_back(addr.first);
+        code = proc.setHardwareBreakpoints(hwAddrs);
+        if(code != ret_t::Success) goto restore;
+        continue;
+      }
+
+      for(auto &func : sprayed)
+        if(func.first == info) info = nullptr;
+      if(!info) continue;
+
+      DEBUGMSG_VERBOSE(tids[i] << ": inserting transformation breakpoints "
+                       "inside function at 0x" << std::hex << fr->addr
+                       << " (current address: 0x" << pc << ")" << std::endl);
+
+      // Insert traps at transformation breakpoints.  Every thread inside the
+      // same function shares the same breakpoints.
+      sprayed.emplace_back(info, std::unordered_map<uintptr_t, uint64_t>());
+      code = sprayTransformBreakpoints(info, sprayed.back().second,
+                                       interruptSize);
+      if(code != ret_t::Success) goto restore;
+    }
+    else step[i] = types[i] == TransformType::CallSite;
+  }
+
+  // Kick threads towards the breakpoints while the rest stay stopped
+  t.end(true);
+  for(i = 0; i < tids.size(); i++) {
+    if(!advancing[i]) continue;
+    if((code = proc.resumeThread(tids[i], trace::Continue)) != ret_t::Success)
+      break;
+    running++;
+  }
+
+  while(code == ret_t::Success && running) {
+    code = proc.waitThreads(stopped, signal, advanceTimeout);
+    if(code != ret_t::Success || stopped == -1) break;
+    for(i = 0; i < tids.size(); i++) if(tids[i] == stopped) break;
+    if(i == tids.size() || !advancing[i]) continue;
+    advancing[i] = false;
+    running--;
+
+    // The thread may have exited or received a signal destined for the
+    // application (which will be delivered after we're done)
+    if(signal == -1) exited[i] = true;
+    else if(signal != SIGTRAP) code = ret_t::AdvancingFailed;
+    else {
+      code = reachedTransformBreakpoint(proc, stopped, hwInfo[i],
+                                        interruptSize, sprayed, types[i]);
+      step[i] = types[i] == TransformType::CallSite;
+    }
+  }
+  t.start();
+
+  // Stop any threads that didn't make it, e.g., blocked in a system call.
+  // They may have reached a breakpoint in the meantime; if so, rewind them.
+  for(i = 0; i < tids.size(); i++) {
+    if(!advancing[i]) continue;
+    restoreCode = proc.interruptThread(tids[i], signal);
+    if(restoreCode == ret_t::DoesNotExist) exited[i] = true;
+    else if(restoreCode != ret_t::Success) return restoreCode;
+    else if(signal == SIGTRAP)
+      reachedTransformBreakpoint(proc, tids[i], hwInfo[i], interruptSize,
+                                 sprayed, types[i]);
+    if(code == ret_t::Success) code = ret_t::AdvancingFailed;
+    DEBUGMSG(pid << ": thread " << tids[i] << " did not reach a "
+             "transformation point" << std::endl);
+  }
+
+restore:
+  if(!proc.traceable()) return ret_t::InvalidState; // Child exited
+  for(auto func = sprayed.rbegin(); func != sprayed.rend(); func++) {
+    restoreCode = restoreTransformBreakpoints(func->first, func->second);
+    if(restoreCode != ret_t::Success) return restoreCode;
+  }
+  for(i = 0; i < tids.size(); i++) {
+    if(exited[i] || !hwInfo[i]) continue;
+    if((restoreCode = proc.selectThread(tids[i])) != ret_t::Success ||
+       (restoreCode = proc.clearHardwareBreakpoints()) != ret_t::Success)
+      return restoreCode;
+  }
+  if(code != ret_t::Success) return code;
+
+  // Attribute the time to the slower strategy if threads needed both
+  advance.end();
+  if(sprayed.size()) {
+    swAdvances++;
+    swAdvanceTime += advance.elapsed(Timer::Micro);
+  }
+  else if(usedHW) {
+    hwAdvances++;
+    hwAdvanceTime += advance.elapsed(Timer::Micro);
+  }
+
+  // If threads stopped at call instructions, walk them into the called
+  // functions in preparation for transformation
+  for(i = 0; i < tids.size(); i++) {
+    if(exited[i] || !step[i]) continue;
+    code = proc.resumeThread(tids[i], trace::SingleStep);
+    if(code != ret_t::Success) return code;
+    code = proc.waitThreads(stopped, signal, advanceTimeout);
+    if(code != ret_t::Success) return code;
+    if(stopped != tids[i] || signal != SIGTRAP) return ret_t::AdvancingFailed;
+  }
+
+  // New threads can't be transformed until they're running their own code;
+  // try again later
+  if(proc.getNumThreads() != tids.size() - std::count(exited.begin(),
+                                                      exited.end(), true))
+    return ret_t::AdvancingFailed;
+
+  for(i = 0; i < tids.size(); i++) {
+    if(exited[i]) continue;
+    stackTransforms.emplace_back();
+    stackTransforms.back().tid = tids[i];
+    stackTransforms.back().isReturn = types[i] == TransformType::Return;
+    DEBUGMSG(tids[i] << ": stopped at transformation point" << std::endl);
+  }
+
+  return proc.selectThread(pid);
+}
+
 instr_t *
 CodeTransformer::getInstruction(uintptr_t pc, RandomizedFunction *info) const {
   const function_record *fr;
@@ -979,6 +2856,15 @@ ret_t CodeTransformer::remapCodeSegment(uintptr_t start, size_t len) const {
   if(parasite::syscall(parasite, SYS_getpid, mmapRet) != ret_t::Success)
     return ret_t::CompelActionFailed;
 
+  // Map the pre-rendered code if available
+  if(mapsCodeFromFile()) {
+    if((code = mapCodeSlot(codeSlot)) != ret_t::Success) return code;
+    t.end();
+    INFO(proc.getPid() << ": code re-mapping: " << t.elapsed(Timer::Micro)
+         << " us" << std::endl);
+    return ret_t::Success;
+  }
+
   DEBUGMSG(proc.getPid() << ": changing code section to anonymous "
            "private mapping for userfaultfd" << std::endl);
 
@@ -1009,15 +2895,64 @@ ret_t CodeTransformer::remapCodeSegment(uintptr_t start, size_t len) const {
   return ret_t::Success;
 }
 
-ret_t CodeTransformer::dropCode() {
+ret_t CodeTransformer::initializeCodeFile() {
+  // Note: use the raw system call in case libc doesn't provide a wrapper
+  codeFd = syscall(SYS_memfd_create, "chameleon-code", MFD_CLOEXEC);
+  if(codeFd < 0) goto fallback;
+  if(ftruncate(codeFd, (numEpochs + 1) * codeSlotSize())) goto fallback;
+  if(proc.passCodeFile(codeFd, childCodeFd) != ret_t::Success) goto fallback;
+
+  DEBUGMSG(proc.getPid() << ": mapping code from file, fd=" << codeFd
+           << " (child fd=" << childCodeFd << ")" << std::endl);
+
+  return ret_t::Success;
+
+fallback:
+  WARN(proc.getPid() << ": could not set up file for mapping code, falling "
+       "back to serving page faults" << std::endl);
+  if(codeFd >= 0) close(codeFd);
+  codeFd = childCodeFd = -1;
+  return ret_t::CodeFileFailed;
+}
+
+ret_t CodeTransformer::renderCode(const MemoryWindow &window,
+                                  size_t slot) const {
+  uintptr_t page, pageStart = PAGE_DOWN(codeStart), pageEnd = PAGE_UP(codeEnd);
+  off_t offset = slot * codeSlotSize();
+  const void *data;
+  std::vector<char> pageBuf(PAGESZ);
+  ret_t code;
+
+  assert(codeFd >= 0 && "Invalid code file descriptor");
+
+  for(page = pageStart; page < pageEnd; page += PAGESZ, offset += PAGESZ) {
+    if(page != intPageAddr) {
+      if(!(data = (const void *)window.zeroCopy(page))) {
+        if((code = window.project(page, pageBuf)) != ret_t::Success)
+          return code;
+        data = &pageBuf[0];
+      }
+    }
+    else data = &intPage[0];
+
+    if(MASK_INT(pwrite(codeFd, data, PAGESZ, offset)) != PAGESZ)
+      return ret_t::CodeFileFailed;
+  }
+
+  return ret_t::Success;
+}
+
+ret_t CodeTransformer::mapCodeSlot(size_t slot) const {
   long ret;
+  uintptr_t pageStart = PAGE_DOWN(codeStart);
   struct parasite_ctl *parasite = proc.getParasiteCtl();
   ret_t code;
 
   assert(parasite && "Invalid parasite control handle");
+  assert(childCodeFd >= 0 && "Invalid code file descriptor");
 
-  DEBUGMSG(proc.getPid() << ": dropping code pages 0x" << std::hex
-           << PAGE_DOWN(codeStart) << " - 0x" << PAGE_UP(codeEnd)
+  DEBUGMSG(proc.getPid() << ": mapping code slot " << slot << " @ 0x"
+           << std::hex << pageStart << " - 0x" << PAGE_UP(codeEnd)
            << std::endl);
 
   // TODO BANDAGE! compel's APIs restore the thread context from when it was
@@ -1025,26 +2960,137 @@ ret_t CodeTransformer::dropCode() {
   struct user_regs_struct regs;
   if((code = proc.readRegs(regs)) != ret_t::Success) return code;
 
-  // The child executes madvise(), which causes the kernel to drop the code
-  // pages.  When returning to userspace, the child causes a page fault, giving
-  // the fault handling thread a chance to serve a page.  We've already told
-  // the fault handling thread to serve an interrupt page, allowing us to
-  // regain control.
-  parasite::syscall(parasite, SYS_madvise, ret, PAGE_DOWN(codeStart),
-                    PAGE_UP(codeEnd - codeStart), MADV_DONTNEED);
-  if(ret) return ret_t::DropCodeFailed;
+  // The child executes mmap(), which atomically replaces the code section with
+  // the pre-rendered code.  Pages are populated up front so the child never
+  // faults on code.  The slot contains an interrupt page where compel injected
+  // the system call, allowing us to regain control after the system call.
+  parasite::syscall(parasite, SYS_mmap, ret, pageStart, codeSlotSize(),
+                    PROT_EXEC | PROT_READ,
+                    MAP_PRIVATE | MAP_FIXED | MAP_POPULATE,
+                    childCodeFd, slot * codeSlotSize());
+  if((uintptr_t)ret != pageStart) return ret_t::RemapCodeFailed;
 
   // TODO BANDAGE! compel's APIs restore the thread context from when it was
   // initialized, not from when we do a syscall
   if((code = proc.writeRegs(regs)) != ret_t::Success) return code;
 
-  // Manually rewrite the interrupt page with actual instructions.
+  // Manually rewrite the interrupt page with actual instructions.  Because
+  // the mapping is private, this doesn't modify the code file.
   code = writeCodePage(intPageAddr);
   if(code != ret_t::Success) return code;
 
   return ret_t::Success;
 }
 
+ret_t CodeTransformer::dropCode() {
+  std::vector<urange_t> all(1, urange_t(PAGE_DOWN(codeStart), PAGE_UP(codeEnd)));
+  return dropCode(all);
+}
+
+ret_t CodeTransformer::dropCode(const std::vector<urange_t> &ranges) {
+  bool droppedIntPage = false;
+  std::vector<struct parasiteSyscall> calls;
+  ret_t code;
+
+  assert(proc.getParasiteCtl() && "Invalid parasite control handle");
+
+  if(ranges.empty()) return ret_t::Success;
+
+  // The child executes madvise(), which causes the kernel to drop the code
+  // pages.  When returning to userspace, the child causes a page fault, giving
+  // the fault handling thread a chance to serve a page.  We've already told
+  // the fault handling thread to serve an interrupt page, allowing us to
+  // regain control.  If the interrupt page isn't dropped, the child returns to
+  // compel's interrupt instruction instead.  All ranges are dropped by a
+  // single batch of system calls.
+  for(auto &range : ranges) {
+    DEBUGMSG(proc.getPid() << ": dropping code pages 0x" << std::hex
+             << range.first << " - 0x" << range.second << std::endl);
+
+    calls.push_back(makeSyscall(SYS_madvise, range.first,
+                                range.second - range.first, MADV_DONTNEED));
+    if(range.first <= intPageAddr && intPageAddr < range.second)
+      droppedIntPage = true;
+    droppedPages += (range.second - range.first) / PAGESZ;
+  }
+  if(runSyscalls(calls) != ret_t::Success) return ret_t::DropCodeFailed;
+
+  // Manually rewrite the interrupt page with actual instructions.
+  if(droppedIntPage) {
+    code = writeCodePage(intPageAddr);
+    if(code != ret_t::Success) return code;
+  }
+
+  return ret_t::Success;
+}
+
+/* Maximum number of ranges dropped when switching randomizations */
+static const size_t maxDropRanges = 16;
+
+ret_t CodeTransformer::findChangedCode(const MemoryWindow &curCode,
+                                       const MemoryWindow &nextCode,
+                                       const urange_t &range,
+                                       std::vector<urange_t> &changed) const {
+  uintptr_t page, pageStart = PAGE_DOWN(std::max(range.first, codeStart)),
+            pageEnd = PAGE_UP(std::min(range.second, codeEnd));
+  const void *cur, *next;
+  std::vector<char> curBuf(PAGESZ), nextBuf(PAGESZ);
+  std::vector<urange_t> merged;
+  std::vector<size_t> splits;
+  size_t i, numPages = 0;
+  ret_t code;
+
+  changed.clear();
+  for(page = pageStart; page < pageEnd; page += PAGESZ) {
+    if(!(cur = (const void *)curCode.zeroCopy(page))) {
+      if((code = curCode.project(page, curBuf)) != ret_t::Success)
+        return code;
+      cur = &curBuf[0];
+    }
+    if(!(next = (const void *)nextCode.zeroCopy(page))) {
+      if((code = nextCode.project(page, nextBuf)) != ret_t::Success)
+        return code;
+      next = &nextBuf[0];
+    }
+    if(!memcmp(cur, next, PAGESZ)) continue;
+
+    numPages++;
+    if(!changed.empty() && changed.back().second == page)
+      changed.back().second += PAGESZ;
+    else changed.emplace_back(page, page + PAGESZ);
+  }
+
+  DEBUGMSG(proc.getPid() << ": " << numPages << " of "
+           << (pageEnd - pageStart) / PAGESZ << " code page(s) changed in "
+           << changed.size() << " range(s)" << std::endl);
+
+  // Each range requires injecting a system call into the child.  Bound the
+  // number of system calls by only splitting ranges at the largest gaps of
+  // unchanged pages; pages in smaller gaps are dropped & re-served.
+  if(changed.size() > maxDropRanges) {
+    auto gapCmp = [&](size_t a, size_t b) {
+      return changed[a].first - changed[a - 1].second >
+             changed[b].first - changed[b - 1].second;
+    };
+
+    for(i = 1; i < changed.size(); i++) splits.push_back(i);
+    std::nth_element(splits.begin(), splits.begin() + maxDropRanges - 1,
+                     splits.end(), gapCmp);
+    splits.resize(maxDropRanges - 1);
+    std::sort(splits.begin(), splits.end());
+
+    page = changed.front().first;
+    for(auto split : splits) {
+      merged.emplace_back(page, changed[split - 1].second);
+      page = changed[split].first;
+    }
+    merged.emplace_back(page, changed.back().second);
+    changed.swap(merged);
+  }
+
+  return ret_t::Success;
+}
+
 ret_t CodeTransformer::populateCodeWindow(const Binary::Section &codeSection,
                                           const Binary::Segment &codeSegment) {
   uintptr_t segStart, curAddr;
@@ -1088,7 +3134,9 @@ ret_t CodeTransformer::populateCodeWindow(const Binary::Section &codeSection,
     return ret_t::InvalidElf;
   }
 
-  // Now, add a region for the code section
+  // Now, add a region for the code section.  Use a copy-on-write region so
+  // that copying the code window at each re-randomization only duplicates the
+  // pages that are actually rewritten.
   len = codeSection.size();
   filelen = binary.getRemainingFileSize(codeStart, codeSegment);
   if(filelen < len)
@@ -1096,7 +3144,7 @@ ret_t CodeTransformer::populateCodeWindow(const Binary::Section &codeSection,
          << filelen << " vs " << codeSection.size() << " bytes)" << std::endl);
   data = binary.getData(codeStart, codeSegment);
   if(!data) return ret_t::MarshalDataFailed;
-  r.reset(new BufferedRegion(codeStart, len, filelen, data));
+  r.reset(new CowRegion(codeStart, len, filelen, data));
   codeWindow.insert(r);
 
   // Finally, add any segment data/zeroed memory after the code section
@@ -1181,7 +3229,8 @@ template<int (*NumOp)(instr_t *),
 ret_t CodeTransformer::analyzeOperands(RandomizedFunctionPtr &info,
                                        uint32_t frameSize,
                                        instr_t *instr,
-                                       bool &wouldRandomize) {
+                                       bool &wouldRandomize,
+                                       AnalysisCache::Function *record) {
   int i, offset;
   opnd_t op;
   arch::RegType type;
@@ -1195,6 +3244,7 @@ ret_t CodeTransformer::analyzeOperands(RandomizedFunctionPtr &info,
       wouldRandomize = true;
       if(arch::getRestriction(instr, op, offset, res)) {
         if((code = info->addRestriction(res)) != ret_t::Success) return code;
+        if(record) record->restrictions.push_back(res);
       }
     }
   }
@@ -1202,7 +3252,8 @@ ret_t CodeTransformer::analyzeOperands(RandomizedFunctionPtr &info,
   return ret_t::Success;
 }
 
-ret_t CodeTransformer::analyzeFunction(RandomizedFunctionPtr &info) {
+ret_t CodeTransformer::analyzeFunction(RandomizedFunctionPtr &info,
+                                       AnalysisCache::Function *record) {
   bool wouldRandomize;
   int32_t update;
   uint32_t frameSize = arch::initialFrameSize(),
@@ -1258,6 +3309,7 @@ ret_t CodeTransformer::analyzeFunction(RandomizedFunctionPtr &info) {
                                instr)) != RandomizedFunction::None) {
       DEBUGMSG_VERBOSE(" -> transformation point" << std::endl);
       info->addTransformAddr((uintptr_t)real, TTy);
+      if(record) record->transformAddrs.emplace_back((uintptr_t)real, TTy);
     }
 
     real += instrSize;
@@ -1275,10 +3327,10 @@ ret_t CodeTransformer::analyzeFunction(RandomizedFunctionPtr &info) {
 
     wouldRandomize = false;
     code = analyzeOperands<instr_num_srcs, instr_get_src>
-                          (info, frameSize, instr, wouldRandomize);
+                          (info, frameSize, instr, wouldRandomize, record);
     if(code != ret_t::Success) return code;
     code = analyzeOperands<instr_num_dsts, instr_get_dst>
-                          (info, frameSize, instr, wouldRandomize);
+                          (info, frameSize, instr, wouldRandomize, record);
     if(code != ret_t::Success) return code;
 
     wouldRandomize |= arch::shouldKeepForRandomization(instr);
@@ -1296,6 +3348,7 @@ ret_t CodeTransformer::analyzeFunction(RandomizedFunctionPtr &info) {
 
         if(arch::getFrameUpdateRestriction(instr, frameSize, update, res)) {
           if((code = info->addRestriction(res)) != ret_t::Success) return code;
+          if(record) record->restrictions.push_back(res);
         }
         wouldRandomize = true;
         frameSize += update;
@@ -1314,6 +3367,9 @@ ret_t CodeTransformer::analyzeFunction(RandomizedFunctionPtr &info) {
                          << (uint64_t)curInstrRun.startAddr << " to 0x"
                          << (uint64_t)curInstrRun.endAddr << std::endl);
 
+        if(record)
+          record->runs.emplace_back((uintptr_t)curInstrRun.startAddr,
+                                    (uintptr_t)curInstrRun.endAddr);
         instrs.emplace_back(std::move(curInstrRun));
       }
       curInstrRun.startAddr = real;
@@ -1328,6 +3384,9 @@ ret_t CodeTransformer::analyzeFunction(RandomizedFunctionPtr &info) {
                      << (uint64_t)curInstrRun.startAddr << " to 0x"
                      << (uint64_t)curInstrRun.endAddr << std::endl);
 
+    if(record)
+      record->runs.emplace_back((uintptr_t)curInstrRun.startAddr,
+                                (uintptr_t)curInstrRun.endAddr);
     instrs.emplace_back(std::move(curInstrRun));
   }
 
@@ -1344,12 +3403,165 @@ ret_t CodeTransformer::analyzeFunction(RandomizedFunctionPtr &info) {
   return code;
 }
 
+ret_t CodeTransformer::analyzeFunctionFromCache(
+                                      RandomizedFunctionPtr &info,
+                                      const AnalysisCache::Function &cached) {
+  size_t instrSize;
+  const function_record *func = info->getFunctionRecord();
+  byte_iterator funcData = info->getInstructionMemory();
+  byte *start = funcData[0], *cur, *end, *prev;
+  app_pc real;
+  SparseInstrList instrs;
+  instr_t *instr;
+  ret_t code;
+
+  if(funcData.getLength() < func->code_size) {
+    DEBUGMSG("code length encoded in metadata larger than available size: "
+             << funcData.getLength() << " vs. " << func->code_size
+             << std::endl);
+    return ret_t::BadTransformMetadata;
+  }
+
+  if(!start) {
+    DEBUGMSG("invalid code iterator" << std::endl);
+    return ret_t::AnalysisFailed;
+  }
+
+  // Replay the analysis in the same order as analyzeFunction() so the
+  // function's regions are built identically
+  for(auto &transform : cached.transformAddrs)
+    info->addTransformAddr(transform.first, transform.second);
+  for(auto &res : cached.restrictions)
+    if((code = info->addRestriction(res)) != ret_t::Success) return code;
+
+  // Only disassemble instructions that will be rewritten during randomization
+  for(auto &run : cached.runs) {
+    if(run.first < func->addr || run.first >= run.second ||
+       run.second > func->addr + func->code_size) {
+      DEBUGMSG("invalid cached instruction run" << std::endl);
+      return ret_t::AnalysisFailed;
+    }
+
+    instrs.emplace_back();
+    InstructionRun &curInstrRun = instrs.back();
+    curInstrRun.startAddr = (app_pc)run.first;
+    curInstrRun.endAddr = (app_pc)run.second;
+    real = (app_pc)run.first;
+    cur = start + (run.first - func->addr);
+    end = start + (run.second - func->addr);
+    while(cur < end) {
+      curInstrRun.instrs.emplace_back();
+      instr = &curInstrRun.instrs.back();
+      instr_init(GLOBAL_DCONTEXT, instr);
+      prev = cur;
+      cur = decode_from_copy(GLOBAL_DCONTEXT, cur, real, instr);
+      if(!cur) return ret_t::AnalysisFailed;
+      instrSize = cur - prev;
+      instr_set_raw_bits(instr, prev, instrSize);
+      real += instrSize;
+    }
+  }
+
+  info->setInstructions(std::move(instrs));
+  return info->finalizeAnalysis();
+}
+
+/**
+ * Hash a set of addresses in sorted order so the hash doesn't depend on the
+ * set's iteration order.
+ *
+ * @param addrs a set of addresses
+ * @param hash initial hash value
+ * @return the hash of the addresses
+ */
+static uint64_t hashAddrs(const std::unordered_set<uintptr_t> &addrs,
+                          uint64_t hash) {
+  std::vector<uintptr_t> sorted(addrs.begin(), addrs.end());
+  std::sort(sorted.begin(), sorted.end());
+  return hashBytes(sorted.data(), sorted.size() * sizeof(uintptr_t), hash);
+}
+
+uint64_t CodeTransformer::getAnalysisCacheKey() const {
+  uint64_t hash = binary.hashCodeAndMetadata();
+  hash = hashAddrs(blacklist, hash);
+  hash = hashBytes(&allIdentityRand, sizeof(allIdentityRand), hash);
+  if(!allIdentityRand) hash = hashAddrs(identityRand, hash);
+  return hash;
+}
+
+void CodeTransformer::runAnalysisWorker(AnalysisWork &work) {
+  size_t i, failed;
+  const function_record *func;
+  Timer t;
+  ret_t code;
+
+  while(true) {
+    i = __atomic_fetch_add(&work.next, 1, __ATOMIC_RELAXED);
+    if(i >= work.order.size()) break;
+    i = work.order[i];
+
+    // Functions after one that already failed can't change the outcome, but
+    // every function before it must still be analyzed in case it fails too
+    if(i > __atomic_load_n(&work.firstFailed, __ATOMIC_RELAXED)) continue;
+    func = work.funcs[i];
+
+    DEBUGMSG("analyzing function @ " << std::hex << func->addr << ", size = "
+             << std::dec << func->code_size << std::endl);
+    t.start();
+
+    work.infos[i] =
+      arch::getRandomizedFunction(binary, func, slotPadding, codeWindow);
+    if(work.cache && work.cache->lookup(func->addr, work.records[i])) {
+      code = analyzeFunctionFromCache(work.infos[i], work.records[i]);
+      __atomic_fetch_add(&work.hits, 1, __ATOMIC_RELAXED);
+    }
+    else code = analyzeFunction(work.infos[i],
+                                work.cache ? &work.records[i] : nullptr);
+    work.codes[i] = code;
+    if(code != ret_t::Success) {
+      failed = __atomic_load_n(&work.firstFailed, __ATOMIC_RELAXED);
+      while(i < failed &&
+            !__atomic_compare_exchange_n(&work.firstFailed, &failed, i, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    t.end();
+    DEBUGMSG_VERBOSE("analyzing function took " << t.elapsed(Timer::Micro)
+                     << " us" << std::endl);
+  }
+}
+
+/**
+ * Sort function indexes so larger functions are analyzed first, which keeps
+ * threads from finishing with a single large function left to analyze.
+ */
+struct LargerFunctionIndex {
+  const std::vector<const function_record *> &funcs;
+  bool operator()(size_t a, size_t b) const
+  { return funcs[a]->code_size > funcs[b]->code_size; }
+};
+
 ret_t CodeTransformer::analyzeFunctions() {
   std::unordered_set<uintptr_t> funcs;
+  std::unique_ptr<AnalysisCache> cache;
+  std::vector<pthread_t> threads;
+  AnalysisWork work;
+  size_t i, numThreads, misses;
+  uint64_t elapsed, cachedElapsed;
   Timer t;
   ret_t code;
 
-  // Analyze every function for which we have transformation metadata
+  if(analysisCacheDir) {
+    cache.reset(new AnalysisCache(analysisCacheDir, getAnalysisCacheKey(),
+                                  binary.getFilename()));
+    if(cache->load() != ret_t::Success)
+      DEBUGMSG("no usable analysis cache at '" << cache->getFilename() << "'"
+               << std::endl);
+  }
+
+  t.start();
+
+  // Gather every function for which we have transformation metadata
   Binary::func_iterator it = binary.getFunctions(codeStart, codeEnd);
   for(; !it.end(); ++it) {
     const function_record *func = *it;
@@ -1369,25 +3581,73 @@ ret_t CodeTransformer::analyzeFunctions() {
     else funcs.insert(func->addr);
 
     if(allIdentityRand) identityRand.insert(func->addr);
+    work.funcs.push_back(func);
+  }
 
-    DEBUGMSG("analyzing function @ " << std::hex << func->addr << ", size = "
-             << std::dec << func->code_size << std::endl);
-    t.start();
+  // Analyze functions in parallel.  Every function is analyzed independently
+  // & only reads the binary and code window, so threads share nothing except
+  // the counter used to claim functions & the first failure.
+  work.CT = this;
+  work.cache = cache.get();
+  work.next = 0;
+  work.hits = 0;
+  work.firstFailed = work.funcs.size();
+  work.infos.resize(work.funcs.size());
+  work.records.resize(work.funcs.size());
+  work.codes.assign(work.funcs.size(), ret_t::Success);
+  work.order.reserve(work.funcs.size());
+  for(i = 0; i < work.funcs.size(); i++) work.order.push_back(i);
+  std::stable_sort(work.order.begin(), work.order.end(),
+                   LargerFunctionIndex{work.funcs});
+
+  numThreads = std::min<size_t>(usableCPUs(), work.funcs.size());
+  for(i = 1; i < numThreads; i++) {
+    threads.emplace_back();
+    if(pthread_create(&threads.back(), nullptr, analysisWorkerAsync, &work)) {
+      WARN("could only start " << i << " analysis thread(s)" << std::endl);
+      threads.pop_back();
+      break;
+    }
+  }
 
-    RandomizedFunctionPtr info =
-      arch::getRandomizedFunction(binary, func, slotPadding, codeWindow);
-    RandomizedFunctionMap::iterator it =
-      functions.emplace(func->addr, std::move(info)).first;
-    code = analyzeFunction(it->second);
-    if(code != ret_t::Success) return code;
+  DEBUGMSG("analyzing " << work.funcs.size() << " function(s) with "
+           << threads.size() + 1 << " thread(s)" << std::endl);
 
-    t.end(true);
-    DEBUGMSG_VERBOSE("analyzing function took " << t.elapsed(Timer::Micro)
-                     << " us" << std::endl);
+  runAnalysisWorker(work);
+  for(auto &thread : threads) pthread_join(thread, nullptr);
+
+  // Every function before the first failure in metadata order was analyzed,
+  // so the outcome (including which error is reported) doesn't depend on how
+  // functions were scheduled
+  if(work.firstFailed < work.funcs.size())
+    return work.codes[work.firstFailed];
+  for(i = 0; i < work.funcs.size(); i++) {
+    functions.emplace(work.funcs[i]->addr, std::move(work.infos[i]));
+    if(cache) cache->record(work.funcs[i]->addr, std::move(work.records[i]));
   }
+  buildFunctionIndex();
 
-  INFO(proc.getPid() << ": analysis: " << t.totalElapsed(Timer::Micro)
-       << " us" << std::endl);
+  t.end();
+  elapsed = t.elapsed(Timer::Micro);
+  misses = work.funcs.size() - work.hits;
+  if(work.hits && !misses) {
+    cachedElapsed = cache->getAnalysisTime();
+    INFO(proc.getPid() << ": analysis: " << elapsed << " us (cache hit, saved "
+         << (cachedElapsed > elapsed ? cachedElapsed - elapsed : 0) << " us)"
+         << std::endl);
+  }
+  else {
+    INFO(proc.getPid() << ": analysis: " << elapsed << " us" << std::endl);
+
+    // Save results for the next launch.  If some functions were found in the
+    // cache keep its original timing, as they weren't fully analyzed here.
+    if(cache) {
+      code = cache->store(work.hits ? cache->getAnalysisTime() : elapsed);
+      if(code != ret_t::Success)
+        WARN("could not write analysis cache '" << cache->getFilename()
+             << "'" << std::endl);
+    }
+  }
 
   return ret_t::Success;
 }
@@ -1404,7 +3664,8 @@ ret_t CodeTransformer::randomizeOperands(const RandomizedFunctionPtr &info,
                                          uint32_t frameSize,
                                          uint32_t randFrameSize,
                                          instr_t *instr,
-                                         bool &changed) {
+                                         bool &changed,
+                                         std::vector<PatchSite> *sites) {
   int i, prevOffset, origOffset, newOffset, regOffset;
   opnd_t op;
   enum arch::RegType type;
@@ -1444,6 +3705,11 @@ ret_t CodeTransformer::randomizeOperands(const RandomizedFunctionPtr &info,
     SetOp(instr, i, op);
     changed = true;
 
+    // Record where the operand needs patching, its location in the encoding
+    // is resolved after re-encoding the instruction
+    if(sites) sites->push_back({ 0, 0, (uint32_t)regOffset, 0, origOffset,
+                                 (uint16_t)type, false });
+
     DEBUGMSG_VERBOSE(" -> remap stack offset " << prevOffset << " -> "
                      << newOffset << " (original: " << origOffset << ")"
                      << std::endl);
@@ -1493,32 +3759,227 @@ static void compareInstructions(byte *real,
 }
 #endif
 
-ret_t CodeTransformer::randomizeFunction(RandomizedFunctionPtr &info,
-                                         MemoryWindow &buffer) {
-  bool changed;
+void CodeTransformer::restoreFrameSizes(FrameSizes &frame) {
+  if(!frame.frameSize) {
+    DEBUGMSG_VERBOSE("found epilogue in function body, restoring frame size "
+                     "to " << frame.maxFrameSize << " (previous), "
+                     << frame.maxRandFrameSize << " (current)" << std::endl);
+    frame.frameSize = frame.maxFrameSize;
+    frame.randFrameSize = frame.maxRandFrameSize;
+  }
+}
+
+ret_t CodeTransformer::rewriteInstruction(RandomizedFunctionPtr &info,
+                                          instr_t *instr,
+                                          byte *&cur,
+                                          byte *&real,
+                                          FrameSizes &frame,
+                                          std::vector<PatchSite> *sites,
+                                          bool &reencode) {
+  bool changed = false;
   int32_t update, offset, instrSize;
-  uint32_t frameSize = arch::initialFrameSize(),
-           maxFrameSize = arch::initialFrameSize(),
-           randFrameSize = arch::initialFrameSize(),
-           maxRandFrameSize = arch::initialFrameSize();
-  size_t count = 0;
+  reg_id_t drsp = arch::getDRRegType(arch::RegType::StackPointer);
+  byte *prev;
+  ret_t code;
+
+  reencode = false;
+  assert(instr_raw_bits_valid(instr) && "Bits not set");
+  instrSize = instr_length(GLOBAL_DCONTEXT, instr);
+
+  DEBUG_VERBOSE(
+    DEBUGMSG_INSTR(std::hex << (uintptr_t)real << " size = " << std::dec
+                   << std::setw(2) << instrSize << " ", instr);
+  )
+
+  if(info->skipTransforming(instr)) {
+    DEBUGMSG_VERBOSE(" -> skipping randomizing" << std::endl);
+    cur += instrSize;
+    real += instrSize;
+    return ret_t::Success;
+  }
+
+  restoreFrameSizes(frame);
+
+  // Allow each ISA-specific randomized function to have its way before
+  // applying generic transformations - this allow architecture-specific
+  // overrides of transformations
+  code = info->transformInstr(frame.frameSize, frame.randFrameSize, instr,
+                              changed);
+  if(code != ret_t::Success) return code;
+  reencode = changed;
+
+  // Rewrite stack slot reference operands to their randomized locations if
+  // there was not already ISA-specific handling
+  if(!changed) {
+    code = randomizeOperands<instr_num_srcs, instr_get_src, instr_set_src>
+                            (info, frame.frameSize, frame.randFrameSize, instr,
+                             changed, sites);
+    if(code != ret_t::Success) return code;
+    code = randomizeOperands<instr_num_dsts, instr_get_dst, instr_set_dst>
+                            (info, frame.frameSize, frame.randFrameSize, instr,
+                             changed, sites);
+    if(code != ret_t::Success) return code;
+  }
+
+  // Keep track of stack pointer updates & rewrite frame update instructions
+  // with randomized size
+  // TODO this logic should be moved into arch.cpp and a function should only
+  // return the frame update/randomized frame update size
+  if(instr_writes_to_reg(instr, drsp, DR_QUERY_DEFAULT)) {
+    reencode = true;
+    update = arch::getFrameUpdateSize(instr);
+    if(update) {
+      offset = (update > 0) ? update : 0;
+      offset = canonicalizeSlotOffset(frame.frameSize + offset,
+                                      arch::RegType::StackPointer, 0);
+      if(info->isBulkFrameUpdate(instr, offset) &&
+         offset <= (int)info->getPrevRandFrameSize()) {
+        offset = info->getRandomizedBulkFrameUpdate();
+        offset = update > 0 ? offset : -offset;
+        code = arch::rewriteFrameUpdate(instr, offset, changed);
+        if(code != ret_t::Success) return code;
+        frame.randFrameSize += offset;
+
+        DEBUGMSG_VERBOSE(" -> rewrite frame update: " << update << " -> "
+                         << offset << std::endl);
+      }
+      else frame.randFrameSize += update;
+      frame.frameSize += update;
+      frame.maxFrameSize = std::max(frame.frameSize, frame.maxFrameSize);
+      frame.maxRandFrameSize = std::max(frame.randFrameSize,
+                                        frame.maxRandFrameSize);
+    }
+  }
+
+  // If we changed anything, re-encode the instruction.  Note that
+  // randomization *may* change the size of individual instructions; the net
+  // code size *must* be identical.
+  if(changed) {
+    // The instruction's raw bits are currently pointing to the last version
+    // of the buffer.  We need to do the following things:
+    //
+    //   1. Point the instruction's raw bits to the current buffer and mark
+    //      them as invalid so that DynamoRIO *actually* re-encodes them
+    //   2. Encode the changed instruction into the new buffer
+    //   3. Point the instruction's raw bits back to the new buffer (which
+    //      sets them as valid), because apparently re-encoding does not do
+    //      this (probably because we're encoding to a copy).
+    //
+    // The last task is required because at the next randomization when we
+    // call instr_length() above, if the bits are not marked valid DynamoRIO
+    // will re-encode the instruction (potentially in a different format) and
+    // may change the instruction's size.
+    prev = cur;
+    instr_set_raw_bits(instr, cur, instrSize);
+    instr_set_raw_bits_valid(instr, false);
+    cur = instr_encode_to_copy(GLOBAL_DCONTEXT, instr, cur, real);
+    if(!cur) {
+      WARN("re-encoding changed instruction failed" << std::endl);
+      return ret_t::RandomizeFailed;
+    }
+    instr_set_raw_bits(instr, prev, cur - prev);
+
+    DEBUG_VERBOSE(
+      if(instrSize != (cur - prev))
+        DEBUGMSG_VERBOSE(" -> changed size of instruction: " << instrSize
+                         << " vs. " << (cur - prev) << std::endl);
+      DEBUGMSG_INSTR(" -> rewrote: size = " << (size_t)(cur - prev) << " ",
+                     instr)
+    );
+  }
+  else cur += instrSize;
+  real += instrSize;
+
+  return ret_t::Success;
+}
+
+ret_t CodeTransformer::patchFunction(RandomizedFunctionPtr &info,
+                                     byte_iterator &funcData) {
+  int newOffset;
+  int32_t disp;
+  bool reencode;
+  size_t reencoded = 0;
   const function_record *func = info->getFunctionRecord();
-  byte_iterator funcData = buffer.getData(func->addr);
-  byte *real, *cur, *prev;
-  SparseInstrList &instrs = info->getInstructions();
-  reg_id_t drsp;
+  FrameSizes frame = { arch::initialFrameSize(), arch::initialFrameSize(),
+                       arch::initialFrameSize(), arch::initialFrameSize() };
+  byte *real, *cur;
   ret_t code;
 
-  assert(funcData[0] && "Invalid code window");
+  for(const PatchSite &site : info->getPatchSites()) {
+    if(site.reencode) {
+      // Frame updates & ISA-specific rewrites go through DynamoRIO.  Patch
+      // sites were recorded assuming instructions keep their size.
+      real = (byte *)func->addr + site.offset;
+      cur = funcData[0] + site.offset;
+      code = rewriteInstruction(info, info->getPatchInstruction(reencoded++),
+                                cur, real, frame, nullptr, reencode);
+      if(code != ret_t::Success) return code;
+      if((cur - funcData[0]) != (real - (byte *)func->addr)) {
+        WARN("changed size of patched instruction @ 0x" << std::hex
+             << func->addr + site.offset << std::endl);
+        return ret_t::RandomizeFailed;
+      }
+      continue;
+    }
+
+    restoreFrameSizes(frame);
+    newOffset = info->getRandomizedOffset(site.origOffset);
+    if(newOffset == INT32_MAX) {
+      WARN("couldn't find new randomized offset for slot originally at offset "
+           << site.origOffset << std::endl);
+      return ret_t::BadTransformMetadata;
+    }
+    disp = slotOffsetFromRegister(frame.randFrameSize,
+                                  (arch::RegType)site.base, newOffset);
+    memcpy(funcData[0] + site.offset, &disp, site.width);
+
+    DEBUGMSG_VERBOSE("patched displacement @ 0x" << std::hex
+                     << func->addr + site.offset << ": slot " << std::dec
+                     << site.origOffset << " -> " << newOffset << std::endl);
+  }
+
+  DEBUGMSG("patched " << info->getPatchSites().size() << " site(s)"
+           << std::endl);
+
+  return ret_t::Success;
+}
+
+ret_t CodeTransformer::randomizeSlots(RandomizedFunctionPtr &info,
+                                      std::random_device &seeds) {
+  const function_record *func = info->getFunctionRecord();
 
   // Randomize the function's layout according to the metadata (or apply
   // identity randomization for specified functions)
-  if(identityRand.count(func->addr)) code = info->resetSlots();
-  else code = info->randomize(rng());
-  if(code != ret_t::Success) return code;
+  if(identityRand.count(func->addr)) return info->resetSlots();
+  else return info->randomize(seeds());
+}
 
-  // Apply the randomization by rewriting instructions
-  drsp = arch::getDRRegType(arch::RegType::StackPointer);
+ret_t CodeTransformer::rewriteFunction(RandomizedFunctionPtr &info,
+                                       MemoryWindow &buffer) {
+  bool reencode, sameSize = true;
+  int32_t dispOffset;
+  size_t firstSite, i;
+  const function_record *func = info->getFunctionRecord();
+  byte_iterator funcData = buffer.getWritableData(func->addr, func->code_size);
+  byte *real, *cur, *start, *realStart;
+  SparseInstrList &instrs = info->getInstructions();
+  FrameSizes frame = { arch::initialFrameSize(), arch::initialFrameSize(),
+                       arch::initialFrameSize(), arch::initialFrameSize() };
+  std::vector<PatchSite> sites;
+  ret_t code;
+
+  if(!funcData) {
+    WARN("could not get writable code for function @ 0x" << std::hex
+         << func->addr << std::endl);
+    return ret_t::RandomizeFailed;
+  }
+
+  // After the first randomization we know exactly which bytes change, write
+  // them directly rather than walking & re-encoding every instruction
+  if(info->hasPatchSites()) return patchFunction(info, funcData);
+
+  // Apply the randomization by rewriting instructions, recording patch sites
+  // for future randomizations along the way
   for(auto instrRunIt = instrs.begin(), runEnd = instrs.end();
       instrRunIt != runEnd;
       instrRunIt++) {
@@ -1529,118 +3990,29 @@ ret_t CodeTransformer::randomizeFunction(RandomizedFunctionPtr &info,
              e = instrRunIt->instrs.end();
         instrIt != e;
         instrIt++) {
-      changed = false;
       instr_t *instr = &*instrIt;
-      assert(instr_raw_bits_valid(instr) && "Bits not set");
-      instrSize = instr_length(GLOBAL_DCONTEXT, instr);
-
-      DEBUG_VERBOSE(
-        DEBUGMSG_INSTR(std::hex << (uintptr_t)real << " size = " << std::dec
-                       << std::setw(2) << instrSize << " ", instr);
-      )
-
-      if(info->skipTransforming(instr)) {
-        DEBUGMSG_VERBOSE(" -> skipping randomizing" << std::endl);
-        cur += instrSize;
-        real += instrSize;
-        continue;
-      }
-
-      // See frame size cleanup comment in analyzeFunction()
-      if(!frameSize) {
-        DEBUGMSG_VERBOSE("found epilogue in function body, restoring frame size "
-                         "to " << maxFrameSize << " (previous), "
-                         << maxRandFrameSize << " (current)" << std::endl);
-        frameSize = maxFrameSize;
-        randFrameSize = maxRandFrameSize;
-      }
-
-      // Allow each ISA-specific randomized function to have its way before
-      // applying generic transformations - this allow architecture-specific
-      // overrides of transformations
-      code = info->transformInstr(frameSize, randFrameSize, instr, changed);
+      start = cur;
+      realStart = real;
+      firstSite = sites.size();
+      code = rewriteInstruction(info, instr, cur, real, frame, &sites,
+                                reencode);
       if(code != ret_t::Success) return code;
-
-      // Rewrite stack slot reference operands to their randomized locations if
-      // there was not already ISA-specific handling
-      if(!changed) {
-        code = randomizeOperands<instr_num_srcs, instr_get_src, instr_set_src>
-                                (info, frameSize, randFrameSize, instr, changed);
-        if(code != ret_t::Success) return code;
-        code = randomizeOperands<instr_num_dsts, instr_get_dst, instr_set_dst>
-                                (info, frameSize, randFrameSize, instr, changed);
-        if(code != ret_t::Success) return code;
+      if((cur - start) != (real - realStart)) sameSize = false;
+
+      // Randomized operands' offsets hold the new displacements, find where
+      // they landed in the encoding.  Fall back to re-encoding if we can't.
+      for(i = firstSite; i < sites.size() && !reencode; i++) {
+        dispOffset = arch::getDisplacementOffset(instr, sites[i].offset,
+                                                 sites[i].width);
+        if(dispOffset < 0) reencode = true;
+        else sites[i].offset = (start - funcData[0]) + dispOffset;
       }
-
-      // Keep track of stack pointer updates & rewrite frame update instructions
-      // with randomized size
-      // TODO this logic should be moved into arch.cpp and a function should only
-      // return the frame update/randomized frame update size
-      if(instr_writes_to_reg(instr, drsp, DR_QUERY_DEFAULT)) {
-        update = arch::getFrameUpdateSize(instr);
-        if(update) {
-          offset = (update > 0) ? update : 0;
-          offset = canonicalizeSlotOffset(frameSize + offset,
-                                          arch::RegType::StackPointer, 0);
-          if(info->isBulkFrameUpdate(instr, offset) &&
-             offset <= (int)info->getPrevRandFrameSize()) {
-            offset = info->getRandomizedBulkFrameUpdate();
-            offset = update > 0 ? offset : -offset;
-            code = arch::rewriteFrameUpdate(instr, offset, changed);
-            if(code != ret_t::Success) return code;
-            randFrameSize += offset;
-
-            DEBUGMSG_VERBOSE(" -> rewrite frame update: " << update << " -> "
-                             << offset << std::endl);
-          }
-          else randFrameSize += update;
-          frameSize += update;
-          maxFrameSize = std::max(frameSize, maxFrameSize);
-          maxRandFrameSize = std::max(randFrameSize, maxRandFrameSize);
-        }
-      }
-
-      // If we changed anything, re-encode the instruction.  Note that
-      // randomization *may* change the size of individual instructions; the net
-      // code size *must* be identical.
-      if(changed) {
-        // The instruction's raw bits are currently pointing to the last version
-        // of the buffer.  We need to do the following things:
-        //
-        //   1. Point the instruction's raw bits to the current buffer and mark
-        //      them as invalid so that DynamoRIO *actually* re-encodes them
-        //   2. Encode the changed instruction into the new buffer
-        //   3. Point the instruction's raw bits back to the new buffer (which
-        //      sets them as valid), because apparently re-encoding does not do
-        //      this (probably because we're encoding to a copy).
-        //
-        // The last task is required because at the next randomization when we
-        // call instr_length() above, if the bits are not marked valid DynamoRIO
-        // will re-encode the instruction (potentially in a different format) and
-        // may change the instruction's size.
-        prev = cur;
-        instr_set_raw_bits(instr, cur, instrSize);
-        instr_set_raw_bits_valid(instr, false);
-        cur = instr_encode_to_copy(GLOBAL_DCONTEXT, instr, cur, real);
-        if(!cur) {
-          WARN("re-encoding changed instruction failed" << std::endl);
-          return ret_t::RandomizeFailed;
-        }
-        instr_set_raw_bits(instr, prev, cur - prev);
-
-        DEBUG_VERBOSE(
-          if(instrSize != (cur - prev))
-            DEBUGMSG_VERBOSE(" -> changed size of instruction: " << instrSize
-                             << " vs. " << (cur - prev) << std::endl);
-          DEBUGMSG_INSTR(" -> rewrote: size = " << (size_t)(cur - prev) << " ",
-                         instr)
-        );
-
-        count++;
-        instrSize = cur - prev;
+      if(reencode) {
+        sites.resize(firstSite);
+        sites.push_back({ (uint32_t)(instrRunIt - instrs.begin()),
+                          (uint32_t)(instrIt - instrRunIt->instrs.begin()),
+                          (uint32_t)(start - funcData[0]), 0, 0, 0, true });
       }
-      else cur += instrSize;
-      real += instrSize;
     }
 
     if(real != instrRunIt->endAddr) {
@@ -1655,28 +4027,146 @@ ret_t CodeTransformer::randomizeFunction(RandomizedFunctionPtr &info,
     }
   }
 
-  DEBUGMSG("rewrote " << count << " instruction(s)" << std::endl);
+  // Patch sites assume instructions sit at the same place in every
+  // randomization; keep walking the function if any changed size
+  DEBUGMSG("rewrote function, " << (sameSize ? "recorded " : "discarded ")
+           << sites.size() << " patch site(s)" << std::endl);
+  if(sameSize) info->setPatchSites(std::move(sites));
 
   return ret_t::Success;
 }
 
-ret_t CodeTransformer::randomizeFunctions(MemoryWindow &buffer) {
+ret_t CodeTransformer::randomizeFunction(RandomizedFunctionPtr &info,
+                                         MemoryWindow &buffer,
+                                         std::random_device &seeds) {
+  ret_t code = randomizeSlots(info, seeds);
+  if(code != ret_t::Success) return code;
+  return rewriteFunction(info, buffer);
+}
+
+RandomizedFunctionPtr *
+CodeTransformer::nextScrambleFunction(ScrambleWorker &worker) {
+  size_t i, numWorkers = scrambleWorkers.size();
+  RandomizedFunctionPtr *info = nullptr;
+
+  pthread_mutex_lock(&worker.lock);
+  if(worker.next < worker.end) info = scrambleOrder[worker.next++];
+  pthread_mutex_unlock(&worker.lock);
+
+  // Our queue is empty, steal from the back of somebody else's queue
+  for(i = 1; !info && i < numWorkers; i++) {
+    ScrambleWorker &victim = *scrambleWorkers[(worker.id + i) % numWorkers];
+    pthread_mutex_lock(&victim.lock);
+    if(victim.next < victim.end) info = scrambleOrder[--victim.end];
+    pthread_mutex_unlock(&victim.lock);
+  }
+
+  return info;
+}
+
+bool CodeTransformer::shouldScramble(uintptr_t addr) const {
+  ssize_t idx;
+
+  if(addr < scrambleRange.first || addr >= scrambleRange.second) return false;
+  if(scrambleSelected.empty()) return true;
+  idx = findIndexedFunction(functionStarts, functionIndex, addr);
+  return idx >= 0 && scrambleSelected[idx];
+}
+
+void CodeTransformer::selectHotFunctions(const urange_t &range) {
+  size_t i, samples;
+
+  scrambleSelected.resize(functionIndex.size());
+  lastScrambled.resize(functionIndex.size(), 0);
+  for(i = 0; i < functionIndex.size(); i++) {
+    if(functionStarts[i] < range.first || functionStarts[i] >= range.second) {
+      scrambleSelected[i] = false;
+      continue;
+    }
+
+    samples = __atomic_exchange_n(&functionIndex[i].samples, 0,
+                                  __ATOMIC_RELAXED);
+    scrambleSelected[i] = samples ||
+                          scrambleGeneration - lastScrambled[i] >= coldPeriod;
+    if(scrambleSelected[i]) {
+      lastScrambled[i] = scrambleGeneration;
+      scrambledFunctions++;
+    }
+  }
+}
+
+void CodeTransformer::scrambleFunctions(ScrambleWorker &worker) {
+  RandomizedFunctionPtr *info;
+  const function_record *func;
+
+  while(!__atomic_load_n(&scrambleFailed, __ATOMIC_ACQUIRE) &&
+        (info = nextScrambleFunction(worker))) {
+    func = (*info)->getFunctionRecord();
+    if(!shouldScramble(func->addr)) continue;
+
+    DEBUG_VERBOSE(
+      DEBUGMSG_VERBOSE("worker " << worker.id << " randomizing function @ "
+                       << std::hex << func->addr << std::endl);
+    )
+    worker.code = randomizeFunction(*info, *scrambleBuffer, worker.rng);
+    if(worker.code != ret_t::Success) {
+      __atomic_store_n(&scrambleFailed, true, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+}
+
+void CodeTransformer::runScrambleWorker(ScrambleWorker &worker) {
+  while(true) {
+    if(MASK_INT(sem_wait(&scrambleStart))) break;
+    if(scrambleWorkersExit) break;
+    scrambleFunctions(worker);
+    if(sem_post(&scrambleDone)) break;
+  }
+}
+
+ret_t CodeTransformer::randomizeFunctions(MemoryWindow &buffer,
+                                          const urange_t &range) {
+  const function_record *func;
   ret_t code;
 #ifdef DEBUG_BUILD
   Timer t;
 #endif
 
+  scrambleRange = range;
+  if(scrambleWorkers.size() > 1) {
+    // Refill the workers' queues & kick them off; we're worker 0.  The
+    // semaphores order the queue updates against the workers' accesses.
+    for(auto &worker : scrambleWorkers) {
+      worker->next = worker->first;
+      worker->end = worker->last;
+      worker->code = ret_t::Success;
+    }
+    scrambleBuffer = &buffer;
+    scrambleFailed = false;
+    for(size_t i = 1; i < scrambleWorkers.size(); i++)
+      if(sem_post(&scrambleStart)) return ret_t::SemaphoreFailed;
+    scrambleFunctions(*scrambleWorkers[0]);
+    for(size_t i = 1; i < scrambleWorkers.size(); i++)
+      if(MASK_INT(sem_wait(&scrambleDone))) return ret_t::SemaphoreFailed;
+
+    for(auto &worker : scrambleWorkers)
+      if(worker->code != ret_t::Success) return worker->code;
+    return ret_t::Success;
+  }
+
   for(auto &it : functions) {
     RandomizedFunctionPtr &info = it.second;
+    func = info->getFunctionRecord();
+    if(!shouldScramble(func->addr)) continue;
 
     DEBUG(
-      const function_record *func = info->getFunctionRecord();
       DEBUGMSG("randomizing function @ " << std::hex << func->addr
                << ", size = " << std::dec << func->code_size << std::endl);
     )
     DEBUG_VERBOSE(t.start());
 
-    code = randomizeFunction(info, buffer);
+    code = randomizeFunction(info, buffer, rng);
     if(code != ret_t::Success) return code;
 
     DEBUG_VERBOSE(
@@ -1,4 +1,5 @@
 #include <cerrno>
+#include <sched.h>
 #include <syscall.h>
 #include <unistd.h>
 #include <linux/futex.h>
@@ -7,6 +8,25 @@
 
 using namespace chameleon;
 
+uint64_t chameleon::hashBytes(const void *data, size_t len, uint64_t hash) {
+  const unsigned char *cur = (const unsigned char *)data;
+  for(size_t i = 0; i < len; i++) {
+    hash ^= cur[i];
+    hash *= 0x100000001b3UL;
+  }
+  return hash;
+}
+
+size_t chameleon::usableCPUs() {
+  cpu_set_t cpus;
+  long online;
+
+  if(!sched_getaffinity(0, sizeof(cpus), &cpus) && CPU_COUNT(&cpus) > 0)
+    return CPU_COUNT(&cpus);
+  online = sysconf(_SC_NPROCESSORS_ONLN);
+  return online > 0 ? online : 1;
+}
+
 ret_t chameleon::syncWait(int *key, int val) {
   int ret = MASK_INT(syscall(SYS_futex, key, FUTEX_WAIT, val,
                              nullptr, nullptr, 0));